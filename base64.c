@@ -0,0 +1,110 @@
+/*
+ * File: base64.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+#include "base64.h"
+
+#define BASE64_PADDING '='
+#define BASE64_INVALID -1
+
+static const char g_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @brief Gets value of base64 character.
+ *
+ * @param symbol    character.
+ * @return int      value (0-63), or BASE64_INVALID.
+ */
+int symbolValue(char symbol)
+{
+    if (symbol >= 'A' && symbol <= 'Z')
+        return symbol - 'A';
+    if (symbol >= 'a' && symbol <= 'z')
+        return symbol - 'a' + 26;
+    if (symbol >= '0' && symbol <= '9')
+        return symbol - '0' + 52;
+    if (symbol == '+')
+        return 62;
+    if (symbol == '/')
+        return 63;
+
+    return BASE64_INVALID;
+}
+
+/**
+ * @brief Encodes data to base64 (with padding).
+ *
+ * @param data      data.
+ * @param length    data length.
+ * @param output    output, must fit BASE64_ENCODED_LEN(length) + 1 characters.
+ * @return size_t   encoded length.
+ */
+size_t base64Encode(const void *data, size_t length, char *output)
+{
+    const uint8_t *bytes = data;
+    char *start = output;
+    uint32_t chunk;
+
+    for (size_t i = 0; i < length; i += 3)
+    {
+        chunk = bytes[i] << 16;
+        if (i + 1 < length)
+            chunk |= bytes[i + 1] << 8;
+        if (i + 2 < length)
+            chunk |= bytes[i + 2];
+
+        *output++ = g_alphabet[(chunk >> 18) & 0x3F];
+        *output++ = g_alphabet[(chunk >> 12) & 0x3F];
+        *output++ = i + 1 < length ? g_alphabet[(chunk >> 6) & 0x3F] : BASE64_PADDING;
+        *output++ = i + 2 < length ? g_alphabet[chunk & 0x3F] : BASE64_PADDING;
+    }
+
+    *output = 0;
+
+    return output - start;
+}
+
+/**
+ * @brief Decodes base64 string. Decoding stops at padding or string end.
+ *
+ * @param input     base64 string.
+ * @param output    output.
+ * @param maxLength output size.
+ * @return int      decoded length, -1 on invalid character or when output is too small.
+ */
+int base64Decode(const char *input, uint8_t *output, size_t maxLength)
+{
+    uint32_t chunk = 0;
+    size_t length = 0;
+    int bits = 0;
+    int value;
+
+    for (; *input && *input != BASE64_PADDING; input++)
+    {
+        value = symbolValue(*input);
+        if (value == BASE64_INVALID)
+            return -1;
+
+        chunk = (chunk << 6) | value;
+        bits += 6;
+
+        if (bits < 8)
+            continue;
+
+        bits -= 8;
+        if (length == maxLength)
+            return -1;
+        output[length++] = chunk >> bits;
+    }
+
+    return length;
+}
@@ -0,0 +1,22 @@
+/*
+ * File: base64.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef BASE64_H
+#define BASE64_H
+
+/**
+ * @brief Length of encoded data, without terminating zero.
+ */
+#define BASE64_ENCODED_LEN(length) (((length) + 2) / 3 * 4)
+
+size_t base64Encode(const void *data, size_t length, char *output);
+int base64Decode(const char *input, uint8_t *output, size_t maxLength);
+
+#endif
@@ -8,12 +8,149 @@
  * Copyright 2022 - 2023 M.Kusiak (timax)
  */
 
+/*
+ * Interrupt driven button.
+ *
+ * First edge starts debounce alarm, further edges within debounce time are just
+ * counted as bounces. When the alarm fires, pin level is compared with last stable
+ * state, and press or release goes into the event queue, timestamped with the first edge.
+ * Queue has single producer (interrupts) and single consumer (main loop), so it needs no locks.
+ */
+
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "button.h"
+
+/*
+ * Must be a power of 2.
+ */
+#define BUTTON_QUEUE_LEN 16
+#define BUTTON_EDGES (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL)
+
+static uint8_t g_pin;
+static bool g_state;
+static uint32_t g_edgeTime;
+static alarm_id_t g_debounceAlarm;
+static alarm_id_t g_longPressAlarm;
+static buttonCallback_t g_callback;
+
+static buttonEvent_t g_queue[BUTTON_QUEUE_LEN];
+static volatile uint8_t g_queueHead;
+static volatile uint8_t g_queueTail;
+
+static volatile uint32_t g_presses;
+static volatile uint32_t g_bounced;
+static volatile uint32_t g_missed;
+
+/**
+ * @brief Puts event into the queue. Called from interrupts only.
+ *
+ * @param type event type.
+ * @param time event time, in miliseconds since boot.
+ */
+void queuePush(buttonEventType_t type, uint32_t time)
+{
+    uint8_t next = (g_queueHead + 1) & (BUTTON_QUEUE_LEN - 1);
+
+    if (next == g_queueTail)
+    {
+        g_missed++;
+        return;
+    }
+
+    g_queue[g_queueHead].type = type;
+    g_queue[g_queueHead].time = time;
+    __dmb();
+    g_queueHead = next;
+
+    if (g_callback)
+        g_callback();
+}
+
+/**
+ * @brief Reports long press, if button is still held.
+ *
+ * @param id        alarm id.
+ * @param userData  not used.
+ * @return int64_t  0, alarm is not rescheduled.
+ */
+int64_t longPressAlarmCallback(alarm_id_t id, void *userData)
+{
+    g_longPressAlarm = 0;
+
+    if (g_state)
+        queuePush(BUTTON_EVENT_LONG_PRESS, to_ms_since_boot(get_absolute_time()));
+
+    return 0;
+}
+
+/**
+ * @brief Samples settled pin, and reports the change.
+ * Level equal to the last stable state means edges were just noise.
+ *
+ * @param id        alarm id.
+ * @param userData  not used.
+ * @return int64_t  0, alarm is not rescheduled.
+ */
+int64_t debounceAlarmCallback(alarm_id_t id, void *userData)
+{
+    bool state = gpio_get(g_pin);
+
+    g_debounceAlarm = 0;
+
+    if (state == g_state)
+    {
+        g_bounced++;
+        return 0;
+    }
+
+    g_state = state;
+
+    if (state)
+    {
+        g_presses++;
+        queuePush(BUTTON_EVENT_PRESS, g_edgeTime);
+        g_longPressAlarm = add_alarm_in_ms(BUTTON_LONG_PRESS_TIME, longPressAlarmCallback, NULL, true);
+    }
+    else
+    {
+        if (g_longPressAlarm > 0)
+            cancel_alarm(g_longPressAlarm);
+        g_longPressAlarm = 0;
+        queuePush(BUTTON_EVENT_RELEASE, g_edgeTime);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief GPIO interrupt handler. Starts debouncing on the first edge.
+ */
+void buttonGpioHandler()
+{
+    uint32_t events = gpio_get_irq_event_mask(g_pin) & BUTTON_EDGES;
+
+    if (!events)
+        return;
+
+    gpio_acknowledge_irq(g_pin, events);
+
+    if (g_debounceAlarm > 0)
+    {
+        g_bounced++;
+        return;
+    }
+
+    g_edgeTime = to_ms_since_boot(get_absolute_time());
+    g_debounceAlarm = add_alarm_in_ms(BUTTON_DEBOUNCE_TIME, debounceAlarmCallback, NULL, true);
+}
 
 /**
- * @brief Configure a button pin.
+ * @brief Configure a button pin. Presses are reported through the event queue.
  *
  * @param buttonPin button pin.
  */
@@ -22,6 +159,43 @@ void buttonSet(uint8_t buttonPin)
     gpio_init(buttonPin);
     gpio_set_dir(buttonPin, GPIO_IN);
     gpio_pull_down(buttonPin);
+
+    g_pin = buttonPin;
+    g_state = gpio_get(buttonPin);
+
+    gpio_add_raw_irq_handler(buttonPin, buttonGpioHandler);
+    gpio_set_irq_enabled(buttonPin, BUTTON_EDGES, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+/**
+ * @brief Sets function called when event is queued.
+ * It's called from interrupt, so it must be short.
+ *
+ * @param callback callback.
+ */
+void buttonSetCallback(buttonCallback_t callback)
+{
+    g_callback = callback;
+}
+
+/**
+ * @brief Takes event from the queue. Must be called from main loop only.
+ *
+ * @param event     event to write to.
+ * @return true     event taken.
+ * @return false    queue empty.
+ */
+bool buttonEventPop(buttonEvent_t *event)
+{
+    if (g_queueTail == g_queueHead)
+        return false;
+
+    *event = g_queue[g_queueTail];
+    __dmb();
+    g_queueTail = (g_queueTail + 1) & (BUTTON_QUEUE_LEN - 1);
+
+    return true;
 }
 
 /**
@@ -33,4 +207,15 @@ void buttonSet(uint8_t buttonPin)
 bool buttonReadState(uint8_t buttonPin)
 {
     return gpio_get(buttonPin);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Prints button statistics on serial.
+ */
+void buttonPrintStats()
+{
+    printf("PRESSES: %lu\n"
+           "BOUNCED: %lu\n"
+           "MISSED: %lu\n",
+           g_presses, g_bounced, g_missed);
+}
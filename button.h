@@ -11,7 +11,28 @@
 #ifndef BUTTON_H
 #define BUTTON_H
 
+#define BUTTON_DEBOUNCE_TIME 10
+#define BUTTON_LONG_PRESS_TIME 1000
+
+typedef enum
+{
+    BUTTON_EVENT_PRESS,
+    BUTTON_EVENT_RELEASE,
+    BUTTON_EVENT_LONG_PRESS
+} buttonEventType_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint32_t time;
+} buttonEvent_t;
+
+typedef void (*buttonCallback_t)();
+
 void buttonSet(uint8_t buttonPin);
+void buttonSetCallback(buttonCallback_t callback);
+bool buttonEventPop(buttonEvent_t *event);
 bool buttonReadState(uint8_t buttonPin);
+void buttonPrintStats();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,96 @@
+/*
+ * File: cobs.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Consistent Overhead Byte Stuffing. Encoded data contains no zero bytes,
+ * so zero can delimit frames on the serial line.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+#include "cobs.h"
+
+#define COBS_BLOCK_MAX 0xFF
+
+/**
+ * @brief Encodes data with COBS. Delimiters are not added.
+ *
+ * @param data      data.
+ * @param length    data length.
+ * @param output    output, must fit COBS_ENCODED_LEN(length) bytes.
+ * @return size_t   encoded length.
+ */
+size_t cobsEncode(const void *data, size_t length, uint8_t *output)
+{
+    const uint8_t *bytes = data;
+    uint8_t *code = output;
+    uint8_t *next = output + 1;
+    uint8_t block = 1;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (bytes[i])
+        {
+            *next++ = bytes[i];
+            block++;
+        }
+
+        if (!bytes[i] || block == COBS_BLOCK_MAX)
+        {
+            *code = block;
+            code = next++;
+            block = 1;
+        }
+    }
+
+    *code = block;
+
+    return next - output;
+}
+
+/**
+ * @brief Decodes COBS data, without delimiters.
+ *
+ * @param input     encoded data.
+ * @param length    encoded length.
+ * @param output    output.
+ * @param maxLength output size.
+ * @return int      decoded length, -1 on malformed data or when output is too small.
+ */
+int cobsDecode(const uint8_t *input, size_t length, uint8_t *output, size_t maxLength)
+{
+    size_t decoded = 0;
+    size_t i = 0;
+    uint8_t block;
+
+    while (i < length)
+    {
+        block = input[i++];
+        if (!block || i + block - 1 > length)
+            return -1;
+
+        for (int j = 1; j < block; j++)
+        {
+            if (!input[i] || decoded == maxLength)
+                return -1;
+            output[decoded++] = input[i++];
+        }
+
+        if (block != COBS_BLOCK_MAX && i < length)
+        {
+            if (decoded == maxLength)
+                return -1;
+            output[decoded++] = 0;
+        }
+    }
+
+    return decoded;
+}
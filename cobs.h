@@ -0,0 +1,22 @@
+/*
+ * File: cobs.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef COBS_H
+#define COBS_H
+
+/**
+ * @brief Worst case length of encoded data, without delimiters.
+ */
+#define COBS_ENCODED_LEN(length) ((length) + (length) / 254 + 1)
+
+size_t cobsEncode(const void *data, size_t length, uint8_t *output);
+int cobsDecode(const uint8_t *input, size_t length, uint8_t *output, size_t maxLength);
+
+#endif
@@ -9,27 +9,42 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
+#include "pico/flash.h"
 #include "hardware/sync.h"
 
 #include "dictionary.h"
 #include "serial.h"
 #include "config.h"
 #include "servo.h"
+#include "button.h"
+#include "led.h"
+#include "crc.h"
+#include "base64.h"
+#include "profiler.h"
+#include "event.h"
+#include "protocol.h"
+#include "telemetry.h"
+#include "log.h"
+#include "group.h"
+#include "ota.h"
+#include "journal.h"
 
 #define CONFIG_SEPARATOR 1
 #define CONFIG_MODE_LEN 3
 #define CONFIG_SETTING_BEGIN (CONFIG_MODE_LEN + CONFIG_SEPARATOR)
 #define CONFIG_SETTING_LEN 4
 #define CONFIG_VALUE_BEGIN (CONFIG_SETTING_BEGIN + CONFIG_SETTING_LEN + CONFIG_SEPARATOR)
-#define CONFIG_VALUE_LEN (SERIAL_MAX_INCOME_LEN - CONFIG_VALUE_BEGIN)
 
 #define CONFIG_MESSAGE_MODE_UNSUPPORTED "MODE UNSUPPORTED"
 #define CONFIG_MESSAGE_SETTING_UNSUPPORTED "SETTING UNSUPPORTED"
 #define CONFIG_MESSAGE_SUCCESS "SUCCESS"
+#define CONFIG_MESSAGE_FAILURE "FAILURE"
 
 #define CONFIG_DEFAULT_SSID "NETWORK SSID"
 #define CONFIG_DEFAULT_PASSWORD "NETWORK PASSWORD"
@@ -43,286 +58,1514 @@
 /**
  * @brief This is 2MB (Pico flash memory size) - 4KB (Block size) in bytes.
  * In other words, this is the offset to last writable memory sector.
+ * Configuration used to be stored there as is, now it's only read when there's no log.
  */
 #define MEMORY_OFFSET 2093056
 
+/*
+ * Configuration log. Every save appends a record (header and configuration)
+ * to the sectors right below the old configuration sector. Sector is erased
+ * only when the log moves into it, the newest record with valid CRC wins.
+ */
+#define CONFIG_LOG_SECTORS 4
+#define CONFIG_LOG_OFFSET (MEMORY_OFFSET - CONFIG_LOG_SECTORS * FLASH_SECTOR_SIZE)
+#define CONFIG_LOG_MAGIC 0x4B4C494B
+#define CONFIG_RECORD_SIZE ((sizeof(configRecordHeader_t) + CONFIG_STRUCT_SIZE + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+#define CONFIG_RECORDS_PER_SECTOR (FLASH_SECTOR_SIZE / CONFIG_RECORD_SIZE)
+#define CONFIG_RECORDS_COUNT (CONFIG_LOG_SECTORS * CONFIG_RECORDS_PER_SECTOR)
+#define CONFIG_RECORD_NONE -1
+
+_Static_assert(JOURNAL_OFFSET + JOURNAL_SECTORS * FLASH_SECTOR_SIZE <= CONFIG_LOG_OFFSET,
+               "update state and actuator journal must not overlap configuration log");
+
+/*
+ * Changes are written to flash once there were none for this long, or on "SET CMIT".
+ */
+#define CONFIG_COMMIT_DELAY 3000
+#define CONFIG_FLASH_TIMEOUT 100
+
+/*
+ * Configuration blob ("GET BLOB" / "SET BLOB") is a header followed by configuration, in base64.
+ * Bump format version when the header changes. Configuration itself is versioned on its own,
+ * blobs from older firmware are upgraded on import.
+ */
+#define CONFIG_BLOB_MAGIC 0x47464E43
+#define CONFIG_BLOB_FORMAT 1
+#define CONFIG_BLOB_SIZE (sizeof(configBlobHeader_t) + CONFIG_STRUCT_SIZE)
+
 /**
- * @brief This is enum for storing settings (configuration entries)
+ * @brief Configuration blob header. CRC covers configuration only.
  */
-typedef enum
+typedef struct __attribute__((packed))
 {
-    SETTING_SSID,
-    SETTING_PASSWORD,
-    SETTING_USERNAME,
-    SETTING_FEED_NAME,
-    SETTING_API_KEY,
-    SETTING_ANGLE_MAX,
-    SETTING_MESSAGE,
-    SETTING_ALL,
-    SETTING_UNDEFINED
-} setting_t;
+    uint32_t magic;
+    uint8_t format;
+    uint8_t configVersion;
+    uint16_t length;
+    uint32_t crc;
+} configBlobHeader_t;
+
+/**
+ * @brief Flash operation, carried out by flashWrite().
+ */
+typedef struct
+{
+    uint32_t offset;
+    const uint8_t *data;
+    bool erase;
+} configFlashWrite_t;
 
 /**
- * @brief This is dictionary that binds setting (configuration entry) with setting string.
+ * @brief Configuration log record header. CRC covers sequence, length and data.
  */
-dictionary_t settingsDictionary[] = {
-    {SETTING_SSID, "SSID"},
-    {SETTING_PASSWORD, "PASS"},
-    {SETTING_USERNAME, "USRN"},
-    {SETTING_FEED_NAME, "FNME"},
-    {SETTING_API_KEY, "APIK"},
-    {SETTING_ANGLE_MAX, "ANGL"},
-    {SETTING_MESSAGE, "MESS"},
-    {SETTING_ALL, "CONF"},
-    {SETTING_UNDEFINED, NULL}};
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    uint32_t crc;
+} configRecordHeader_t;
+
+/*
+ * Modes, settings and profiler commands are dispatched by integer keys,
+ * their characters packed little endian, so "SSID" is CONFIG_KEY('S', 'S', 'I', 'D').
+ */
+#define CONFIG_KEY(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+/*
+ * Setting kinds for the registry, see CONFIG_SETTINGS().
+ */
+#define CONFIG_FIELD(field) .offset = offsetof(config_t, field), .size = sizeof(((config_t *)0)->field)
+#define CONFIG_STRING(field) .type = CONFIG_TYPE_STRING, CONFIG_FIELD(field)
+#define CONFIG_NUMBER(field, minimum, maximum) .type = CONFIG_TYPE_NUMBER, CONFIG_FIELD(field), .min = minimum, .max = maximum
+#define CONFIG_CHOICE(field, dictionary) .type = CONFIG_TYPE_CHOICE, CONFIG_FIELD(field), .choices = dictionary
+#define CONFIG_CUSTOM(printer, parser, settingFlags) .type = CONFIG_TYPE_CUSTOM, .print = printer, .parse = parser, .flags = settingFlags
+#define CONFIG_STATS(printer) .type = CONFIG_TYPE_STATS, .stats = printer
+#define CONFIG_ALL() .type = CONFIG_TYPE_ALL
+
+/*
+ * Setting is written to flash right away, rather than after the quiet period.
+ */
+#define CONFIG_FLAG_COMMIT 0x01
+/*
+ * Setting is left out of "GET CONF".
+ */
+#define CONFIG_FLAG_UNLISTED 0x02
 
 /**
- * @brief  Configuration modes. Supported modes are GET and SET.
+ * @brief Setting types. Only types up to CONFIG_TYPE_CUSTOM can be set.
  */
 typedef enum
 {
-    CONFIG_MODE_GET,
-    CONFIG_MODE_SET,
-    CONFIG_MODE_RESET,
-    CONFIG_MODE_UNSUPPORTED
-} config_mode_t;
+    CONFIG_TYPE_STRING,
+    CONFIG_TYPE_NUMBER,
+    CONFIG_TYPE_CHOICE,
+    CONFIG_TYPE_CUSTOM,
+    CONFIG_TYPE_STATS,
+    CONFIG_TYPE_ALL
+} configType_t;
+
+/**
+ * @brief Setting registry entry. Plain settings point at their config_t field,
+ *        custom ones have their own print and parse handlers.
+ */
+typedef struct
+{
+    uint32_t key;
+    configType_t type;
+    uint8_t flags;
+    uint16_t offset;
+    uint16_t size;
+    uint16_t min;
+    uint16_t max;
+    dictionary_t *choices;
+    void (*print)(config_t *config);
+    bool (*parse)(config_t *config, char *value);
+    void (*stats)();
+} configSetting_t;
 
 /**
- * @brief Mode dictionary. It binds mode with string.
+ * @brief Motion profile dictionary. It binds servo motion profile with string.
  */
-dictionary_t modeDictionary[] = {
-    {CONFIG_MODE_GET, "GET"},
-    {CONFIG_MODE_SET, "SET"},
-    {CONFIG_MODE_RESET, "RST"},
-    {CONFIG_MODE_UNSUPPORTED, NULL}};
+dictionary_t profileDictionary[] = {
+    {SERVO_PROFILE_NONE, "NONE"},
+    {SERVO_PROFILE_TRAPEZOID, "TRAP"},
+    {SERVO_PROFILE_S_CURVE, "SCRV"},
+    {SERVO_PROFILE_UNDEFINED, NULL}};
+
+static config_t g_config;
+static bool g_loaded;
+static volatile bool g_dirty;
+static volatile bool g_commitRequested;
+static uint32_t g_changeTime;
+/*
+ * Blob being printed, imported or transferred over binary protocol.
+ */
+static uint8_t g_blob[CONFIG_BLOB_SIZE];
 
 /**
- * @brief Gets configuration mode based on configuration string.
+ * @brief Packs up to given number of characters into integer key, see CONFIG_KEY().
+ * Characters past the end of the string are zero.
  *
- * @param string            configuration string.
- * @return config_mode_t    configuration mode (CONFIG_MODE_[...]).
+ * @param string        configuration string part.
+ * @param length        key length, at most 4.
+ * @return uint32_t     key.
  */
-config_mode_t getMode(char *string)
+uint32_t getKey(const char *string, int length)
 {
-    static char mode[CONFIG_MODE_LEN + 1];
-    memset(mode, 0, CONFIG_MODE_LEN + 1);
-    strncpy(mode, string, CONFIG_MODE_LEN);
+    uint32_t key = 0;
+
+    for (int i = 0; i < length && string[i]; i++)
+        key |= (uint32_t)(uint8_t)string[i] << (8 * i);
 
-    return dictionaryGetEntry(modeDictionary, mode);
+    return key;
 }
 
 /**
- * @brief Gets setting (configuration entry) based on configuration string.
+ * @brief Gets setting value from configuration string. Value is not copied.
  *
- * @param string            configuration string.
- * @return setting_t    setting (SETTING_[...]).
+ * @param string configuration string.
+ * @return char* setting value, empty when there's none.
  */
-setting_t getSetting(char *string)
+char *getValue(char *string)
 {
-    static char setting[CONFIG_SETTING_LEN + 1];
-    strncpy(setting, &string[CONFIG_SETTING_BEGIN], CONFIG_SETTING_LEN);
+    if (strlen(string) <= CONFIG_VALUE_BEGIN)
+        return "";
 
-    return dictionaryGetEntry(settingsDictionary, setting);
+    return &string[CONFIG_VALUE_BEGIN];
 }
 
 /**
- * @brief Gets setting value from configuration string.
+ * @brief Parses decimal number and checks its bounds.
  *
- * @param string configuration string.
- * @return char* setting value.
+ * @param value     setting value.
+ * @param min       lowest accepted number.
+ * @param max       highest accepted number.
+ * @param number    parsed number.
+ * @return true     number parsed.
+ * @return false    value malformed or out of bounds.
  */
-char *getValue(char *string)
+bool parseNumber(char *value, long min, long max, uint32_t *number)
+{
+    char *next;
+    long parsed = strtol(value, &next, 10);
+
+    if (next == value || (*next && !isspace((unsigned char)*next)) || parsed < min || parsed > max)
+        return false;
+
+    *number = parsed;
+    return true;
+}
+
+/**
+ * @brief Prints servo channel table.
+ *
+ * @param config configuration.
+ */
+void printChannels(config_t *config)
+{
+    configChannel_t *channel;
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        channel = &config->channels[i];
+
+        if (channel->pin == CONFIG_CHANNEL_PIN_NONE)
+            printf("CHANNEL %d: OFF\n", i);
+        else
+            printf("CHANNEL %d: PIN %d, ANGLE %d, FEED %s\n", i, channel->pin,
+                   channel->angleMax ? channel->angleMax : config->angleMax,
+                   channel->feedName[0] ? channel->feedName : config->feedName);
+    }
+}
+
+/**
+ * @brief Checks if channel can drive the pin. Pins of the LED, button, uart
+ *        and wireless chip are taken, and so are the ones of other channels.
+ *
+ * @param config    configuration.
+ * @param index     channel index.
+ * @param pin       pin, CONFIG_CHANNEL_PIN_NONE is always allowed.
+ * @return true     pin free.
+ */
+bool channelPinAllowed(config_t *config, int index, long pin)
+{
+    static const uint8_t reserved[] = {PICO_DEFAULT_UART_TX_PIN, PICO_DEFAULT_UART_RX_PIN,
+                                       CONFIG_LED_RED_PIN, CONFIG_LED_GREEN_PIN, CONFIG_LED_BLUE_PIN,
+                                       CONFIG_BUTTON_PIN, CYW43_DEFAULT_PIN_WL_REG_ON, CYW43_DEFAULT_PIN_WL_DATA_OUT,
+                                       CYW43_DEFAULT_PIN_WL_CS, CYW43_DEFAULT_PIN_WL_CLOCK};
+
+    if (pin == CONFIG_CHANNEL_PIN_NONE)
+        return true;
+    if (pin < 0 || pin >= CONFIG_PINS_COUNT)
+        return false;
+
+    for (int i = 0; i < sizeof reserved; i++)
+    {
+        if (pin == reserved[i])
+            return false;
+    }
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        if (i != index && config->channels[i].pin == pin)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Sets servo channel from "<channel> <pin> [angle] [feed]" value.
+ *        Pin 255 disables the channel, angle 0 and no feed mean ANGL and FNME.
+ *        Channels are set up at start, so changes apply after restart.
+ *
+ * @param config    configuration.
+ * @param value     setting value.
+ * @return true     channel set.
+ * @return false    value malformed, or pin taken.
+ */
+bool parseChannel(config_t *config, char *value)
+{
+    configChannel_t *channel;
+    char *next;
+    long index, pin, angle;
+
+    index = strtol(value, &next, 10);
+    if (next == value || index < 0 || index >= CONFIG_CHANNELS_MAX)
+        return false;
+
+    value = next;
+    pin = strtol(value, &next, 10);
+    if (next == value || (*next && *next != ' ') || !channelPinAllowed(config, index, pin))
+        return false;
+
+    /*
+     * Angle is a number on its own, feed name can start with digits too.
+     */
+    value = next;
+    angle = strtol(value, &next, 10);
+    if (next != value && *next && *next != ' ')
+    {
+        angle = 0;
+        next = value;
+    }
+    if (angle < 0 || angle > SERVO_MAX_ANGLE)
+        return false;
+
+    while (*next == ' ')
+        next++;
+
+    channel = &config->channels[index];
+    channel->pin = pin;
+    channel->angleMax = angle;
+    memset(channel->feedName, 0, sizeof channel->feedName);
+    strncpy(channel->feedName, next, CONFIG_CHANNEL_FEED_LEN);
+
+    return true;
+}
+
+/**
+ * @brief Prints macros, in the same form they are set.
+ *
+ * @param config configuration.
+ */
+void printMacros(config_t *config)
+{
+    servoMacroStep_t *step;
+
+    for (int i = 0; i < CONFIG_MACROS_MAX; i++)
+    {
+        printf("MACRO %d:", i);
+
+        for (int j = 0; j < SERVO_MACRO_STEPS_MAX; j++)
+        {
+            step = &config->macros[i][j];
+
+            if (step->op == SERVO_MACRO_MOVE)
+                printf(" M%d:%d", step->arg, step->time);
+            else if (step->op == SERVO_MACRO_WAIT)
+                printf(" W%d", step->time);
+            else if (step->op == SERVO_MACRO_REPEAT)
+                printf(" R%d:%d", step->arg, step->time);
+            else
+                break;
+        }
+
+        printf("\n");
+    }
+}
+
+/**
+ * @brief Sets macro from "<macro> [steps]" value and hands it over to servo motion engine.
+ *        Steps are separated with spaces: "M<angle>:<ms>" moves to angle, taking at least ms,
+ *        "W<ms>" waits, "R<count>:<step>" goes back to step, count more times.
+ *        No steps clear the macro.
+ *
+ * @param config    configuration.
+ * @param value     setting value.
+ * @return true     macro set.
+ * @return false    value malformed.
+ */
+bool parseMacro(config_t *config, char *value)
+{
+    servoMacroStep_t steps[SERVO_MACRO_STEPS_MAX];
+    servoMacroStep_t *step;
+    char *next;
+    long index, arg, time;
+    int count = 0;
+
+    memset(steps, 0, sizeof steps);
+
+    index = strtol(value, &next, 10);
+    if (next == value || index < 0 || index >= CONFIG_MACROS_MAX)
+        return false;
+
+    value = next;
+
+    while (true)
+    {
+        while (*value == ' ')
+            value++;
+        if (!*value)
+            break;
+        if (count == SERVO_MACRO_STEPS_MAX)
+            return false;
+
+        step = &steps[count++];
+
+        switch (toupper((unsigned char)*value++))
+        {
+        case 'M':
+            step->op = SERVO_MACRO_MOVE;
+            break;
+        case 'W':
+            step->op = SERVO_MACRO_WAIT;
+            break;
+        case 'R':
+            step->op = SERVO_MACRO_REPEAT;
+            break;
+        default:
+            return false;
+        }
+
+        if (step->op != SERVO_MACRO_WAIT)
+        {
+            arg = strtol(value, &next, 10);
+            if (next == value || *next != ':' || arg < 0 || arg > UINT8_MAX)
+                return false;
+            step->arg = arg;
+            value = next + 1;
+        }
+
+        time = strtol(value, &next, 10);
+        if (next == value || time < 0 || time > UINT16_MAX || (*next && *next != ' '))
+            return false;
+        step->time = time;
+        value = next;
+    }
+
+    if (!servoMacroSet(index, steps))
+        return false;
+
+    memcpy(config->macros[index], steps, sizeof steps);
+
+    return true;
+}
+
+/**
+ * @brief Fills in settings added after configuration was saved.
+ *
+ * @param config    configuration.
+ * @return true     configuration has been upgraded.
+ * @return false    configuration is up to date.
+ */
+bool upgradeConfig(config_t *config)
+{
+    if (config->version == CONFIG_VERSION)
+        return false;
+
+    /*
+     * Before versioning, this byte was part of the message.
+     */
+    if (config->version > CONFIG_VERSION)
+        config->version = 0;
+
+    switch (config->version)
+    {
+    case 0:
+        config->motionProfile = SERVO_PROFILE_S_CURVE;
+        config->motionDuration = SERVO_DEFAULT_PROFILE_DURATION;
+        config->motionVelocity = SERVO_DEFAULT_PROFILE_VELOCITY;
+        // fall through
+    case 1:
+        config->servoMinPulse = SERVO_DEFAULT_MIN_PULSE;
+        config->servoMaxPulse = SERVO_DEFAULT_MAX_PULSE;
+        config->servoReversed = false;
+        // fall through
+    case 2:
+        memset(config->channels, 0, sizeof config->channels);
+        for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+            config->channels[i].pin = CONFIG_CHANNEL_PIN_NONE;
+        config->channels[0].pin = SERVO_DEFAULT_PIN;
+        // fall through
+    case 3:
+        config->servoHoldTime = SERVO_DEFAULT_HOLD_TIME;
+        // fall through
+    case 4:
+        memset(config->macros, 0, sizeof config->macros);
+        // fall through
+    case 5:
+        config->localFirst = true;
+        // fall through
+    case 6:
+        config->ledBrightness = LED_BRIGHTNESS_MAX;
+        // fall through
+    case 7:
+        config->telemetryPeriod = 0;
+        // fall through
+    case 8:
+        config->lanPort = 0;
+        memset(config->lanKey, 0, sizeof config->lanKey);
+        // fall through
+    case 9:
+        config->groupMode = false;
+        // fall through
+    case 10:
+        memset(config->feedGroup, 0, sizeof config->feedGroup);
+    }
+
+    /*
+     * New settings take message space, so whatever is left of the message is garbage.
+     */
+    memset(config->message, 0, sizeof config->message);
+    strncpy(config->message, CONFIG_DEFAULT_MESSAGE, sizeof config->message - 1);
+    config->version = CONFIG_VERSION;
+
+    return true;
+}
+
+/**
+ * @brief Builds configuration blob, header followed by configuration.
+ *
+ * @param config    configuration.
+ * @param blob      output, CONFIG_BLOB_SIZE long.
+ */
+void blobBuild(config_t *config, uint8_t *blob)
+{
+    configBlobHeader_t *header = (configBlobHeader_t *)blob;
+
+    header->magic = CONFIG_BLOB_MAGIC;
+    header->format = CONFIG_BLOB_FORMAT;
+    header->configVersion = config->version;
+    header->length = CONFIG_STRUCT_SIZE;
+    header->crc = crc32(config, CONFIG_STRUCT_SIZE);
+    memcpy(header + 1, config, CONFIG_STRUCT_SIZE);
+}
+
+bool configValidate(config_t *config);
+
+/**
+ * @brief Replaces configuration with one from blob.
+ * Blob made by older firmware is upgraded, one made by newer firmware is refused.
+ * Whole configuration is checked first, macros are handed to servo motion engine only then.
+ *
+ * @param config    configuration.
+ * @param blob      blob.
+ * @param length    blob length.
+ * @return true     configuration replaced.
+ * @return false    blob malformed, corrupted, unsupported or with invalid settings.
+ */
+bool blobImport(config_t *config, const uint8_t *blob, int length)
+{
+    const configBlobHeader_t *header = (const configBlobHeader_t *)blob;
+
+    if (length < (int)sizeof(configBlobHeader_t) ||
+        header->magic != CONFIG_BLOB_MAGIC ||
+        header->format != CONFIG_BLOB_FORMAT ||
+        header->configVersion > CONFIG_VERSION ||
+        header->length > CONFIG_STRUCT_SIZE ||
+        length != sizeof(configBlobHeader_t) + header->length ||
+        crc32(header + 1, header->length) != header->crc)
+        return false;
+
+    memset(config, 0, CONFIG_STRUCT_SIZE);
+    memcpy(config, header + 1, header->length);
+    upgradeConfig(config);
+
+    if (!configValidate(config))
+        return false;
+
+    for (int i = 0; i < CONFIG_MACROS_MAX; i++)
+        servoMacroSet(i, config->macros[i]);
+
+    return true;
+}
+
+/**
+ * @brief Prints whole configuration as base64 blob, in one line.
+ *
+ * @param config configuration.
+ */
+void printBlob(config_t *config)
+{
+    static char encoded[BASE64_ENCODED_LEN(CONFIG_BLOB_SIZE) + 1];
+
+    blobBuild(config, g_blob);
+    base64Encode(g_blob, CONFIG_BLOB_SIZE, encoded);
+    printf("%s\n", encoded);
+}
+
+/**
+ * @brief Replaces configuration with one from base64 blob.
+ *
+ * @param config    configuration.
+ * @param value     base64 blob.
+ * @return true     configuration replaced.
+ * @return false    blob malformed, corrupted or unsupported.
+ */
+bool importBlob(config_t *config, char *value)
+{
+    return blobImport(config, g_blob, base64Decode(value, g_blob, CONFIG_BLOB_SIZE));
+}
+
+/**
+ * @brief Prints whether configuration changes are still waiting for flash.
+ *
+ * @param config configuration.
+ */
+void printCommit(config_t *config)
+{
+    printf("%s\n", g_dirty ? "PENDING" : "COMMITTED");
+}
+
+/**
+ * @brief Requests writing configuration to flash without waiting for the quiet period.
+ *
+ * @param config    configuration.
+ * @param value     setting value, ignored.
+ * @return true     always.
+ */
+bool requestCommit(config_t *config, char *value)
 {
-    static char value[CONFIG_VALUE_LEN + 1];
-    int settingLength = strlen(string);
+    return true;
+}
 
-    memset(value, 0, sizeof value);
-    strncpy(value, &string[CONFIG_VALUE_BEGIN], settingLength - CONFIG_VALUE_BEGIN + 1); // or even + 2
+/*
+ * Setting registry. Every setting is one line here: name, key (setting string packed
+ * with CONFIG_KEY()) and what it is. Plain fields of config_t are printed, parsed and
+ * bounds checked by the type, others bring their own handlers.
+ */
+#define CONFIG_SETTINGS(X)                                                             \
+    X(SSID, CONFIG_KEY('S', 'S', 'I', 'D'), CONFIG_STRING(ssid))                       \
+    X(PASSWORD, CONFIG_KEY('P', 'A', 'S', 'S'), CONFIG_STRING(password))               \
+    X(USERNAME, CONFIG_KEY('U', 'S', 'R', 'N'), CONFIG_STRING(username))               \
+    X(FEED_NAME, CONFIG_KEY('F', 'N', 'M', 'E'), CONFIG_STRING(feedName))              \
+    X(API_KEY, CONFIG_KEY('A', 'P', 'I', 'K'), CONFIG_STRING(apiKey))                  \
+    X(ANGLE_MAX, CONFIG_KEY('A', 'N', 'G', 'L'),                                       \
+      CONFIG_NUMBER(angleMax, 0, SERVO_MAX_ANGLE))                                     \
+    X(MESSAGE, CONFIG_KEY('M', 'E', 'S', 'S'), CONFIG_STRING(message))                 \
+    X(MOTION_PROFILE, CONFIG_KEY('P', 'R', 'O', 'F'),                                  \
+      CONFIG_CHOICE(motionProfile, profileDictionary))                                 \
+    X(MOTION_DURATION, CONFIG_KEY('P', 'D', 'U', 'R'),                                 \
+      CONFIG_NUMBER(motionDuration, 0, UINT16_MAX))                                    \
+    X(MOTION_VELOCITY, CONFIG_KEY('P', 'V', 'E', 'L'),                                 \
+      CONFIG_NUMBER(motionVelocity, 0, UINT16_MAX))                                    \
+    X(SERVO_MIN_PULSE, CONFIG_KEY('S', 'M', 'I', 'N'),                                 \
+      CONFIG_NUMBER(servoMinPulse, 0, UINT16_MAX))                                     \
+    X(SERVO_MAX_PULSE, CONFIG_KEY('S', 'M', 'A', 'X'),                                 \
+      CONFIG_NUMBER(servoMaxPulse, 0, UINT16_MAX))                                     \
+    X(SERVO_REVERSED, CONFIG_KEY('S', 'D', 'I', 'R'), CONFIG_NUMBER(servoReversed, 0, 1)) \
+    X(CHANNEL, CONFIG_KEY('C', 'H', 'A', 'N'), CONFIG_CUSTOM(printChannels, parseChannel, 0)) \
+    X(SERVO_HOLD_TIME, CONFIG_KEY('H', 'O', 'L', 'D'),                                 \
+      CONFIG_NUMBER(servoHoldTime, 0, UINT16_MAX))                                     \
+    X(MACRO, CONFIG_KEY('M', 'A', 'C', 'R'), CONFIG_CUSTOM(printMacros, parseMacro, 0)) \
+    X(LOCAL_FIRST, CONFIG_KEY('L', 'O', 'C', 'L'), CONFIG_NUMBER(localFirst, 0, 1))    \
+    X(LED_BRIGHTNESS, CONFIG_KEY('L', 'B', 'R', 'T'),                                  \
+      CONFIG_NUMBER(ledBrightness, 0, LED_BRIGHTNESS_MAX))                             \
+    X(TELEMETRY_PERIOD, CONFIG_KEY('T', 'E', 'L', 'E'),                                \
+      CONFIG_NUMBER(telemetryPeriod, 0, UINT16_MAX))                                   \
+    X(LAN_PORT, CONFIG_KEY('L', 'A', 'N', 'P'), CONFIG_NUMBER(lanPort, 0, UINT16_MAX))  \
+    X(LAN_KEY, CONFIG_KEY('L', 'A', 'N', 'K'), CONFIG_STRING(lanKey))                  \
+    X(GROUP_MODE, CONFIG_KEY('G', 'R', 'P', 'M'), CONFIG_NUMBER(groupMode, 0, 1))      \
+    X(FEED_GROUP, CONFIG_KEY('F', 'G', 'R', 'P'), CONFIG_STRING(feedGroup))            \
+    X(BLOB, CONFIG_KEY('B', 'L', 'O', 'B'),                                            \
+      CONFIG_CUSTOM(printBlob, importBlob, CONFIG_FLAG_COMMIT | CONFIG_FLAG_UNLISTED))  \
+    X(ALL, CONFIG_KEY('C', 'O', 'N', 'F'), CONFIG_ALL())                               \
+    X(LOOP, CONFIG_KEY('L', 'O', 'O', 'P'), CONFIG_STATS(eventLoopPrintStats))         \
+    X(SERVO_STATS, CONFIG_KEY('S', 'R', 'V', 'S'), CONFIG_STATS(servoPrintStats))      \
+    X(BUTTON_STATS, CONFIG_KEY('B', 'T', 'N', 'S'), CONFIG_STATS(buttonPrintStats))    \
+    X(SERIAL_STATS, CONFIG_KEY('S', 'E', 'R', 'S'), CONFIG_STATS(serialPrintStats))     \
+    X(PROTOCOL_STATS, CONFIG_KEY('P', 'R', 'T', 'S'), CONFIG_STATS(protocolPrintStats)) \
+    X(LAN_STATS, CONFIG_KEY('L', 'A', 'N', 'S'), CONFIG_STATS(httpServerPrintStats))  \
+    X(GROUP_STATS, CONFIG_KEY('G', 'R', 'P', 'S'), CONFIG_STATS(groupPrintStats))      \
+    X(OTA_STATS, CONFIG_KEY('O', 'T', 'A', 'S'), CONFIG_STATS(otaPrintStats))          \
+    X(JOURNAL_STATS, CONFIG_KEY('J', 'R', 'N', 'S'), CONFIG_STATS(journalPrintStats))  \
+    X(COMMIT, CONFIG_KEY('C', 'M', 'I', 'T'),                                          \
+      CONFIG_CUSTOM(printCommit, requestCommit, CONFIG_FLAG_COMMIT | CONFIG_FLAG_UNLISTED))
 
+/**
+ * @brief This is enum for storing settings (configuration entries), generated from the registry.
+ */
+typedef enum
+{
+#define CONFIG_SETTING_ENUM(name, key, type) SETTING_##name,
+    CONFIG_SETTINGS(CONFIG_SETTING_ENUM)
+#undef CONFIG_SETTING_ENUM
+    SETTING_COUNT
+} setting_t;
+
+/**
+ * @brief Setting registry table, indexed with setting_t.
+ */
+static const configSetting_t g_settings[SETTING_COUNT] = {
+#define CONFIG_SETTING_ENTRY(name, settingKey, settingType) [SETTING_##name] = {.key = settingKey, settingType},
+    CONFIG_SETTINGS(CONFIG_SETTING_ENTRY)
+#undef CONFIG_SETTING_ENTRY
+};
+
+/**
+ * @brief Finds setting by its key. Keys are case labels, so duplicates fail to compile.
+ *
+ * @param key                       setting key.
+ * @return const configSetting_t*   setting, NULL if there's none.
+ */
+const configSetting_t *settingFind(uint32_t key)
+{
+    switch (key)
+    {
+#define CONFIG_SETTING_CASE(name, settingKey, settingType) \
+    case settingKey:                                       \
+        return &g_settings[SETTING_##name];
+        CONFIG_SETTINGS(CONFIG_SETTING_CASE)
+#undef CONFIG_SETTING_CASE
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Reads plain numeric field of configuration.
+ *
+ * @param config        configuration.
+ * @param setting       setting.
+ * @return uint32_t     field value.
+ */
+uint32_t fieldRead(config_t *config, const configSetting_t *setting)
+{
+    uint32_t value = 0;
+
+    memcpy(&value, (uint8_t *)config + setting->offset, setting->size);
     return value;
 }
 
 /**
- * @brief Handles "Get" configuration mode.
- *        "Get" mode is used to print current settings on serial.
- * @param string configuration setting.
+ * @brief Writes plain numeric field of configuration.
+ *
+ * @param config    configuration.
+ * @param setting   setting.
+ * @param value     field value.
  */
-void modeGetHandler(char *string)
+void fieldWrite(config_t *config, const configSetting_t *setting, uint32_t value)
 {
-    config_t config;
-    configLoad(&config);
+    memcpy((uint8_t *)config + setting->offset, &value, setting->size);
+}
 
-    switch (getSetting(string))
+/**
+ * @brief Checks whole configuration the way SET checks single settings:
+ *        strings terminated, numbers and choices in range, channels and macros valid.
+ *
+ * @param config    configuration.
+ * @return true     configuration valid.
+ */
+bool configValidate(config_t *config)
+{
+    const configSetting_t *setting;
+    configChannel_t *channel;
+    uint32_t number;
+
+    for (int i = 0; i < SETTING_COUNT; i++)
     {
-    case SETTING_SSID:
-        printf("%s\n", config.ssid);
-        break;
-    case SETTING_PASSWORD:
-        printf("%s\n", config.password);
-        break;
-    case SETTING_USERNAME:
-        printf("%s\n", config.username);
-        break;
-    case SETTING_FEED_NAME:
-        printf("%s\n", config.feedName);
+        setting = &g_settings[i];
+
+        if (setting->type == CONFIG_TYPE_STRING && !memchr((char *)config + setting->offset, 0, setting->size))
+            return false;
+
+        if (setting->type != CONFIG_TYPE_NUMBER && setting->type != CONFIG_TYPE_CHOICE)
+            continue;
+
+        number = fieldRead(config, setting);
+        if (setting->type == CONFIG_TYPE_NUMBER ? number < setting->min || number > setting->max
+                                                : !dictionaryGetString(setting->choices, number))
+            return false;
+    }
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        channel = &config->channels[i];
+
+        if (!channelPinAllowed(config, i, channel->pin) || channel->angleMax > SERVO_MAX_ANGLE ||
+            !memchr(channel->feedName, 0, sizeof channel->feedName))
+            return false;
+    }
+
+    for (int i = 0; i < CONFIG_MACROS_MAX; i++)
+    {
+        if (!servoMacroIsValid(config->macros[i]))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Prints setting value.
+ *
+ * @param config    configuration.
+ * @param setting   setting.
+ */
+void printSetting(config_t *config, const configSetting_t *setting)
+{
+    char *choice;
+
+    switch (setting->type)
+    {
+    case CONFIG_TYPE_STRING:
+        printf("%s\n", (char *)config + setting->offset);
         break;
-    case SETTING_API_KEY:
-        printf("%s\n", config.apiKey);
+    case CONFIG_TYPE_NUMBER:
+        printf("%lu\n", fieldRead(config, setting));
         break;
-    case SETTING_ANGLE_MAX:
-        printf("%d\n", config.angleMax);
+    case CONFIG_TYPE_CHOICE:
+        choice = dictionaryGetString(setting->choices, fieldRead(config, setting));
+        printf("%s\n", choice ? choice : CONFIG_MESSAGE_SETTING_UNSUPPORTED);
         break;
-    case SETTING_MESSAGE:
-        printf("%s\n", config.message);
+    case CONFIG_TYPE_CUSTOM:
+        setting->print(config);
         break;
-    case SETTING_ALL:
-        printf("SSID: %s\n"
-               "PASSWORD: %s\n"
-               "USERNAME: %s\n"
-               "FEED NAME: %s\n"
-               "API_KEY: %s\n"
-               "MAX ANGLE: %d\n"
-               "MESSAGE:%s\n",
-               config.ssid,
-               config.password,
-               config.username,
-               config.feedName,
-               config.apiKey,
-               config.angleMax,
-               config.message);
+    case CONFIG_TYPE_STATS:
+        setting->stats();
         break;
-    case SETTING_UNDEFINED:
-        printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
+    case CONFIG_TYPE_ALL:
+        for (int i = 0; i < SETTING_COUNT; i++)
+        {
+            const configSetting_t *entry = &g_settings[i];
+            uint32_t key = entry->key;
+
+            if (entry->type > CONFIG_TYPE_CUSTOM || entry->flags & CONFIG_FLAG_UNLISTED)
+                continue;
+
+            if (entry->type != CONFIG_TYPE_CUSTOM)
+                printf("%c%c%c%c: ", (char)key, (char)(key >> 8), (char)(key >> 16), (char)(key >> 24));
+            printSetting(config, entry);
+        }
         break;
-    default:
+    }
+}
+
+/**
+ * @brief Handles "Get" configuration mode.
+ *        "Get" mode is used to print current settings on serial.
+ * @param setting setting, NULL if unknown.
+ */
+void modeGetHandler(const configSetting_t *setting)
+{
+    if (!setting)
+    {
         printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
-        break;
+        return;
     }
+
+    printSetting(configGet(), setting);
+}
+
+/**
+ * @brief Validates changed configuration, saves it and applies what can be applied at once.
+ *
+ * @param config    changed configuration.
+ * @return true     configuration saved.
+ * @return false    servo calibration refused.
+ */
+bool settingStore(config_t *config)
+{
+    if (!servoCalibrate(config->servoMinPulse, config->servoMaxPulse, config->servoReversed))
+        return false;
+
+    /*
+     * Period set with SUBSCRIBE stays, unless the setting itself changes.
+     */
+    if (config->telemetryPeriod != configGet()->telemetryPeriod)
+        telemetrySetPeriod(config->telemetryPeriod, 0);
+
+    configSave(config);
+    servoMotionSetProfile(config->motionProfile, config->motionDuration, config->motionVelocity);
+    servoSetHoldTime(config->servoHoldTime);
+
+    return true;
 }
 
 /**
  * @brief Handles "Set" configuration mode.
  *        "Set" mode is used to overwrite current settings.
- *        Function sets configuration setting based on string, an (re)writes configuration to onboard flash.
- * @param string configuration string.
+ *        Function sets configuration setting based on its registry entry, and saves configuration.
+ * @param setting   setting, NULL if unknown.
+ * @param value     setting value.
  */
-void modeSetHandler(char *string)
+void modeSetHandler(const configSetting_t *setting, char *value)
 {
-    char *value = getValue(string);
-    static uint8_t valueLength;
     static config_t config;
+    char *field;
+    uint32_t number;
+
+    if (!setting || setting->type > CONFIG_TYPE_CUSTOM)
+    {
+        printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
+        return;
+    }
 
-    valueLength = strlen(value);
     configLoad(&config);
-    switch (getSetting(string))
+    switch (setting->type)
     {
-    case SETTING_SSID:
-        memset(config.ssid, 0, sizeof config.ssid);
-        strncpy(config.ssid, value, REQUEST_NET_SSID_LEN);
+    case CONFIG_TYPE_STRING:
+        field = (char *)&config + setting->offset;
+        memset(field, 0, setting->size);
+        strncpy(field, value, setting->size - 1);
         break;
-    case SETTING_PASSWORD:
-        memset(config.password, 0, sizeof config.password);
-        strncpy(config.password, value, REQUEST_NET_PASS_LEN);
+    case CONFIG_TYPE_NUMBER:
+        if (!parseNumber(value, setting->min, setting->max, &number))
+        {
+            printf("%s\n", CONFIG_MESSAGE_FAILURE);
+            return;
+        }
+        fieldWrite(&config, setting, number);
         break;
-    case SETTING_USERNAME:
-        memset(config.username, 0, sizeof config.username);
-        strncpy(config.username, value, REQUEST_API_USERNAME_LEN);
+    case CONFIG_TYPE_CHOICE:
+        number = dictionaryGetEntry(setting->choices, value);
+        if (!dictionaryGetString(setting->choices, number))
+        {
+            printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
+            return;
+        }
+        fieldWrite(&config, setting, number);
         break;
-    case SETTING_FEED_NAME:
-        memset(config.feedName, 0, sizeof config.feedName);
-        strncpy(config.feedName, value, REQUEST_API_FEED_NAME_LEN);
+    default:
+        if (!setting->parse(&config, value))
+        {
+            printf("%s\n", CONFIG_MESSAGE_FAILURE);
+            return;
+        }
         break;
-    case SETTING_API_KEY:
-        memset(config.apiKey, 0, sizeof config.apiKey);
-        strncpy(config.apiKey, value, REQUEST_API_KEY_LEN);
+    }
+
+    if (!settingStore(&config))
+    {
+        printf("%s\n", CONFIG_MESSAGE_FAILURE);
+        return;
+    }
+
+    /*
+     * Response is printed by configUpdate(), once configuration is in flash.
+     */
+    if (setting->flags & CONFIG_FLAG_COMMIT)
+        g_commitRequested = true;
+    else
+        printf("%s\n", CONFIG_MESSAGE_SUCCESS);
+}
+
+/**
+ * @brief Handles "Profiler" mode.
+ *        "PRF STRT [rate]" starts sampling, "PRF STOP" stops it,
+ *        "PRF DUMP" prints the histogram and "PRF CLER" drops collected samples.
+ *        "PRF BNCH" prints servo angle conversion benchmark.
+ * @param command   command key.
+ * @param value     command value.
+ */
+void modeProfilerHandler(uint32_t command, char *value)
+{
+    switch (command)
+    {
+    case CONFIG_KEY('S', 'T', 'R', 'T'):
+        if (!profilerStart(atoi(value)))
+        {
+            printf("%s\n", CONFIG_MESSAGE_FAILURE);
+            return;
+        }
         break;
-    case SETTING_ANGLE_MAX:
-        config.angleMax = atoi(value);
-        if (config.angleMax > SERVO_MAX_ANGLE)
-            config.angleMax = SERVO_MAX_ANGLE;
+    case CONFIG_KEY('S', 'T', 'O', 'P'):
+        profilerStop();
         break;
-    case SETTING_MESSAGE:
-        memset(config.message, 0, sizeof config.message);
-        strncpy(config.message, value, CONFIG_STRUCT_LEFT_SPACE - 1); // This one is different
+    case CONFIG_KEY('D', 'U', 'M', 'P'):
+        profilerRequestDump();
+        return;
+    case CONFIG_KEY('C', 'L', 'E', 'R'):
+        profilerRequestClear();
         break;
-    case SETTING_ALL: // Yes, I could skip the contents
+    case CONFIG_KEY('B', 'N', 'C', 'H'):
+        servoBenchmark();
+        return;
+    default:
         printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
         return;
-    case SETTING_UNDEFINED:
+    }
+
+    printf("%s\n", CONFIG_MESSAGE_SUCCESS);
+}
+
+/**
+ * @brief Handles logging commands.
+ *        "LOG LEVL" prints module levels, "LOG LEVL <module> <level>" sets one.
+ *
+ * @param command   command key.
+ * @param value     command value.
+ */
+void modeLogHandler(uint32_t command, char *value)
+{
+    char module[CONFIG_SETTING_LEN + 1];
+    int level;
+
+    switch (command)
+    {
+    case CONFIG_KEY('L', 'E', 'V', 'L'):
+        if (!*value)
+        {
+            logPrintLevels();
+            return;
+        }
+        if (sscanf(value, "%4s %d", module, &level) != 2 || !logSetLevel(module, level))
+        {
+            printf("%s\n", CONFIG_MESSAGE_FAILURE);
+            return;
+        }
+        break;
+    case CONFIG_KEY('D', 'U', 'M', 'P'):
+        logDump();
+        return;
+    case CONFIG_KEY('C', 'L', 'E', 'R'):
+        logClear();
+        break;
+    default:
         printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
         return;
     }
 
-    configSave(&config);
     printf("%s\n", CONFIG_MESSAGE_SUCCESS);
 }
 
+/**
+ * @brief Handles firmware update commands.
+ *        "OTA BEGN <url>" starts update from HTTPS URL, "OTA STOP" abandons it.
+ *        Progress is printed by "GET OTAS".
+ *
+ * @param command   command key.
+ * @param value     command value.
+ */
+void modeOtaHandler(uint32_t command, char *value)
+{
+    switch (command)
+    {
+    case CONFIG_KEY('B', 'E', 'G', 'N'):
+        if (!otaBegin(value))
+        {
+            printf("%s\n", CONFIG_MESSAGE_FAILURE);
+            return;
+        }
+        break;
+    case CONFIG_KEY('S', 'T', 'O', 'P'):
+        otaStop();
+        break;
+    default:
+        printf("%s\n", CONFIG_MESSAGE_SETTING_UNSUPPORTED);
+        return;
+    }
+
+    printf("%s\n", CONFIG_MESSAGE_SUCCESS);
+}
+
+/**
+ * @brief Reads setting in binary form. Numbers are 32-bit little endian,
+ *        strings come without terminating zero, choices as their numbers.
+ *
+ * @param key       setting key.
+ * @param data      output.
+ * @param maxLength output size.
+ * @param number    set if value is a number.
+ * @return int      value length, -1 if setting is not a plain one or output is too small.
+ */
+int configSettingRead(uint32_t key, uint8_t *data, size_t maxLength, bool *number)
+{
+    const configSetting_t *setting = settingFind(key);
+    config_t *config = configGet();
+    uint32_t value;
+    size_t length;
+
+    if (!setting || setting->type > CONFIG_TYPE_CHOICE)
+        return -1;
+
+    *number = setting->type != CONFIG_TYPE_STRING;
+    if (!*number)
+    {
+        length = strnlen((char *)config + setting->offset, setting->size);
+        if (length > maxLength)
+            return -1;
+
+        memcpy(data, (char *)config + setting->offset, length);
+        return length;
+    }
+
+    if (maxLength < sizeof value)
+        return -1;
+
+    value = fieldRead(config, setting);
+    memcpy(data, &value, sizeof value);
+    return sizeof value;
+}
+
+/**
+ * @brief Writes setting in binary form, see configSettingRead().
+ *        Settings that commit right away are written to flash before this returns.
+ *
+ * @param key               setting key.
+ * @param data              value.
+ * @param length            value length.
+ * @return configStatus_t   CONFIG_STATUS_[...].
+ */
+configStatus_t configSettingWrite(uint32_t key, const uint8_t *data, size_t length)
+{
+    static config_t config;
+    const configSetting_t *setting = settingFind(key);
+    uint32_t number = 0;
+
+    if (!setting || (setting->type > CONFIG_TYPE_CHOICE && setting != &g_settings[SETTING_COMMIT]))
+        return CONFIG_STATUS_UNSUPPORTED;
+
+    configLoad(&config);
+    switch (setting->type)
+    {
+    case CONFIG_TYPE_STRING:
+        if (length >= setting->size)
+            return CONFIG_STATUS_FAILURE;
+
+        memset((char *)&config + setting->offset, 0, setting->size);
+        memcpy((char *)&config + setting->offset, data, length);
+        break;
+    case CONFIG_TYPE_NUMBER:
+    case CONFIG_TYPE_CHOICE:
+        if (length != sizeof number)
+            return CONFIG_STATUS_FAILURE;
+
+        memcpy(&number, data, sizeof number);
+        if (setting->type == CONFIG_TYPE_NUMBER ? number < setting->min || number > setting->max
+                                                : !dictionaryGetString(setting->choices, number))
+            return CONFIG_STATUS_FAILURE;
+
+        fieldWrite(&config, setting, number);
+        break;
+    default:
+        break;
+    }
+
+    if (!settingStore(&config))
+        return CONFIG_STATUS_FAILURE;
+
+    if (setting->flags & CONFIG_FLAG_COMMIT && !configCommit())
+        return CONFIG_STATUS_FAILURE;
+
+    return CONFIG_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Reads configuration blob in chunks. Reading from offset 0 takes a fresh snapshot.
+ *
+ * @param offset    offset within the blob.
+ * @param data      output.
+ * @param maxLength output size.
+ * @return int      chunk length, 0 past the blob end.
+ */
+int configBlobRead(uint16_t offset, uint8_t *data, size_t maxLength)
+{
+    if (!offset)
+        blobBuild(configGet(), g_blob);
+
+    if (offset >= CONFIG_BLOB_SIZE)
+        return 0;
+
+    if (maxLength > CONFIG_BLOB_SIZE - offset)
+        maxLength = CONFIG_BLOB_SIZE - offset;
+
+    memcpy(data, &g_blob[offset], maxLength);
+    return maxLength;
+}
+
+/**
+ * @brief Writes chunk of configuration blob. It's imported by configBlobApply().
+ *
+ * @param offset    offset within the blob.
+ * @param data      chunk.
+ * @param length    chunk length.
+ * @return true     chunk stored.
+ * @return false    chunk out of blob bounds.
+ */
+bool configBlobWrite(uint16_t offset, const uint8_t *data, size_t length)
+{
+    if (offset + length > CONFIG_BLOB_SIZE)
+        return false;
+
+    memcpy(&g_blob[offset], data, length);
+    return true;
+}
+
+/**
+ * @brief Imports blob written with configBlobWrite() and writes it to flash.
+ *
+ * @param length            blob length.
+ * @return configStatus_t   CONFIG_STATUS_[...].
+ */
+configStatus_t configBlobApply(size_t length)
+{
+    static config_t config;
+
+    if (length > CONFIG_BLOB_SIZE || !blobImport(&config, g_blob, length) || !settingStore(&config))
+        return CONFIG_STATUS_FAILURE;
+
+    return configCommit() ? CONFIG_STATUS_SUCCESS : CONFIG_STATUS_FAILURE;
+}
+
 /**
  * @brief Handles device configuration standalone.
+ *        String is "<mode> <setting> <value>", mode and setting are dispatched by their keys.
  *
  * @param string configuration string.
  */
 void configHandler(char *string)
 {
-    switch (getMode(string))
+    uint32_t setting = 0;
+
+    if (strlen(string) > CONFIG_SETTING_BEGIN)
+        setting = getKey(&string[CONFIG_SETTING_BEGIN], CONFIG_SETTING_LEN);
+
+    switch (getKey(string, CONFIG_MODE_LEN))
     {
-    case CONFIG_MODE_GET:
-        modeGetHandler(string);
+    case CONFIG_KEY('G', 'E', 'T', 0):
+        modeGetHandler(settingFind(setting));
         break;
-    case CONFIG_MODE_SET:
-        modeSetHandler(string);
+    case CONFIG_KEY('S', 'E', 'T', 0):
+        modeSetHandler(settingFind(setting), getValue(string));
         break;
-    case CONFIG_MODE_RESET:
+    case CONFIG_KEY('R', 'S', 'T', 0):
         configApplyDefaults(true);
         break;
-    case CONFIG_MODE_UNSUPPORTED:
+    case CONFIG_KEY('P', 'R', 'F', 0):
+        modeProfilerHandler(setting, getValue(string));
+        break;
+    case CONFIG_KEY('L', 'O', 'G', 0):
+        modeLogHandler(setting, getValue(string));
+        break;
+    case CONFIG_KEY('O', 'T', 'A', 0):
+        modeOtaHandler(setting, getValue(string));
+        break;
+    default:
         printf("%s\n", CONFIG_MESSAGE_MODE_UNSUPPORTED);
         break;
     }
 }
 
 /**
- * @brief Handles device configuration over UART (ONLY)!
- *        The function was designed to be run by uart interrupts.
+ * @brief Handles line received on serial, text command or binary frame.
+ *
+ * @param string    line.
+ * @param frame     true if it's binary frame.
+ */
+void configHandleInput(char *string, bool frame)
+{
+    if (frame)
+        protocolHandleFrame(string);
+    else
+        configHandler(string);
+}
+
+/**
+ * @brief Handles configuration lines received over UART and USB serial.
+ *        Lines are queued by serial.c, this runs them in the main loop.
+ */
+void configSerialUpdate()
+{
+    char *string;
+    bool frame;
+
+    while ((string = serialUartGetLastLine(&frame)))
+        configHandleInput(string, frame);
+
+    while ((string = serialUsbGetLastLine(&frame)))
+        configHandleInput(string, frame);
+}
+
+static int g_record = CONFIG_RECORD_NONE;
+static uint32_t g_sequence;
+static bool g_logScanned;
+
+/**
+ * @brief Gets record header in flash.
+ *
+ * @param record                    record index.
+ * @return const configRecordHeader_t* record header.
+ */
+const configRecordHeader_t *recordGet(int record)
+{
+    return (const configRecordHeader_t *)(XIP_BASE + CONFIG_LOG_OFFSET +
+                                          record / CONFIG_RECORDS_PER_SECTOR * FLASH_SECTOR_SIZE +
+                                          record % CONFIG_RECORDS_PER_SECTOR * CONFIG_RECORD_SIZE);
+}
+
+/**
+ * @brief Computes record CRC.
+ *
+ * @param header    record header, followed by data.
+ * @return uint32_t CRC.
+ */
+uint32_t recordCrc(const configRecordHeader_t *header)
+{
+    uint32_t crc = crc32Update(CRC32_INITIAL, &header->sequence, sizeof header->sequence + sizeof header->length);
+
+    return ~crc32Update(crc, header + 1, header->length);
+}
+
+/**
+ * @brief Checks if record is complete and intact.
+ *
+ * @param header    record header.
+ * @return true     record valid.
+ * @return false    record empty, partially written or corrupted.
+ */
+bool recordIsValid(const configRecordHeader_t *header)
+{
+    return header->magic == CONFIG_LOG_MAGIC &&
+           header->length <= CONFIG_STRUCT_SIZE &&
+           recordCrc(header) == header->crc;
+}
+
+/**
+ * @brief Finds the newest valid record. Done once, log position is tracked by saves afterwards.
+ */
+void logScan()
+{
+    const configRecordHeader_t *header;
+
+    g_logScanned = true;
+
+    for (int i = 0; i < CONFIG_RECORDS_COUNT; i++)
+    {
+        header = recordGet(i);
+
+        if (g_record != CONFIG_RECORD_NONE && header->sequence <= g_sequence)
+            continue;
+
+        if (!recordIsValid(header))
+            continue;
+
+        g_record = i;
+        g_sequence = header->sequence;
+    }
+}
+
+/**
+ * @brief Picks the record to write next. Moving into next sector erases it first,
+ * which drops its records, but the newest one is always in the sector before.
+ *
+ * @param erase     set to true if sector has to be erased.
+ * @return int      record index.
  */
-void configUartInterruptHandler()
+int logNextRecord(bool *erase)
 {
-    char *string = serialUartGetLastLine();
-    if (!string)
+    int record = g_record == CONFIG_RECORD_NONE ? 0 : (g_record + 1) % CONFIG_RECORDS_COUNT;
+
+    /*
+     * Whatever is in the log before first valid record is garbage.
+     */
+    *erase = g_record == CONFIG_RECORD_NONE || record % CONFIG_RECORDS_PER_SECTOR == 0;
+
+    if (*erase || recordGet(record)->magic == 0xFFFFFFFF)
+        return record;
+
+    /*
+     * Slot is not empty, most likely a save was cut, start with next sector.
+     */
+    record = (record / CONFIG_RECORDS_PER_SECTOR + 1) % CONFIG_LOG_SECTORS * CONFIG_RECORDS_PER_SECTOR;
+    *erase = true;
+
+    return record;
+}
+
+/**
+ * @brief Programs configuration record. Called by flash_safe_execute(),
+ * with the other core and interrupts locked out.
+ *
+ * @param param flash operation (configFlashWrite_t).
+ */
+void flashWrite(void *param)
+{
+    configFlashWrite_t *write = param;
+
+    if (write->erase)
+        flash_range_erase(write->offset - write->offset % FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    flash_range_program(write->offset, write->data, CONFIG_RECORD_SIZE);
+}
+
+/**
+ * @brief Appends configuration record to the log.
+ * Usually it's just programming a few pages, the sector is erased only when the log moves to it.
+ * Write cut at any point leaves previous configuration in place.
+ *
+ * @param config    configuration.
+ * @return true     record written and verified.
+ * @return false    flash could not be accessed, or record is corrupted.
+ */
+bool logAppend(config_t *config)
+{
+    static uint8_t record[CONFIG_RECORD_SIZE];
+    configRecordHeader_t *header = (configRecordHeader_t *)record;
+    configFlashWrite_t write;
+    int next;
+
+    if (!g_logScanned)
+        logScan();
+
+    next = logNextRecord(&write.erase);
+    write.offset = CONFIG_LOG_OFFSET + next / CONFIG_RECORDS_PER_SECTOR * FLASH_SECTOR_SIZE +
+                   next % CONFIG_RECORDS_PER_SECTOR * CONFIG_RECORD_SIZE;
+    write.data = record;
+
+    memset(record, 0xFF, sizeof record);
+    memcpy(header + 1, config, CONFIG_STRUCT_SIZE);
+    header->magic = CONFIG_LOG_MAGIC;
+    header->sequence = g_sequence + 1;
+    header->length = CONFIG_STRUCT_SIZE;
+    header->crc = recordCrc(header);
+
+    if (flash_safe_execute(flashWrite, &write, CONFIG_FLASH_TIMEOUT) != PICO_OK)
+        return false;
+
+    if (!recordIsValid(recordGet(next)))
+        return false;
+
+    g_record = next;
+    g_sequence = header->sequence;
+
+    return true;
+}
+
+/**
+ * @brief Reads configuration from flash into RAM. Done once, RAM copy is authoritative afterwards.
+ */
+void cacheLoad()
+{
+    const configRecordHeader_t *header;
+
+    g_loaded = true;
+
+    if (!g_logScanned)
+        logScan();
+
+    if (g_record == CONFIG_RECORD_NONE)
+    {
+        /*
+         * No log yet, configuration saved by older firmware (or erased flash, meaning first time setup).
+         */
+        memcpy(&g_config, (const uint8_t *)(XIP_BASE + MEMORY_OFFSET), CONFIG_STRUCT_SIZE);
         return;
-    configHandler(string);
+    }
+
+    header = recordGet(g_record);
+    memset(&g_config, 0, CONFIG_STRUCT_SIZE);
+    memcpy(&g_config, header + 1, header->length);
 }
 
 /**
- * @brief Loads configuration from flash.
+ * @brief Gets current configuration, kept in RAM. Must not be modified, use configSave().
+ *
+ * @return config_t* configuration.
+ */
+config_t *configGet()
+{
+    if (!g_loaded)
+        cacheLoad();
+
+    return &g_config;
+}
+
+/**
+ * @brief Loads current configuration.
  *
  * @param config configuration to write to.
  */
 void configLoad(config_t *config)
 {
-    const uint8_t *flash_target_contents = (const uint8_t *)(XIP_BASE + MEMORY_OFFSET);
-    memcpy(config, flash_target_contents, CONFIG_STRUCT_SIZE);
+    memcpy(config, configGet(), CONFIG_STRUCT_SIZE);
 }
 
 /**
- * @brief Saves configuration to flash memory.
- * WARNING! This overwrites previous configuration.
+ * @brief Saves configuration. It's kept in RAM, and written to flash
+ * once there are no more changes for CONFIG_COMMIT_DELAY, or on configCommit().
  *
  * @param config current configuration.
  */
 void configSave(config_t *config)
 {
-    uint8_t *configBytes = (uint8_t *)config;
-    int confSize = CONFIG_STRUCT_SIZE;
-    uint32_t interrupts = save_and_disable_interrupts();
+    if (!g_loaded)
+        cacheLoad();
+
+    if (!memcmp(&g_config, config, CONFIG_STRUCT_SIZE))
+        return;
 
-    flash_range_erase(MEMORY_OFFSET, FLASH_SECTOR_SIZE);
-    flash_range_program(MEMORY_OFFSET, configBytes, CONFIG_STRUCT_SIZE);
-    restore_interrupts(interrupts);
+    memcpy(&g_config, config, CONFIG_STRUCT_SIZE);
+    g_changeTime = to_ms_since_boot(get_absolute_time());
+    g_dirty = true;
+}
+
+/**
+ * @brief Writes pending changes to flash right away.
+ *
+ * @return true     configuration is in flash.
+ * @return false    flash write failed, changes are still pending.
+ */
+bool configCommit()
+{
+    if (!g_dirty)
+        return true;
+
+    /*
+     * Settings are changed only by the config task in main loop,
+     * so nothing touches configuration while it's being written.
+     */
+    if (!logAppend(&g_config))
+        return false;
+
+    g_dirty = false;
+    return true;
+}
+
+/**
+ * @brief Commits changes after quiet period, or when requested with "SET CMIT".
+ * Must be called periodically from main loop, never from interrupts.
+ */
+void configUpdate()
+{
+    bool requested = g_commitRequested;
+    bool quiet = to_ms_since_boot(get_absolute_time()) - g_changeTime >= CONFIG_COMMIT_DELAY;
+
+    if (!requested && !(g_dirty && quiet))
+        return;
+
+    g_commitRequested = false;
+
+    if (requested)
+        printf("%s\n", configCommit() ? CONFIG_MESSAGE_SUCCESS : CONFIG_MESSAGE_FAILURE);
+    else
+        configCommit();
 }
 
 /**
  * @brief Checks and saves default configuration to flash if firstTimeSetup is not set.
+ * Configuration saved by older firmware gets defaults for settings it lacks.
  *
  * @param force  forces restoring configuration to defaults.
  * @return true  defaults have been restored.
@@ -330,11 +1573,18 @@ void configSave(config_t *config)
  */
 bool configApplyDefaults(bool force)
 {
-    config_t config;
+    static config_t config;
     configLoad(&config);
 
     if (!config.firstTimeSetup && !force)
+    {
+        if (upgradeConfig(&config))
+        {
+            configSave(&config);
+            configCommit();
+        }
         return false;
+    }
 
     memset(config.ssid, 0, sizeof config.ssid);
     memset(config.password, 0, sizeof config.password);
@@ -352,11 +1602,15 @@ bool configApplyDefaults(bool force)
 
     config.angleMax = SERVO_MAX_ANGLE;
     config.firstTimeSetup = 0;
+    config.version = 0;
+    upgradeConfig(&config);
 
     configSave(&config);
 
     if (force)
         printf("%s\n", CONFIG_MESSAGE_SUCCESS);
+    else
+        configCommit();
 
     return true;
 }
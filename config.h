@@ -12,10 +12,37 @@
 #define CONFIG_H
 
 #include "request.h"
+#include "servo.h"
+#include "http.h"
 
-#define CONFIG_STRUCT_SIZE 512
+#define CONFIG_STRUCT_SIZE 1024
 #define CONFIG_LEN_FIRST_TIME_SETUP 1
 #define CONFIG_LEN_MAX_ANGLE 1
+#define CONFIG_LEN_VERSION 1
+#define CONFIG_LEN_MOTION_PROFILE 5
+#define CONFIG_LEN_SERVO_CALIBRATION 5
+#define CONFIG_LEN_SERVO_HOLD_TIME 2
+#define CONFIG_LEN_LOCAL_FIRST 1
+#define CONFIG_LEN_LED_BRIGHTNESS 1
+#define CONFIG_LEN_TELEMETRY_PERIOD 2
+#define CONFIG_LEN_LAN_PORT 2
+#define CONFIG_LEN_GROUP_MODE 1
+
+#define CONFIG_MACROS_MAX SERVO_MACROS_MAX
+#define CONFIG_LEN_MACROS (CONFIG_MACROS_MAX * SERVO_MACRO_STEPS_MAX * sizeof(servoMacroStep_t))
+
+#define CONFIG_CHANNELS_MAX SERVO_CHANNELS_MAX
+#define CONFIG_CHANNEL_FEED_LEN 48
+#define CONFIG_CHANNEL_PIN_NONE 0xFF
+/*
+ * Board pins, channels can't take them.
+ */
+#define CONFIG_PINS_COUNT 30
+#define CONFIG_BUTTON_PIN 26
+#define CONFIG_LED_BLUE_PIN 20
+#define CONFIG_LED_GREEN_PIN 19
+#define CONFIG_LED_RED_PIN 18
+#define CONFIG_LEN_CHANNELS (CONFIG_CHANNELS_MAX * (CONFIG_CHANNEL_FEED_LEN + 1 + 2))
 /*
  *  This is better than defining [...]_ELEMENTS_COUNT as it's less error prone.
  */
@@ -25,11 +52,44 @@
                                              REQUEST_API_FEED_NAME_LEN + 1 + \
                                              REQUEST_API_KEY_LEN + 1 +       \
                                              CONFIG_LEN_FIRST_TIME_SETUP +   \
-                                             CONFIG_LEN_MAX_ANGLE
+                                             CONFIG_LEN_MAX_ANGLE +          \
+                                             CONFIG_LEN_VERSION +            \
+                                             CONFIG_LEN_MOTION_PROFILE +     \
+                                             CONFIG_LEN_SERVO_CALIBRATION +  \
+                                             CONFIG_LEN_CHANNELS +           \
+                                             CONFIG_LEN_SERVO_HOLD_TIME +    \
+                                             CONFIG_LEN_MACROS +             \
+                                             CONFIG_LEN_LOCAL_FIRST +        \
+                                             CONFIG_LEN_LED_BRIGHTNESS +     \
+                                             CONFIG_LEN_TELEMETRY_PERIOD +   \
+                                             CONFIG_LEN_LAN_PORT +           \
+                                             HTTP_KEY_LEN + 1 +              \
+                                             CONFIG_LEN_GROUP_MODE +         \
+                                             REQUEST_API_GROUP_NAME_LEN + 1
 
 #define CONFIG_STRUCT_LEFT_SPACE (CONFIG_STRUCT_SIZE - (CONFIG_STRUCT_CRITICAL_DATA_SIZE))
 
-typedef struct
+/*
+ * Bump it when adding fields, configApplyDefaults() fills them in on devices
+ * configured by older firmware.
+ */
+#define CONFIG_VERSION 11
+
+/*
+ * Config is stored in flash as is, so there's no padding.
+ */
+
+/**
+ * @brief Servo channel. Empty feed name means main feed, zero angle means ANGL.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t pin;
+    uint8_t angleMax;
+    char feedName[CONFIG_CHANNEL_FEED_LEN + 1];
+} configChannel_t;
+
+typedef struct __attribute__((packed))
 {
     bool firstTimeSetup;
     char ssid[REQUEST_NET_SSID_LEN + 1];
@@ -38,6 +98,23 @@ typedef struct
     char feedName[REQUEST_API_FEED_NAME_LEN + 1];
     char apiKey[REQUEST_API_KEY_LEN + 1];
     uint8_t angleMax;
+    uint8_t version;
+    uint8_t motionProfile;
+    uint16_t motionDuration;
+    uint16_t motionVelocity;
+    uint16_t servoMinPulse;
+    uint16_t servoMaxPulse;
+    uint8_t servoReversed;
+    configChannel_t channels[CONFIG_CHANNELS_MAX];
+    uint16_t servoHoldTime;
+    servoMacroStep_t macros[CONFIG_MACROS_MAX][SERVO_MACRO_STEPS_MAX];
+    uint8_t localFirst;
+    uint8_t ledBrightness;
+    uint16_t telemetryPeriod;
+    uint16_t lanPort;
+    char lanKey[HTTP_KEY_LEN + 1];
+    uint8_t groupMode;
+    char feedGroup[REQUEST_API_GROUP_NAME_LEN + 1];
     /*
      * Data length must be a multiple of page size,
      * this is basically here, not to waste that space.
@@ -45,10 +122,31 @@ typedef struct
     char message[CONFIG_STRUCT_LEFT_SPACE];
 } config_t;
 
+_Static_assert(sizeof(config_t) == CONFIG_STRUCT_SIZE, "config_t must match CONFIG_STRUCT_SIZE");
+
+/**
+ * @brief Result of configuration change made over binary protocol.
+ */
+typedef enum
+{
+    CONFIG_STATUS_SUCCESS,
+    CONFIG_STATUS_FAILURE,
+    CONFIG_STATUS_UNSUPPORTED
+} configStatus_t;
+
 void configHandler(char *string);
-void configUartInterruptHandler();
+void configHandleInput(char *string, bool frame);
+void configSerialUpdate();
+config_t *configGet();
 void configLoad(config_t *config);
 void configSave(config_t *config);
+bool configCommit();
+void configUpdate();
 bool configApplyDefaults(bool force);
+int configSettingRead(uint32_t key, uint8_t *data, size_t maxLength, bool *number);
+configStatus_t configSettingWrite(uint32_t key, const uint8_t *data, size_t length);
+int configBlobRead(uint16_t offset, uint8_t *data, size_t maxLength);
+bool configBlobWrite(uint16_t offset, const uint8_t *data, size_t length);
+configStatus_t configBlobApply(size_t length);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,56 @@
+/*
+ * File: crc.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+#include "crc.h"
+
+/*
+ * Reflected CRC-32 polynomial (the zlib one), so checksums can be checked with any host tool.
+ */
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+/**
+ * @brief Continues CRC-32 over more data. Start with CRC32_INITIAL,
+ * and invert the result once all data is in.
+ * Bitwise, no table, as it's only used on rare occasions.
+ *
+ * @param crc       CRC so far.
+ * @param data      data.
+ * @param length    data length.
+ * @return uint32_t updated CRC.
+ */
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+
+    while (length--)
+    {
+        crc ^= *bytes++;
+
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Computes CRC-32 of data.
+ *
+ * @param data      data.
+ * @param length    data length.
+ * @return uint32_t CRC.
+ */
+uint32_t crc32(const void *data, size_t length)
+{
+    return ~crc32Update(CRC32_INITIAL, data, length);
+}
@@ -0,0 +1,19 @@
+/*
+ * File: crc.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#define CRC32_INITIAL 0xFFFFFFFF
+
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length);
+uint32_t crc32(const void *data, size_t length);
+
+#endif
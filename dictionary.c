@@ -23,7 +23,7 @@
  */
 char *dictionaryGetString(dictionary_t *dictionary, uint8_t entry)
 {
-    while (dictionary->entry)
+    while (dictionary->string)
     {
         if (dictionary->entry == entry)
             return dictionary->string;
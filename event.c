@@ -0,0 +1,303 @@
+/*
+ * File: event.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Cooperative, run-to-completion event loop.
+ *
+ * Every task registers a single handler. Tasks talk to each other by posting events,
+ * either straight to the queue, or with a deadline (timer). Handlers must never block,
+ * anything that takes time is split into steps scheduled with eventPostDelayed().
+ *
+ * Posting is interrupt safe, so interrupt handlers can wake tasks up too.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "event.h"
+
+/**
+ * @brief Event waiting for its deadline.
+ */
+typedef struct
+{
+    bool active;
+    uint64_t deadline;
+    event_t event;
+} eventTimer_t;
+
+/**
+ * @brief Task with its handler and run time statistics.
+ */
+typedef struct
+{
+    char *name;
+    eventHandler_t handler;
+    uint32_t runs;
+    uint32_t maxRunTime;
+} eventTaskEntry_t;
+
+static eventTaskEntry_t g_tasks[EVENT_TASK_COUNT];
+
+static event_t g_queue[EVENT_QUEUE_LEN];
+static uint8_t g_queueHead;
+static uint8_t g_queueCount;
+
+static eventTimer_t g_timers[EVENT_TIMERS_LEN];
+
+static uint32_t g_maxLag;
+static uint32_t g_maxQueueDepth;
+static uint32_t g_dropped;
+
+/**
+ * @brief Registers task handler.
+ *
+ * @param task      task.
+ * @param name      task name, for statistics.
+ * @param handler   function handling events posted to the task.
+ */
+void eventTaskRegister(eventTask_t task, char *name, eventHandler_t handler)
+{
+    g_tasks[task].name = name;
+    g_tasks[task].handler = handler;
+}
+
+/**
+ * @brief Posts event to the task. Can be called from interrupts.
+ *
+ * @param task      receiving task.
+ * @param type      event type, meaning is up to the task.
+ * @param value     event value.
+ * @return true     event queued.
+ * @return false    queue full, event dropped.
+ */
+bool eventPost(eventTask_t task, uint8_t type, int32_t value)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+    event_t *event;
+
+    if (g_queueCount == EVENT_QUEUE_LEN)
+    {
+        g_dropped++;
+        restore_interrupts(interrupts);
+        return false;
+    }
+
+    event = &g_queue[(g_queueHead + g_queueCount) % EVENT_QUEUE_LEN];
+    event->task = task;
+    event->type = type;
+    event->value = value;
+    g_queueCount++;
+
+    if (g_queueCount > g_maxQueueDepth)
+        g_maxQueueDepth = g_queueCount;
+
+    restore_interrupts(interrupts);
+    __sev();
+
+    return true;
+}
+
+/**
+ * @brief Posts event to the task after given time. Can be called from interrupts.
+ *
+ * @param task      receiving task.
+ * @param type      event type.
+ * @param value     event value.
+ * @param delay     delay in miliseconds.
+ * @return true     event scheduled.
+ * @return false    no free timer, event dropped.
+ */
+bool eventPostDelayed(eventTask_t task, uint8_t type, int32_t value, uint32_t delay)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    for (int i = 0; i < EVENT_TIMERS_LEN; i++)
+    {
+        if (g_timers[i].active)
+            continue;
+
+        g_timers[i].deadline = time_us_64() + delay * 1000ull;
+        g_timers[i].event.task = task;
+        g_timers[i].event.type = type;
+        g_timers[i].event.value = value;
+        g_timers[i].active = true;
+
+        restore_interrupts(interrupts);
+        __sev();
+        return true;
+    }
+
+    g_dropped++;
+    restore_interrupts(interrupts);
+
+    return false;
+}
+
+/**
+ * @brief Cancels all scheduled events of given type for the task.
+ *
+ * @param task task.
+ * @param type event type.
+ */
+void eventCancel(eventTask_t task, uint8_t type)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    for (int i = 0; i < EVENT_TIMERS_LEN; i++)
+    {
+        if (g_timers[i].event.task == task && g_timers[i].event.type == type)
+            g_timers[i].active = false;
+    }
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Takes event from the queue.
+ *
+ * @param event     event to write to.
+ * @return true     event taken.
+ * @return false    queue empty.
+ */
+bool queuePop(event_t *event)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    if (!g_queueCount)
+    {
+        restore_interrupts(interrupts);
+        return false;
+    }
+
+    *event = g_queue[g_queueHead];
+    g_queueHead = (g_queueHead + 1) % EVENT_QUEUE_LEN;
+    g_queueCount--;
+
+    restore_interrupts(interrupts);
+
+    return true;
+}
+
+/**
+ * @brief Moves expired timers to the queue.
+ *
+ * @param now       current time in microseconds.
+ * @return uint64_t closest deadline of still pending timers.
+ */
+uint64_t timersExpire(uint64_t now)
+{
+    uint64_t closest = UINT64_MAX;
+
+    for (int i = 0; i < EVENT_TIMERS_LEN; i++)
+    {
+        uint32_t interrupts = save_and_disable_interrupts();
+        eventTimer_t timer = g_timers[i];
+
+        if (timer.active && timer.deadline <= now)
+            g_timers[i].active = false;
+
+        restore_interrupts(interrupts);
+
+        if (!timer.active)
+            continue;
+
+        if (timer.deadline > now)
+        {
+            if (timer.deadline < closest)
+                closest = timer.deadline;
+            continue;
+        }
+
+        if (now - timer.deadline > g_maxLag)
+            g_maxLag = now - timer.deadline;
+
+        eventPost(timer.event.task, timer.event.type, timer.event.value);
+    }
+
+    return closest;
+}
+
+/**
+ * @brief Runs the handler of event's task and measures how long it took.
+ *
+ * @param event event.
+ */
+void dispatch(event_t *event)
+{
+    eventTaskEntry_t *task = &g_tasks[event->task];
+    uint32_t start, runTime;
+
+    if (!task->handler)
+        return;
+
+    start = time_us_32();
+    task->handler(event);
+    runTime = time_us_32() - start;
+
+    task->runs++;
+    if (runTime > task->maxRunTime)
+        task->maxRunTime = runTime;
+}
+
+/**
+ * @brief Runs the event loop. Never returns.
+ * When there's nothing to do, core sleeps till next deadline or posted event.
+ */
+void eventLoopRun()
+{
+    event_t event;
+    uint64_t closest;
+
+    while (true)
+    {
+        closest = timersExpire(time_us_64());
+
+        while (queuePop(&event))
+            dispatch(&event);
+
+        if (closest != UINT64_MAX)
+            best_effort_wfe_or_timeout(from_us_since_boot(closest));
+        else
+            __wfe();
+    }
+}
+
+/**
+ * @brief Gets number of events dropped, for full queue or no free timer.
+ *
+ * @return uint32_t dropped events.
+ */
+uint32_t eventLoopGetDropped()
+{
+    return g_dropped;
+}
+
+/**
+ * @brief Prints loop statistics on serial.
+ */
+void eventLoopPrintStats()
+{
+    for (int i = 0; i < EVENT_TASK_COUNT; i++)
+    {
+        if (!g_tasks[i].handler)
+            continue;
+
+        printf("%s: RUNS %lu, MAX RUN TIME %lu us\n",
+               g_tasks[i].name, g_tasks[i].runs, g_tasks[i].maxRunTime);
+    }
+
+    printf("MAX LAG: %lu us\n"
+           "MAX QUEUE DEPTH: %lu\n"
+           "DROPPED: %lu\n",
+           g_maxLag, g_maxQueueDepth, g_dropped);
+}
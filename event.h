@@ -0,0 +1,44 @@
+/*
+ * File: event.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#define EVENT_QUEUE_LEN 32
+#define EVENT_TIMERS_LEN 16
+
+typedef enum
+{
+    EVENT_TASK_NETWORK,
+    EVENT_TASK_ACTUATOR,
+    EVENT_TASK_BUTTON,
+    EVENT_TASK_LED,
+    EVENT_TASK_CONFIG,
+    EVENT_TASK_COUNT
+} eventTask_t;
+
+typedef struct
+{
+    uint8_t task;
+    uint8_t type;
+    int32_t value;
+} event_t;
+
+typedef void (*eventHandler_t)(event_t *event);
+
+void eventTaskRegister(eventTask_t task, char *name, eventHandler_t handler);
+bool eventPost(eventTask_t task, uint8_t type, int32_t value);
+bool eventPostDelayed(eventTask_t task, uint8_t type, int32_t value, uint32_t delay);
+void eventCancel(eventTask_t task, uint8_t type);
+void eventLoopRun();
+uint32_t eventLoopGetDropped();
+void eventLoopPrintStats();
+
+#endif
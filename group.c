@@ -0,0 +1,953 @@
+/*
+ * File: group.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Cooperative polling of a group of units on one LAN.
+ *
+ * Units of the same account find each other with HELLO messages sent to a multicast
+ * group every second. HELLO carries unit's feeds and whether it reaches the cloud.
+ * The online unit with lowest id is the leader, it's the only one polling the cloud,
+ * for its own feeds and those of the others. Value changes are relayed in VALUE
+ * messages with sequence numbers, followers ACK them and the leader retransmits till
+ * everyone did. Leader's HELLO carries values of all the feeds, so anything lost is
+ * caught up with in a second. When the leader goes silent, it's dropped and the next
+ * one takes over. Without any online unit everyone polls for itself. Followers poll their
+ * feeds the leader doesn't list, because it ran out of room for them.
+ *
+ * Followers write their own changes to the cloud and list the written value in HELLO
+ * till the leader relays it back, so the leader's cache doesn't lag behind the cloud.
+ * Leader's values older than the write are not applied meanwhile.
+ *
+ * Messages are signed with HMAC-SHA256 keyed with the API key, truncated to 8 bytes.
+ * lwIP runs in poll mode, callbacks come from the network task.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+#include "mbedtls/md.h"
+
+#include "group.h"
+#include "request.h"
+#include "crc.h"
+#include "log.h"
+
+#define GROUP_VERSION 1
+#define GROUP_PORT 5757
+
+#define GROUP_HELLO_TIME 1000
+#define GROUP_MEMBER_TIMEOUT 3500
+#define GROUP_RETRY_TIME 100
+#define GROUP_RETRIES 5
+#define GROUP_WRITE_TIMEOUT 3000
+
+#define GROUP_RELAYS_MAX 8
+#define GROUP_MESSAGE_MAX 1200
+#define GROUP_MAC_LEN 8
+#define GROUP_FEED_NAME_LEN REQUEST_API_FEED_NAME_LEN
+
+#define GROUP_FLAG_ONLINE 0x01
+#define GROUP_FLAG_LEADER 0x02
+
+typedef enum
+{
+    GROUP_MESSAGE_HELLO = 1,
+    GROUP_MESSAGE_VALUE,
+    GROUP_MESSAGE_ACK
+} groupMessage_t;
+
+/**
+ * @brief Message header. Payload is a list of feed entries, value byte followed by
+ * zero terminated feed name, then comes the MAC.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t group;
+    uint32_t unit;
+    uint32_t session;
+    uint32_t sequence;
+} groupHeader_t;
+
+typedef struct
+{
+    bool active;
+    uint8_t flags;
+    uint32_t unit;
+    uint32_t session;
+    uint32_t lastSequence;
+    uint32_t lastSeen;
+    ip_addr_t address;
+} groupMember_t;
+
+/**
+ * @brief Feed followed by other units, with members following it as bits.
+ */
+typedef struct
+{
+    uint16_t followers;
+    int8_t value;
+    char name[GROUP_FEED_NAME_LEN + 1];
+} groupFeed_t;
+
+/**
+ * @brief Value change waiting for ACKs, with members that didn't ACK yet as bits.
+ */
+typedef struct
+{
+    bool active;
+    uint8_t feed;
+    uint8_t retries;
+    uint16_t pending;
+    uint32_t sequence;
+    uint32_t sentAt;
+} groupRelay_t;
+
+/**
+ * @brief Own write of a local feed, till the leader catches up with it.
+ */
+typedef struct
+{
+    bool active;
+    int8_t value;
+    uint32_t sequence;
+    uint32_t writtenAt;
+} groupWrite_t;
+
+typedef struct
+{
+    uint32_t elections;
+    uint32_t relayed;
+    uint32_t acks;
+    uint32_t retransmits;
+    uint32_t lost;
+    uint32_t rejected;
+    uint32_t overflows;
+} groupStats_t;
+
+static struct udp_pcb *g_pcb;
+static ip_addr_t g_address;
+static const char *g_key;
+static uint32_t g_group;
+static uint32_t g_unit;
+static uint32_t g_session;
+static uint32_t g_sequence;
+static uint32_t g_leader;
+static bool g_online;
+static uint16_t g_covered;
+static uint32_t g_lastHello;
+
+static char **g_localFeeds;
+static uint8_t g_localFeedsCount;
+static groupValueCallback_t g_callback;
+
+static groupMember_t g_members[GROUP_MEMBERS_MAX];
+static groupFeed_t g_feeds[GROUP_FEEDS_MAX];
+static groupRelay_t g_relays[GROUP_RELAYS_MAX];
+static groupWrite_t g_writes[GROUP_FEEDS_MAX];
+static groupStats_t g_stats;
+
+static uint8_t g_message[GROUP_MESSAGE_MAX];
+
+/**
+ * @brief Gets current time for group timeouts.
+ *
+ * @return uint32_t miliseconds since boot.
+ */
+uint32_t groupNow()
+{
+    return to_ms_since_boot(get_absolute_time());
+}
+
+/**
+ * @brief Computes message MAC.
+ *
+ * @param data      signed data.
+ * @param length    data length.
+ * @param mac       output, GROUP_MAC_LEN long.
+ */
+void groupSign(const uint8_t *data, size_t length, uint8_t *mac)
+{
+    uint8_t digest[32];
+
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                    (const unsigned char *)g_key, strlen(g_key), data, length, digest);
+    memcpy(mac, digest, GROUP_MAC_LEN);
+}
+
+/**
+ * @brief Adds feed entry to the message payload.
+ *
+ * @param offset    payload length so far.
+ * @param name      feed name.
+ * @param value     feed value, -1 if not known.
+ * @return size_t   new payload length, unchanged if the entry doesn't fit.
+ */
+size_t groupEntryAdd(size_t offset, const char *name, int8_t value)
+{
+    size_t length = strlen(name) + 2;
+
+    if (offset + length > GROUP_MESSAGE_MAX - sizeof(groupHeader_t) - GROUP_MAC_LEN)
+        return offset;
+
+    g_message[sizeof(groupHeader_t) + offset] = value;
+    memcpy(&g_message[sizeof(groupHeader_t) + offset + 1], name, length - 1);
+
+    return offset + length;
+}
+
+/**
+ * @brief Takes next feed entry from received payload.
+ *
+ * @param payload   payload.
+ * @param length    payload length.
+ * @param offset    offset of the entry, moved to the next one.
+ * @param name      feed name output.
+ * @param value     feed value output.
+ * @return true     entry taken.
+ * @return false    no more entries, or malformed one.
+ */
+bool groupEntryNext(const uint8_t *payload, size_t length, size_t *offset, const char **name, int8_t *value)
+{
+    const uint8_t *end;
+
+    if (*offset + 2 > length)
+        return false;
+
+    end = memchr(&payload[*offset + 1], 0, length - *offset - 1);
+    if (!end)
+        return false;
+
+    *value = payload[*offset];
+    *name = (const char *)&payload[*offset + 1];
+    *offset = end - payload + 1;
+
+    return true;
+}
+
+/**
+ * @brief Signs and sends message. Payload must be in g_message already.
+ *
+ * @param type      message type.
+ * @param sequence  sequence number.
+ * @param length    payload length.
+ * @param address   destination.
+ * @return true     message sent.
+ */
+bool groupSend(groupMessage_t type, uint32_t sequence, size_t length, const ip_addr_t *address)
+{
+    groupHeader_t *header = (groupHeader_t *)g_message;
+    size_t total = sizeof(groupHeader_t) + length;
+    struct pbuf *p;
+    err_t err;
+
+    header->version = GROUP_VERSION;
+    header->type = type;
+    header->flags = (g_online ? GROUP_FLAG_ONLINE : 0) | (g_leader == g_unit ? GROUP_FLAG_LEADER : 0);
+    header->reserved = 0;
+    header->group = g_group;
+    header->unit = g_unit;
+    header->session = g_session;
+    header->sequence = sequence;
+    groupSign(g_message, total, &g_message[total]);
+    total += GROUP_MAC_LEN;
+
+    p = pbuf_alloc(PBUF_TRANSPORT, total, PBUF_RAM);
+    if (!p)
+        return false;
+
+    memcpy(p->payload, g_message, total);
+    err = udp_sendto(g_pcb, p, address, GROUP_PORT);
+    pbuf_free(p);
+
+    return err == ERR_OK;
+}
+
+/**
+ * @brief Finds feed followed by the group.
+ *
+ * @param name  feed name.
+ * @return int  feed index, -1 if not followed.
+ */
+int groupFeedFind(const char *name)
+{
+    for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+    {
+        if (g_feeds[i].followers && !strcmp(g_feeds[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Marks feed as followed by a member, adds it if it's new.
+ *
+ * @param name      feed name.
+ * @param member    member index.
+ * @return int      feed index, -1 if there's no room.
+ */
+int groupFeedFollow(const char *name, int member)
+{
+    int feed = groupFeedFind(name);
+
+    for (int i = 0; feed < 0 && i < GROUP_FEEDS_MAX; i++)
+    {
+        if (g_feeds[i].followers)
+            continue;
+
+        strncpy(g_feeds[i].name, name, GROUP_FEED_NAME_LEN);
+        g_feeds[i].name[GROUP_FEED_NAME_LEN] = 0;
+        g_feeds[i].value = -1;
+        feed = i;
+    }
+
+    if (feed < 0)
+    {
+        g_stats.overflows++;
+        return -1;
+    }
+
+    g_feeds[feed].followers |= 1u << member;
+
+    return feed;
+}
+
+/**
+ * @brief Forgets member's feeds and pending ACKs.
+ *
+ * @param member member index.
+ */
+void groupMemberForget(int member)
+{
+    for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+        g_feeds[i].followers &= ~(1u << member);
+
+    for (int i = 0; i < GROUP_RELAYS_MAX; i++)
+    {
+        g_relays[i].pending &= ~(1u << member);
+        if (!g_relays[i].pending)
+            g_relays[i].active = false;
+    }
+}
+
+/**
+ * @brief Finds member sending the message, adds it if it's new.
+ *
+ * @param header    message header.
+ * @param address   sender address.
+ * @return int      member index, -1 if there's no room.
+ */
+int groupMemberUpdate(const groupHeader_t *header, const ip_addr_t *address)
+{
+    int member = -1;
+
+    for (int i = 0; i < GROUP_MEMBERS_MAX; i++)
+    {
+        if (g_members[i].active && g_members[i].unit == header->unit)
+        {
+            member = i;
+            break;
+        }
+        if (!g_members[i].active && member < 0)
+            member = i;
+    }
+
+    if (member < 0)
+    {
+        g_stats.overflows++;
+        return -1;
+    }
+
+    if (!g_members[member].active || g_members[member].session != header->session)
+    {
+        groupMemberForget(member);
+        g_members[member].active = true;
+        g_members[member].unit = header->unit;
+        g_members[member].session = header->session;
+        g_members[member].lastSequence = 0;
+        LOG_INFO(LOG_MODULE_NETWORK, "group: unit %08x joined", header->unit);
+    }
+
+    g_members[member].flags = header->flags;
+    g_members[member].lastSeen = groupNow();
+    ip_addr_copy(g_members[member].address, *address);
+
+    return member;
+}
+
+/**
+ * @brief Picks the leader, online unit with lowest id.
+ * When no unit is online, this one polls by itself.
+ */
+void groupElect()
+{
+    uint32_t leader = g_unit;
+    bool found = g_online;
+
+    for (int i = 0; i < GROUP_MEMBERS_MAX; i++)
+    {
+        if (!g_members[i].active || !(g_members[i].flags & GROUP_FLAG_ONLINE))
+            continue;
+
+        if (!found || g_members[i].unit < leader)
+        {
+            leader = g_members[i].unit;
+            found = true;
+        }
+    }
+
+    if (leader == g_leader)
+        return;
+
+    g_leader = leader;
+    g_covered = 0;
+    g_stats.elections++;
+    LOG_INFO(LOG_MODULE_NETWORK, "group: leader is %08x", leader);
+}
+
+/**
+ * @brief Checks if own write of a local feed still waits for the leader to catch up.
+ *
+ * @param feed  local feed index.
+ * @return true write is newer than what the leader has.
+ */
+bool groupWriteActive(int feed)
+{
+    if (g_writes[feed].active && groupNow() - g_writes[feed].writtenAt >= GROUP_WRITE_TIMEOUT)
+        g_writes[feed].active = false;
+
+    return g_writes[feed].active;
+}
+
+/**
+ * @brief Checks leader's value against own write of the feed.
+ * HELLO repeats leader's cache, which may still hold the value from before the write,
+ * so only the written value or a newer VALUE ends the write.
+ *
+ * @param feed      local feed index.
+ * @param sequence  message sequence number.
+ * @param value     feed value.
+ * @param hello     true if value comes from HELLO.
+ * @return true     value is outdated by the write.
+ */
+bool groupWriteOutdates(int feed, uint32_t sequence, int8_t value, bool hello)
+{
+    if (!groupWriteActive(feed))
+        return false;
+
+    if (value != g_writes[feed].value && (hello || (int32_t)(sequence - g_writes[feed].sequence) <= 0))
+        return true;
+
+    g_writes[feed].active = false;
+
+    return false;
+}
+
+/**
+ * @brief Passes value from the leader on, if it's newer than what was received already.
+ *
+ * @param member    leader's member index.
+ * @param sequence  message sequence number.
+ * @param name      feed name.
+ * @param value     feed value.
+ * @param hello     true if value comes from HELLO.
+ */
+void groupValueApply(int member, uint32_t sequence, const char *name, int8_t value, bool hello)
+{
+    int feed = groupFeedFind(name);
+
+    if (g_members[member].lastSequence && (int32_t)(sequence - g_members[member].lastSequence) < 0)
+        return;
+
+    g_members[member].lastSequence = sequence;
+
+    if (feed >= 0)
+        g_feeds[feed].value = value;
+
+    for (int i = 0; i < g_localFeedsCount; i++)
+    {
+        if (!strcmp(g_localFeeds[i], name))
+        {
+            if (!groupWriteOutdates(i, sequence, value, hello))
+                g_callback(name, value);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Notes which local feeds the leader polls, those it doesn't are polled by this unit.
+ *
+ * @param name  feed name listed by the leader.
+ */
+void groupFeedCovered(const char *name)
+{
+    for (int i = 0; i < g_localFeedsCount; i++)
+    {
+        if (!strcmp(g_localFeeds[i], name))
+            g_covered |= 1u << i;
+    }
+}
+
+/**
+ * @brief Handles HELLO. Leader's one carries feed values, the others' feeds they follow.
+ * Only the follow set is recomputed, values still waiting for member's ACK stay pending.
+ */
+void groupHelloReceived(int member, const groupHeader_t *header, const uint8_t *payload, size_t length)
+{
+    const char *name;
+    size_t offset = 0;
+    int8_t value;
+    int feed;
+    uint16_t followed = 0;
+    bool leader = (header->flags & GROUP_FLAG_LEADER) != 0;
+
+    if (header->unit == g_leader)
+        g_covered = 0;
+
+    while (groupEntryNext(payload, length, &offset, &name, &value))
+    {
+        if (!leader)
+        {
+            feed = groupFeedFollow(name, member);
+            if (feed >= 0)
+                followed |= 1u << feed;
+            /*
+             * Member wrote the feed itself, relay it to the others, if it's news.
+             */
+            if (feed >= 0 && value >= 0)
+                groupPublish(name, value);
+        }
+        else if (header->unit == g_leader)
+        {
+            groupFeedCovered(name);
+            if (value >= 0)
+                groupValueApply(member, header->sequence, name, value, true);
+        }
+    }
+
+    for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+    {
+        if (!(followed & (1u << i)))
+            g_feeds[i].followers &= ~(1u << member);
+    }
+}
+
+/**
+ * @brief Handles VALUE from the leader, ACKs it even if it was received already.
+ */
+void groupValueReceived(int member, const groupHeader_t *header, const uint8_t *payload, size_t length,
+                        const ip_addr_t *address)
+{
+    const char *name;
+    size_t offset = 0;
+    int8_t value;
+
+    if (header->unit != g_leader || !groupEntryNext(payload, length, &offset, &name, &value))
+        return;
+
+    groupSend(GROUP_MESSAGE_ACK, header->sequence, 0, address);
+    groupValueApply(member, header->sequence, name, value, false);
+}
+
+/**
+ * @brief Handles ACK of relayed value.
+ */
+void groupAckReceived(int member, const groupHeader_t *header)
+{
+    for (int i = 0; i < GROUP_RELAYS_MAX; i++)
+    {
+        if (!g_relays[i].active || g_relays[i].sequence != header->sequence)
+            continue;
+
+        g_stats.acks++;
+        g_relays[i].pending &= ~(1u << member);
+        if (!g_relays[i].pending)
+            g_relays[i].active = false;
+    }
+}
+
+/**
+ * @brief Checks and dispatches received message.
+ */
+static void groupRecv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *address, u16_t port)
+{
+    static uint8_t message[GROUP_MESSAGE_MAX];
+    const groupHeader_t *header = (const groupHeader_t *)message;
+    uint8_t mac[GROUP_MAC_LEN];
+    size_t length = p->tot_len;
+    int member;
+
+    if (length > sizeof message || length < sizeof(groupHeader_t) + GROUP_MAC_LEN)
+    {
+        pbuf_free(p);
+        g_stats.rejected++;
+        return;
+    }
+
+    pbuf_copy_partial(p, message, length, 0);
+    pbuf_free(p);
+
+    if (header->version != GROUP_VERSION || header->group != g_group || header->unit == g_unit)
+        return;
+
+    length -= GROUP_MAC_LEN;
+    groupSign(message, length, mac);
+    if (memcmp(mac, &message[length], GROUP_MAC_LEN))
+    {
+        g_stats.rejected++;
+        return;
+    }
+
+    member = groupMemberUpdate(header, address);
+    if (member < 0)
+        return;
+
+    length -= sizeof(groupHeader_t);
+
+    switch (header->type)
+    {
+    case GROUP_MESSAGE_HELLO:
+        groupElect();
+        groupHelloReceived(member, header, (const uint8_t *)(header + 1), length);
+        break;
+    case GROUP_MESSAGE_VALUE:
+        groupValueReceived(member, header, (const uint8_t *)(header + 1), length, address);
+        break;
+    case GROUP_MESSAGE_ACK:
+        groupAckReceived(member, header);
+        break;
+    }
+}
+
+/**
+ * @brief Sends relayed value to the group.
+ *
+ * @param relay relay.
+ */
+void groupRelaySend(groupRelay_t *relay)
+{
+    groupFeed_t *feed = &g_feeds[relay->feed];
+
+    relay->sentAt = groupNow();
+    groupSend(GROUP_MESSAGE_VALUE, relay->sequence, groupEntryAdd(0, feed->name, feed->value), &g_address);
+}
+
+/**
+ * @brief Sends HELLO. Leader lists values of followed feeds, the others their own feeds,
+ * with values they wrote and the leader didn't catch up with yet.
+ */
+void groupHelloSend()
+{
+    size_t length = 0;
+
+    if (g_leader == g_unit)
+    {
+        for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+        {
+            if (g_feeds[i].followers)
+                length = groupEntryAdd(length, g_feeds[i].name, g_feeds[i].value);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < g_localFeedsCount; i++)
+            length = groupEntryAdd(length, g_localFeeds[i], groupWriteActive(i) ? g_writes[i].value : -1);
+    }
+
+    groupSend(GROUP_MESSAGE_HELLO, g_sequence, length, &g_address);
+    g_lastHello = groupNow();
+}
+
+/**
+ * @brief Joins the group. Wi-Fi must be connected already.
+ * Units are grouped by account, messages are signed with its API key.
+ *
+ * @param username      account name.
+ * @param apiKey        API key.
+ * @param feeds         feeds this unit follows.
+ * @param feedsCount    number of feeds.
+ * @param callback      function receiving relayed values.
+ * @return true         group joined.
+ */
+bool groupStart(const char *username, const char *apiKey, char **feeds, uint8_t feedsCount,
+                groupValueCallback_t callback)
+{
+    uint8_t *mac = cyw43_state.mac;
+
+    if (g_pcb)
+        return false;
+
+    g_key = apiKey;
+    g_group = crc32(username, strlen(username));
+    g_unit = ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+    /*
+     * Wi-Fi join time varies enough, to tell restarts apart.
+     */
+    g_session = time_us_32();
+    g_leader = g_unit;
+    g_localFeeds = feeds;
+    g_localFeedsCount = MIN(feedsCount, GROUP_FEEDS_MAX);
+    g_callback = callback;
+    /*
+     * Organisation-local multicast scope, it doesn't leave the site.
+     */
+    IP_ADDR4(&g_address, 239, 255, 75, 75);
+
+    cyw43_arch_lwip_begin();
+
+    g_pcb = udp_new_ip_type(IPADDR_TYPE_V4);
+    if (!g_pcb || udp_bind(g_pcb, IP_ANY_TYPE, GROUP_PORT) != ERR_OK ||
+        igmp_joingroup(IP4_ADDR_ANY4, ip_2_ip4(&g_address)) != ERR_OK)
+    {
+        if (g_pcb)
+            udp_remove(g_pcb);
+        g_pcb = NULL;
+        cyw43_arch_lwip_end();
+        LOG_ERROR(LOG_MODULE_NETWORK, "group: can't join");
+        return false;
+    }
+
+    udp_recv(g_pcb, groupRecv, NULL);
+    groupHelloSend();
+
+    cyw43_arch_lwip_end();
+
+    LOG_INFO(LOG_MODULE_NETWORK, "group: joined as %08x", g_unit);
+
+    return true;
+}
+
+/**
+ * @brief Tells the group if this unit reaches the cloud.
+ *
+ * @param online true if last request succeeded.
+ */
+void groupSetOnline(bool online)
+{
+    if (online == g_online)
+        return;
+
+    g_online = online;
+    if (g_pcb)
+        groupElect();
+}
+
+/**
+ * @brief Checks if this unit should poll the cloud.
+ *
+ * @return true leader, or not in a group.
+ */
+bool groupIsLeader()
+{
+    return !g_pcb || g_leader == g_unit;
+}
+
+/**
+ * @brief Checks if local feed is polled by the leader. Feeds the leader has no room for,
+ * or didn't list yet, have to be polled by this unit.
+ *
+ * @param feed  local feed index.
+ * @return true leader polls the feed for this unit.
+ */
+bool groupCoversFeed(uint8_t feed)
+{
+    return g_pcb && g_leader != g_unit && feed < g_localFeedsCount && (g_covered & (1u << feed));
+}
+
+/**
+ * @brief Gets feed followed by other units, for the leader to poll.
+ *
+ * @param index         feed slot, up to GROUP_FEEDS_MAX.
+ * @return const char*  feed name, NULL if slot is empty.
+ */
+const char *groupGetFeed(uint8_t index)
+{
+    if (!g_pcb || g_leader != g_unit || !g_feeds[index].followers)
+        return NULL;
+
+    return g_feeds[index].name;
+}
+
+/**
+ * @brief Relays value read by the leader to units following the feed, if it changed.
+ *
+ * @param feedName  feed name.
+ * @param value     feed value.
+ */
+void groupPublish(const char *feedName, int8_t value)
+{
+    int feed = groupFeedFind(feedName);
+    groupRelay_t *relay = NULL;
+
+    if (!g_pcb || g_leader != g_unit || feed < 0 || g_feeds[feed].value == value)
+        return;
+
+    g_feeds[feed].value = value;
+
+    /*
+     * Newer value replaces the one of the same feed still waiting for ACKs.
+     * With no free slot, the oldest relay is given up, HELLO will catch it up.
+     */
+    for (int i = 0; i < GROUP_RELAYS_MAX && !relay; i++)
+    {
+        if (g_relays[i].active && g_relays[i].feed == feed)
+            relay = &g_relays[i];
+    }
+
+    for (int i = 0; i < GROUP_RELAYS_MAX && !relay; i++)
+    {
+        if (!g_relays[i].active)
+            relay = &g_relays[i];
+    }
+
+    if (!relay)
+    {
+        relay = &g_relays[0];
+        for (int i = 1; i < GROUP_RELAYS_MAX; i++)
+        {
+            if ((int32_t)(g_relays[i].sequence - relay->sequence) < 0)
+                relay = &g_relays[i];
+        }
+        g_stats.lost++;
+    }
+
+    relay->active = true;
+    relay->feed = feed;
+    relay->retries = GROUP_RETRIES;
+    relay->pending = g_feeds[feed].followers;
+    relay->sequence = ++g_sequence;
+
+    g_stats.relayed++;
+    groupRelaySend(relay);
+}
+
+/**
+ * @brief Takes note of own write to a feed. Leader relays it to the units following the feed,
+ * follower tells the leader about it, till the leader relays it back.
+ *
+ * @param feedName  feed name.
+ * @param value     written value.
+ */
+void groupWritten(const char *feedName, int8_t value)
+{
+    if (!g_pcb)
+        return;
+
+    if (g_leader == g_unit)
+    {
+        groupPublish(feedName, value);
+        return;
+    }
+
+    for (int i = 0; i < g_localFeedsCount; i++)
+    {
+        if (strcmp(g_localFeeds[i], feedName))
+            continue;
+
+        g_writes[i].active = true;
+        g_writes[i].value = value;
+        g_writes[i].writtenAt = groupNow();
+        g_writes[i].sequence = 0;
+
+        for (int j = 0; j < GROUP_MEMBERS_MAX; j++)
+        {
+            if (g_members[j].active && g_members[j].unit == g_leader)
+                g_writes[i].sequence = g_members[j].lastSequence;
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Sends HELLOs, retransmits unacknowledged values and drops silent members.
+ * Must be called periodically from the network task.
+ */
+void groupUpdate()
+{
+    uint32_t now = groupNow();
+    bool changed = false;
+
+    if (!g_pcb)
+        return;
+
+    for (int i = 0; i < GROUP_MEMBERS_MAX; i++)
+    {
+        if (!g_members[i].active || now - g_members[i].lastSeen < GROUP_MEMBER_TIMEOUT)
+            continue;
+
+        LOG_INFO(LOG_MODULE_NETWORK, "group: unit %08x left", g_members[i].unit);
+        g_members[i].active = false;
+        groupMemberForget(i);
+        changed = true;
+    }
+
+    if (changed)
+        groupElect();
+
+    for (int i = 0; i < GROUP_RELAYS_MAX; i++)
+    {
+        if (!g_relays[i].active || now - g_relays[i].sentAt < GROUP_RETRY_TIME)
+            continue;
+
+        if (!g_relays[i].retries--)
+        {
+            g_relays[i].active = false;
+            g_stats.lost++;
+            continue;
+        }
+
+        g_stats.retransmits++;
+        groupRelaySend(&g_relays[i]);
+    }
+
+    if (now - g_lastHello >= GROUP_HELLO_TIME)
+        groupHelloSend();
+}
+
+/**
+ * @brief Prints group statistics on serial.
+ */
+void groupPrintStats()
+{
+    int members = 0, feeds = 0;
+
+    if (!g_pcb)
+    {
+        printf("GROUP: OFF\n");
+        return;
+    }
+
+    for (int i = 0; i < GROUP_MEMBERS_MAX; i++)
+        members += g_members[i].active;
+    for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+        feeds += g_feeds[i].followers != 0;
+
+    printf("GROUP: %s, UNIT %08lx, LEADER %08lx\n"
+           "MEMBERS: %d\n"
+           "FOLLOWED FEEDS: %d\n"
+           "ELECTIONS: %lu\n"
+           "RELAYED: %lu\n"
+           "ACKS: %lu\n"
+           "RETRANSMITS: %lu\n"
+           "LOST: %lu\n"
+           "REJECTED: %lu\n"
+           "OVERFLOWS: %lu\n",
+           g_leader == g_unit ? "LEADER" : "FOLLOWER", g_unit, g_leader, members, feeds,
+           g_stats.elections, g_stats.relayed, g_stats.acks, g_stats.retransmits,
+           g_stats.lost, g_stats.rejected, g_stats.overflows);
+}
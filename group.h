@@ -0,0 +1,36 @@
+/*
+ * File: group.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#define GROUP_MEMBERS_MAX 8
+#define GROUP_FEEDS_MAX 8
+
+/**
+ * @brief Receives feed value relayed by the leader.
+ *
+ * @param feedName  feed name.
+ * @param value     feed value.
+ */
+typedef void (*groupValueCallback_t)(const char *feedName, int8_t value);
+
+bool groupStart(const char *username, const char *apiKey, char **feeds, uint8_t feedsCount,
+                groupValueCallback_t callback);
+void groupSetOnline(bool online);
+bool groupIsLeader();
+bool groupCoversFeed(uint8_t feed);
+const char *groupGetFeed(uint8_t index);
+void groupPublish(const char *feedName, int8_t value);
+void groupWritten(const char *feedName, int8_t value);
+void groupUpdate();
+void groupPrintStats();
+
+#endif
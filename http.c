@@ -0,0 +1,544 @@
+/*
+ * File: http.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Local control server.
+ *
+ * Minimal HTTP server on lwIP raw TCP API, so commands sent from the same network
+ * don't go through the cloud and wait for the next poll:
+ *   GET  /status               device state and feed value,
+ *   POST /state?value=<0|1>    switches the feed off or on,
+ *   POST /tap?count=<1|2>      taps once or twice,
+ * "feed=<index>" parameter picks other than the main feed. Every request must carry
+ * the shared key, it's accepted only in "X-Klik-Key" header.
+ *
+ * Each request is answered and the connection is closed. Server is advertised
+ * over mDNS as "_http._tcp" service. lwIP runs in poll mode, so all callbacks
+ * come from cyw43_arch_poll() in the main loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/init.h"
+#include "lwip/tcp.h"
+#include "lwip/apps/mdns.h"
+
+#include "http.h"
+#include "log.h"
+
+#define HTTP_CONNECTIONS_MAX 2
+#define HTTP_REQUEST_LEN 512
+#define HTTP_RESPONSE_LEN (HTTP_RESPONSE_BODY_LEN + 128)
+/*
+ * lwIP polls connections every HTTP_POLL_INTERVAL half seconds,
+ * connection without complete request is closed after HTTP_TIMEOUT_POLLS polls.
+ */
+#define HTTP_POLL_INTERVAL 2
+#define HTTP_TIMEOUT_POLLS 3
+
+#define HTTP_REQUEST_END "\r\n\r\n"
+#define HTTP_LINE_END "\r\n"
+#define HTTP_KEY_HEADER "X-Klik-Key:"
+
+#define HTTP_HOSTNAME_LEN 16
+#define HTTP_SERVICE_NAME "Klik"
+#define HTTP_SERVICE_TXT "path=/status"
+#define HTTP_MDNS_TTL 3600
+
+/**
+ * @brief Accepted connection, with request received so far.
+ */
+typedef struct
+{
+    struct tcp_pcb *pcb;
+    uint32_t start;
+    uint16_t length;
+    uint8_t polls;
+    char request[HTTP_REQUEST_LEN + 1];
+} httpConnection_t;
+
+typedef struct
+{
+    uint32_t requests;
+    uint32_t unauthorized;
+    uint32_t badRequests;
+    uint32_t rejected;
+    uint32_t maxResponseTime;
+} httpStats_t;
+
+static struct tcp_pcb *g_listener;
+static httpConnection_t g_connections[HTTP_CONNECTIONS_MAX];
+static httpHandler_t g_handler;
+static const char *g_key;
+static char g_hostname[HTTP_HOSTNAME_LEN + 1];
+static httpStats_t g_stats;
+
+/**
+ * @brief Closes connection. Aborts it, if it can't be closed gracefully.
+ *
+ * @param connection    connection.
+ * @return err_t        ERR_ABRT if aborted, must be passed back to lwIP then.
+ */
+err_t httpClose(httpConnection_t *connection)
+{
+    err_t err = ERR_OK;
+
+    if (!connection->pcb)
+        return ERR_OK;
+
+    tcp_arg(connection->pcb, NULL);
+    tcp_recv(connection->pcb, NULL);
+    tcp_err(connection->pcb, NULL);
+    tcp_poll(connection->pcb, NULL, 0);
+
+    if (tcp_close(connection->pcb) != ERR_OK)
+    {
+        tcp_abort(connection->pcb);
+        err = ERR_ABRT;
+    }
+
+    connection->pcb = NULL;
+
+    return err;
+}
+
+/**
+ * @brief Gets reason phrase of HTTP status code.
+ *
+ * @param status        status code.
+ * @return const char*  reason phrase.
+ */
+const char *httpReason(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 409:
+        return "Conflict";
+    case 431:
+        return "Request Header Fields Too Large";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+/**
+ * @brief Sends response and closes the connection.
+ *
+ * @param connection    connection.
+ * @param status        HTTP status code.
+ * @param body          JSON body.
+ * @return err_t        result of closing the connection.
+ */
+err_t httpRespond(httpConnection_t *connection, int status, const char *body)
+{
+    static char response[HTTP_RESPONSE_LEN];
+    uint32_t responseTime;
+    int length;
+
+    length = snprintf(response, sizeof response,
+                      "HTTP/1.1 %d %s\r\n"
+                      "Content-Type: application/json\r\n"
+                      "Content-Length: %u\r\n"
+                      "Connection: close\r\n"
+                      "\r\n"
+                      "%s",
+                      status, httpReason(status), strlen(body), body);
+
+    if (length >= (int)sizeof response)
+        length = sizeof response - 1;
+
+    if (tcp_write(connection->pcb, response, length, TCP_WRITE_FLAG_COPY) == ERR_OK)
+        tcp_output(connection->pcb);
+
+    responseTime = time_us_32() - connection->start;
+    if (responseTime > g_stats.maxResponseTime)
+        g_stats.maxResponseTime = responseTime;
+
+    return httpClose(connection);
+}
+
+/**
+ * @brief Finds query parameter.
+ *
+ * @param query     query string, NULL if there's none.
+ * @param name      parameter name.
+ * @param length    value length output.
+ * @return char*    parameter value, not terminated, NULL if not found.
+ */
+char *httpParameter(char *query, const char *name, size_t *length)
+{
+    size_t nameLength = strlen(name);
+
+    while (query && *query)
+    {
+        if (!strncmp(query, name, nameLength) && query[nameLength] == '=')
+        {
+            query += nameLength + 1;
+            *length = strcspn(query, "&");
+            return query;
+        }
+
+        query = strchr(query, '&');
+        if (query)
+            query++;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Parses numeric query parameter.
+ *
+ * @param query     query string, NULL if there's none.
+ * @param name      parameter name.
+ * @param min       minimum value.
+ * @param max       maximum value.
+ * @param number    value output, left unchanged if parameter is missing.
+ * @return true     parameter missing, or a number in range.
+ * @return false    parameter is not a number or out of range.
+ */
+bool httpNumberParameter(char *query, const char *name, unsigned long min, unsigned long max, uint32_t *number)
+{
+    size_t length;
+    char *value = httpParameter(query, name, &length);
+    char *end;
+    unsigned long parsed;
+
+    if (!value)
+        return true;
+    if (!length || value[0] < '0' || value[0] > '9')
+        return false;
+
+    parsed = strtoul(value, &end, 10);
+    if (end != value + length || parsed < min || parsed > max)
+        return false;
+
+    *number = parsed;
+    return true;
+}
+
+/**
+ * @brief Checks key sent in the request header. Compares all of it, whether it matches or not.
+ *
+ * @param headers   request headers.
+ * @return true     key is right.
+ */
+bool httpAuthorized(char *headers)
+{
+    size_t keyLength = strlen(g_key);
+    size_t length = 0;
+    uint8_t difference = 0;
+    char *key = NULL;
+
+    for (char *line = headers; !key && line && *line; line = strstr(line, HTTP_LINE_END))
+    {
+        line += strspn(line, HTTP_LINE_END);
+
+        if (!strncasecmp(line, HTTP_KEY_HEADER, strlen(HTTP_KEY_HEADER)))
+        {
+            key = line + strlen(HTTP_KEY_HEADER);
+            key += strspn(key, " ");
+            length = strcspn(key, HTTP_LINE_END);
+        }
+    }
+
+    if (!key || length != keyLength)
+        return false;
+
+    for (size_t i = 0; i < keyLength; i++)
+        difference |= key[i] ^ g_key[i];
+
+    return !difference;
+}
+
+/**
+ * @brief Parses complete request, runs the command and responds.
+ *
+ * @param connection    connection.
+ * @return err_t        result of closing the connection.
+ */
+err_t httpHandleRequest(httpConnection_t *connection)
+{
+    static char body[HTTP_RESPONSE_BODY_LEN];
+    char *method = connection->request;
+    char *path, *query, *headers;
+    uint32_t feed = 0, value;
+    size_t length;
+    int status;
+
+    g_stats.requests++;
+
+    headers = strstr(method, HTTP_LINE_END);
+    *headers = 0;
+    headers += strlen(HTTP_LINE_END);
+
+    path = strchr(method, ' ');
+    if (!path)
+    {
+        g_stats.badRequests++;
+        return httpRespond(connection, 400, "{\"error\":\"bad request\"}");
+    }
+    *path++ = 0;
+    path[strcspn(path, " ")] = 0;
+
+    query = strchr(path, '?');
+    if (query)
+        *query++ = 0;
+
+    if (!httpAuthorized(headers))
+    {
+        g_stats.unauthorized++;
+        return httpRespond(connection, 401, "{\"error\":\"unauthorized\"}");
+    }
+
+    if (!httpNumberParameter(query, "feed", 0, UINT8_MAX, &feed))
+    {
+        g_stats.badRequests++;
+        return httpRespond(connection, 400, "{\"error\":\"bad request\"}");
+    }
+
+    strcpy(body, "{}");
+
+    if (!strcmp(path, "/status"))
+    {
+        if (strcmp(method, "GET"))
+            return httpRespond(connection, 405, "{\"error\":\"method not allowed\"}");
+        status = g_handler(HTTP_COMMAND_STATUS, feed, 0, body);
+    }
+    else if (!strcmp(path, "/state") || !strcmp(path, "/tap"))
+    {
+        if (strcmp(method, "POST"))
+            return httpRespond(connection, 405, "{\"error\":\"method not allowed\"}");
+
+        if (!strcmp(path, "/state"))
+        {
+            status = httpParameter(query, "value", &length) && httpNumberParameter(query, "value", 0, 1, &value)
+                         ? g_handler(HTTP_COMMAND_STATE, feed, value, body)
+                         : 400;
+        }
+        else
+        {
+            value = 1;
+            status = httpNumberParameter(query, "count", 1, 2, &value)
+                         ? g_handler(HTTP_COMMAND_TAP, feed, value, body)
+                         : 400;
+        }
+    }
+    else
+    {
+        return httpRespond(connection, 404, "{\"error\":\"not found\"}");
+    }
+
+    if (status == 400)
+        g_stats.badRequests++;
+
+    return httpRespond(connection, status, body);
+}
+
+/**
+ * @brief Collects request data, handles request once all headers are in.
+ */
+static err_t httpRecv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    httpConnection_t *connection = (httpConnection_t *)arg;
+
+    if (!p)
+        return httpClose(connection);
+
+    connection->length += pbuf_copy_partial(p, connection->request + connection->length,
+                                            HTTP_REQUEST_LEN - connection->length, 0);
+    connection->request[connection->length] = 0;
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+
+    if (strstr(connection->request, HTTP_REQUEST_END))
+        return httpHandleRequest(connection);
+
+    if (connection->length == HTTP_REQUEST_LEN)
+    {
+        g_stats.badRequests++;
+        return httpRespond(connection, 431, "{\"error\":\"request too large\"}");
+    }
+
+    return ERR_OK;
+}
+
+/**
+ * @brief Drops the connection, its pcb is already freed by lwIP.
+ */
+static void httpErr(void *arg, err_t err)
+{
+    httpConnection_t *connection = (httpConnection_t *)arg;
+
+    if (connection)
+        connection->pcb = NULL;
+}
+
+/**
+ * @brief Closes connections that didn't send whole request in time.
+ */
+static err_t httpPoll(void *arg, struct tcp_pcb *pcb)
+{
+    httpConnection_t *connection = (httpConnection_t *)arg;
+
+    if (++connection->polls < HTTP_TIMEOUT_POLLS)
+        return ERR_OK;
+
+    return httpClose(connection);
+}
+
+/**
+ * @brief Takes new connection into a free slot, aborts it if there's none.
+ */
+static err_t httpAccept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    httpConnection_t *connection;
+
+    if (err != ERR_OK || !pcb)
+        return ERR_VAL;
+
+    for (int i = 0; i < HTTP_CONNECTIONS_MAX; i++)
+    {
+        connection = &g_connections[i];
+        if (connection->pcb)
+            continue;
+
+        connection->pcb = pcb;
+        connection->start = time_us_32();
+        connection->length = 0;
+        connection->polls = 0;
+        connection->request[0] = 0;
+
+        tcp_arg(pcb, connection);
+        tcp_recv(pcb, httpRecv);
+        tcp_err(pcb, httpErr);
+        tcp_poll(pcb, httpPoll, HTTP_POLL_INTERVAL);
+
+        return ERR_OK;
+    }
+
+    g_stats.rejected++;
+    tcp_abort(pcb);
+
+    return ERR_ABRT;
+}
+
+/**
+ * @brief Adds TXT record of the mDNS service.
+ */
+static void httpServiceTxt(struct mdns_service *service, void *userdata)
+{
+    mdns_resp_add_service_txtitem(service, HTTP_SERVICE_TXT, strlen(HTTP_SERVICE_TXT));
+}
+
+/**
+ * @brief Advertises the server over mDNS, as klik-<end of MAC address>.local.
+ *
+ * @param port server port.
+ */
+void httpAdvertise(uint16_t port)
+{
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+
+    snprintf(g_hostname, sizeof g_hostname, "klik-%02x%02x%02x",
+             cyw43_state.mac[3], cyw43_state.mac[4], cyw43_state.mac[5]);
+
+    mdns_resp_init();
+#if LWIP_VERSION_MAJOR > 2 || (LWIP_VERSION_MAJOR == 2 && LWIP_VERSION_MINOR >= 2)
+    mdns_resp_add_netif(netif, g_hostname);
+    mdns_resp_add_service(netif, HTTP_SERVICE_NAME, "_http", DNSSD_PROTO_TCP, port, httpServiceTxt, NULL);
+#else
+    mdns_resp_add_netif(netif, g_hostname, HTTP_MDNS_TTL);
+    mdns_resp_add_service(netif, HTTP_SERVICE_NAME, "_http", DNSSD_PROTO_TCP, port, HTTP_MDNS_TTL,
+                          httpServiceTxt, NULL);
+#endif
+}
+
+/**
+ * @brief Starts the server. Wi-Fi must be connected already.
+ *
+ * @param port      TCP port, 0 keeps the server off.
+ * @param key       shared key requests must carry, empty keeps the server off.
+ * @param handler   function carrying out commands.
+ * @return true     server is listening.
+ * @return false    server is off, or could not be started.
+ */
+bool httpServerStart(uint16_t port, const char *key, httpHandler_t handler)
+{
+    struct tcp_pcb *pcb;
+
+    if (!port || !key[0] || g_listener)
+        return false;
+
+    g_key = key;
+    g_handler = handler;
+
+    cyw43_arch_lwip_begin();
+
+    pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!pcb)
+    {
+        cyw43_arch_lwip_end();
+        return false;
+    }
+
+    if (tcp_bind(pcb, IP_ANY_TYPE, port) != ERR_OK ||
+        !(g_listener = tcp_listen_with_backlog(pcb, HTTP_CONNECTIONS_MAX)))
+    {
+        tcp_close(pcb);
+        cyw43_arch_lwip_end();
+        LOG_ERROR(LOG_MODULE_NETWORK, "LAN server: can't listen on port %u", port);
+        return false;
+    }
+
+    tcp_accept(g_listener, httpAccept);
+    httpAdvertise(port);
+
+    cyw43_arch_lwip_end();
+
+    LOG_INFO(LOG_MODULE_NETWORK, "LAN server: listening on port %u", port);
+
+    return true;
+}
+
+/**
+ * @brief Prints server statistics on serial.
+ */
+void httpServerPrintStats()
+{
+    if (!g_listener)
+    {
+        printf("LAN SERVER: OFF\n");
+        return;
+    }
+
+    printf("LAN SERVER: %s.local\n"
+           "REQUESTS: %lu\n"
+           "UNAUTHORIZED: %lu\n"
+           "BAD REQUESTS: %lu\n"
+           "REJECTED CONNECTIONS: %lu\n"
+           "MAX RESPONSE TIME: %lu us\n",
+           g_hostname, g_stats.requests, g_stats.unauthorized, g_stats.badRequests,
+           g_stats.rejected, g_stats.maxResponseTime);
+}
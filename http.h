@@ -0,0 +1,38 @@
+/*
+ * File: http.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#define HTTP_KEY_LEN 32
+#define HTTP_RESPONSE_BODY_LEN 256
+
+typedef enum
+{
+    HTTP_COMMAND_STATUS,
+    HTTP_COMMAND_STATE,
+    HTTP_COMMAND_TAP
+} httpCommand_t;
+
+/**
+ * @brief Carries out command received over LAN.
+ *
+ * @param command   command.
+ * @param feed      feed index, 0 unless given in the request.
+ * @param value     state value or tap count.
+ * @param body      JSON response body, HTTP_RESPONSE_BODY_LEN long.
+ * @return int      HTTP status code.
+ */
+typedef int (*httpHandler_t)(httpCommand_t command, uint8_t feed, int32_t value, char *body);
+
+bool httpServerStart(uint16_t port, const char *key, httpHandler_t handler);
+void httpServerPrintStats();
+
+#endif
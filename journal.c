@@ -0,0 +1,261 @@
+/*
+ * File: journal.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Actuator state journal.
+ *
+ * Every change of the applied state appends a small entry to two flash sectors,
+ * the newest entry with valid CRC wins. Entries share flash pages, a page is programmed
+ * again with the new entry and 0xFF elsewhere, which leaves entries already there intact.
+ * Sector is erased only when the journal moves into it, once per a hundred and more changes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "pico/flash.h"
+
+#include "journal.h"
+#include "crc.h"
+
+#define JOURNAL_MAGIC 0x4C4E524A
+#define JOURNAL_ENTRY_SIZE 32
+#define JOURNAL_ENTRIES_PER_SECTOR (FLASH_SECTOR_SIZE / JOURNAL_ENTRY_SIZE)
+#define JOURNAL_ENTRIES_COUNT (JOURNAL_SECTORS * JOURNAL_ENTRIES_PER_SECTOR)
+#define JOURNAL_ENTRY_NONE -1
+#define JOURNAL_FLASH_TIMEOUT 100
+
+/**
+ * @brief Journal entry. CRC covers sequence and state.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t sequence;
+    journalState_t state;
+    uint32_t crc;
+} journalEntry_t;
+
+_Static_assert(sizeof(journalEntry_t) <= JOURNAL_ENTRY_SIZE, "journal entry must fit its slot");
+_Static_assert(FLASH_PAGE_SIZE % JOURNAL_ENTRY_SIZE == 0, "journal entries must not cross pages");
+
+/**
+ * @brief Flash operation, carried out by journalFlashWrite().
+ */
+typedef struct
+{
+    uint32_t offset;
+    const uint8_t *page;
+    bool erase;
+} journalFlashWrite_t;
+
+static struct
+{
+    bool scanned;
+    int entry;
+    uint32_t sequence;
+    uint32_t writes;
+    uint32_t erases;
+    uint32_t failures;
+} g_journal = {.entry = JOURNAL_ENTRY_NONE};
+
+/**
+ * @brief Gets flash offset of an entry.
+ *
+ * @param entry     entry index.
+ * @return uint32_t offset from flash start.
+ */
+uint32_t journalEntryOffset(int entry)
+{
+    return JOURNAL_OFFSET + entry / JOURNAL_ENTRIES_PER_SECTOR * FLASH_SECTOR_SIZE +
+           entry % JOURNAL_ENTRIES_PER_SECTOR * JOURNAL_ENTRY_SIZE;
+}
+
+/**
+ * @brief Gets entry in flash.
+ *
+ * @param entry                     entry index.
+ * @return const journalEntry_t*    entry.
+ */
+const journalEntry_t *journalEntryGet(int entry)
+{
+    return (const journalEntry_t *)(XIP_BASE + journalEntryOffset(entry));
+}
+
+/**
+ * @brief Computes entry CRC.
+ *
+ * @param entry     entry.
+ * @return uint32_t CRC.
+ */
+uint32_t journalCrc(const journalEntry_t *entry)
+{
+    return crc32(&entry->sequence, sizeof entry->sequence + sizeof entry->state);
+}
+
+/**
+ * @brief Checks if entry is complete and intact.
+ *
+ * @param entry     entry.
+ * @return true     entry valid.
+ * @return false    entry empty, partially written or corrupted.
+ */
+bool journalEntryIsValid(const journalEntry_t *entry)
+{
+    return entry->magic == JOURNAL_MAGIC && journalCrc(entry) == entry->crc;
+}
+
+/**
+ * @brief Finds the newest valid entry. Done once, journal position is tracked by appends afterwards.
+ */
+void journalScan()
+{
+    const journalEntry_t *entry;
+
+    g_journal.scanned = true;
+
+    for (int i = 0; i < JOURNAL_ENTRIES_COUNT; i++)
+    {
+        entry = journalEntryGet(i);
+
+        if (g_journal.entry != JOURNAL_ENTRY_NONE && entry->sequence <= g_journal.sequence)
+            continue;
+
+        if (!journalEntryIsValid(entry))
+            continue;
+
+        g_journal.entry = i;
+        g_journal.sequence = entry->sequence;
+    }
+}
+
+/**
+ * @brief Picks the entry to write next. Moving into next sector erases it first,
+ * the newest entry is always in the sector before.
+ *
+ * @param erase     set to true if sector has to be erased.
+ * @return int      entry index.
+ */
+int journalNextEntry(bool *erase)
+{
+    int entry = g_journal.entry == JOURNAL_ENTRY_NONE ? 0 : (g_journal.entry + 1) % JOURNAL_ENTRIES_COUNT;
+
+    *erase = g_journal.entry == JOURNAL_ENTRY_NONE || entry % JOURNAL_ENTRIES_PER_SECTOR == 0;
+
+    if (*erase || journalEntryGet(entry)->magic == 0xFFFFFFFF)
+        return entry;
+
+    /*
+     * Slot is not empty, write was cut, start with next sector.
+     */
+    entry = (entry / JOURNAL_ENTRIES_PER_SECTOR + 1) % JOURNAL_SECTORS * JOURNAL_ENTRIES_PER_SECTOR;
+    *erase = true;
+
+    return entry;
+}
+
+/**
+ * @brief Programs page holding the entry. Called by flash_safe_execute(),
+ * with the other core and interrupts locked out.
+ *
+ * @param param flash operation (journalFlashWrite_t).
+ */
+void journalFlashWrite(void *param)
+{
+    journalFlashWrite_t *write = param;
+
+    if (write->erase)
+        flash_range_erase(write->offset - write->offset % FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    flash_range_program(write->offset, write->page, FLASH_PAGE_SIZE);
+}
+
+/**
+ * @brief Reads the newest state from the journal.
+ *
+ * @param state     filled with the state.
+ * @return true     state read.
+ * @return false    journal is empty.
+ */
+bool journalRestore(journalState_t *state)
+{
+    if (!g_journal.scanned)
+        journalScan();
+
+    if (g_journal.entry == JOURNAL_ENTRY_NONE)
+        return false;
+
+    memcpy(state, &journalEntryGet(g_journal.entry)->state, sizeof *state);
+
+    return true;
+}
+
+/**
+ * @brief Appends state to the journal. It's a single page program,
+ * write cut at any point leaves previous state in place.
+ *
+ * @param state     state.
+ * @return true     entry written and verified.
+ * @return false    flash could not be accessed, or entry is corrupted.
+ */
+bool journalAppend(const journalState_t *state)
+{
+    static uint8_t page[FLASH_PAGE_SIZE];
+    journalEntry_t *entry;
+    journalFlashWrite_t write;
+    uint32_t offset;
+    int next;
+
+    if (!g_journal.scanned)
+        journalScan();
+
+    next = journalNextEntry(&write.erase);
+    offset = journalEntryOffset(next);
+    entry = (journalEntry_t *)(page + offset % FLASH_PAGE_SIZE);
+    write.offset = offset - offset % FLASH_PAGE_SIZE;
+    write.page = page;
+
+    memset(page, 0xFF, sizeof page);
+    entry->magic = JOURNAL_MAGIC;
+    entry->sequence = g_journal.sequence + 1;
+    memcpy(&entry->state, state, sizeof *state);
+    entry->crc = journalCrc(entry);
+
+    if (flash_safe_execute(journalFlashWrite, &write, JOURNAL_FLASH_TIMEOUT) != PICO_OK ||
+        !journalEntryIsValid(journalEntryGet(next)))
+    {
+        g_journal.failures++;
+        return false;
+    }
+
+    g_journal.entry = next;
+    g_journal.sequence = entry->sequence;
+    g_journal.writes++;
+    g_journal.erases += write.erase;
+
+    return true;
+}
+
+/**
+ * @brief Prints journal position and counters since restart.
+ */
+void journalPrintStats()
+{
+    if (!g_journal.scanned)
+        journalScan();
+
+    printf("ENTRY: %d/%d\n"
+           "SEQUENCE: %lu\n"
+           "WRITES: %lu\n"
+           "ERASES: %lu\n"
+           "FAILURES: %lu\n",
+           g_journal.entry, JOURNAL_ENTRIES_COUNT, g_journal.sequence,
+           g_journal.writes, g_journal.erases, g_journal.failures);
+}
@@ -0,0 +1,41 @@
+/*
+ * File: journal.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "hardware/flash.h"
+#include "servo.h"
+#include "ota.h"
+
+/*
+ * Actuator state journal takes free flash right after the update state sector.
+ */
+#define JOURNAL_SECTORS 2
+#define JOURNAL_OFFSET (OTA_STATE_OFFSET + FLASH_SECTOR_SIZE)
+#define JOURNAL_CHANNELS_MAX SERVO_CHANNELS_MAX
+#define JOURNAL_FEEDS_MAX (SERVO_CHANNELS_MAX + 1)
+
+/**
+ * @brief Actuator state, as last applied: value of every local feed and angle of every channel.
+ * Layout tells which configuration the indexes belong to.
+ */
+typedef struct __attribute__((packed))
+{
+    uint16_t layout;
+    int8_t values[JOURNAL_FEEDS_MAX];
+    uint8_t angles[JOURNAL_CHANNELS_MAX];
+} journalState_t;
+
+bool journalRestore(journalState_t *state);
+bool journalAppend(const journalState_t *state);
+void journalPrintStats();
+
+#endif
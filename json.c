@@ -0,0 +1,211 @@
+/*
+ * File: json.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Streaming JSON scanner.
+ *
+ * Document is fed in pieces as they come from the network, split anywhere,
+ * and reported through a callback in a single pass, so it never has to be held
+ * in memory as a whole. It's forgiving, not validating, escapes are kept as they are,
+ * except for quotes and backslashes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#include "json.h"
+
+/**
+ * @brief Prepares scanner for a new document.
+ *
+ * @param scanner   scanner.
+ * @param callback  function receiving scanned pieces.
+ * @param context   passed to callback.
+ */
+void jsonScannerInit(jsonScanner_t *scanner, jsonCallback_t callback, void *context)
+{
+    memset(scanner, 0, sizeof *scanner);
+    scanner->callback = callback;
+    scanner->context = context;
+}
+
+/**
+ * @brief Checks if scanner is directly inside an object.
+ *
+ * @param scanner   scanner.
+ * @return true     in object, false in array or outside.
+ */
+bool jsonInObject(jsonScanner_t *scanner)
+{
+    return scanner->depth && (scanner->objects & (1u << (scanner->depth - 1)));
+}
+
+/**
+ * @brief Reports scalar value and forgets its key.
+ *
+ * @param scanner scanner.
+ */
+void jsonValueEnd(jsonScanner_t *scanner)
+{
+    scanner->value[scanner->valueLength] = 0;
+    scanner->callback(scanner->context, JSON_EVENT_VALUE, scanner->key, scanner->value, scanner->depth);
+    scanner->key[0] = 0;
+    scanner->state = JSON_STATE_STRUCTURE;
+}
+
+/**
+ * @brief Adds character to key or value being read, whatever doesn't fit is dropped.
+ *
+ * @param scanner   scanner.
+ * @param c         character.
+ */
+void jsonAppend(jsonScanner_t *scanner, char c)
+{
+    if (scanner->readingKey)
+    {
+        if (scanner->keyLength < JSON_KEY_LEN)
+            scanner->key[scanner->keyLength++] = c;
+    }
+    else if (scanner->valueLength < JSON_VALUE_LEN)
+    {
+        scanner->value[scanner->valueLength++] = c;
+    }
+}
+
+/**
+ * @brief Handles character outside of strings and literals.
+ *
+ * @param scanner   scanner.
+ * @param c         character.
+ */
+void jsonStructure(jsonScanner_t *scanner, char c)
+{
+    switch (c)
+    {
+    case '{':
+    case '[':
+        if (scanner->depth == JSON_DEPTH_MAX)
+        {
+            scanner->state = JSON_STATE_ERROR;
+            return;
+        }
+
+        scanner->depth++;
+        if (c == '{')
+            scanner->objects |= 1u << (scanner->depth - 1);
+        else
+            scanner->objects &= ~(1u << (scanner->depth - 1));
+
+        scanner->callback(scanner->context, JSON_EVENT_OPEN, scanner->key, "", scanner->depth);
+        scanner->key[0] = 0;
+        scanner->expectKey = c == '{';
+        break;
+    case '}':
+    case ']':
+        if (!scanner->depth)
+        {
+            scanner->state = JSON_STATE_ERROR;
+            return;
+        }
+
+        scanner->callback(scanner->context, JSON_EVENT_CLOSE, "", "", scanner->depth);
+        scanner->depth--;
+        scanner->key[0] = 0;
+        break;
+    case ',':
+        scanner->expectKey = jsonInObject(scanner);
+        break;
+    case ':':
+        scanner->expectKey = false;
+        break;
+    case '"':
+        scanner->readingKey = jsonInObject(scanner) && scanner->expectKey;
+        if (scanner->readingKey)
+            scanner->keyLength = 0;
+        scanner->valueLength = 0;
+        scanner->state = JSON_STATE_STRING;
+        break;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        break;
+    default:
+        scanner->readingKey = false;
+        scanner->valueLength = 0;
+        jsonAppend(scanner, c);
+        scanner->state = JSON_STATE_LITERAL;
+        break;
+    }
+}
+
+/**
+ * @brief Scans next piece of the document.
+ *
+ * @param scanner   scanner.
+ * @param data      piece of the document.
+ * @param length    piece length.
+ */
+void jsonScannerFeed(jsonScanner_t *scanner, const char *data, size_t length)
+{
+    char c;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        c = data[i];
+
+        switch (scanner->state)
+        {
+        case JSON_STATE_STRUCTURE:
+            jsonStructure(scanner, c);
+            break;
+        case JSON_STATE_STRING:
+            if (c == '\\')
+            {
+                scanner->state = JSON_STATE_ESCAPE;
+            }
+            else if (c != '"')
+            {
+                jsonAppend(scanner, c);
+            }
+            else if (scanner->readingKey)
+            {
+                scanner->key[scanner->keyLength] = 0;
+                scanner->readingKey = false;
+                scanner->state = JSON_STATE_STRUCTURE;
+            }
+            else
+            {
+                jsonValueEnd(scanner);
+            }
+            break;
+        case JSON_STATE_ESCAPE:
+            if (c != '"' && c != '\\')
+                jsonAppend(scanner, '\\');
+            jsonAppend(scanner, c);
+            scanner->state = JSON_STATE_STRING;
+            break;
+        case JSON_STATE_LITERAL:
+            if (strchr(",}] \t\r\n", c))
+            {
+                jsonValueEnd(scanner);
+                jsonStructure(scanner, c);
+            }
+            else
+            {
+                jsonAppend(scanner, c);
+            }
+            break;
+        case JSON_STATE_ERROR:
+            return;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * File: json.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#define JSON_KEY_LEN 32
+#define JSON_VALUE_LEN 128
+/*
+ * Deeper documents are not scanned any further.
+ */
+#define JSON_DEPTH_MAX 32
+
+typedef enum
+{
+    JSON_EVENT_OPEN,
+    JSON_EVENT_VALUE,
+    JSON_EVENT_CLOSE
+} jsonEvent_t;
+
+/**
+ * @brief Receives scanned document piece by piece.
+ * Object or array opening comes with the key it's under and its depth, root being 1.
+ * Value comes with its key (empty in arrays), as text, strings without quotes.
+ * Closing comes with depth of what's closed.
+ *
+ * @param context   context given to jsonScannerInit().
+ * @param event     event.
+ * @param key       key, truncated to JSON_KEY_LEN.
+ * @param value     value, truncated to JSON_VALUE_LEN, empty for opening and closing.
+ * @param depth     depth.
+ */
+typedef void (*jsonCallback_t)(void *context, jsonEvent_t event, const char *key, const char *value, uint8_t depth);
+
+typedef enum
+{
+    JSON_STATE_STRUCTURE,
+    JSON_STATE_STRING,
+    JSON_STATE_ESCAPE,
+    JSON_STATE_LITERAL,
+    JSON_STATE_ERROR
+} jsonState_t;
+
+typedef struct
+{
+    jsonState_t state;
+    uint8_t depth;
+    uint32_t objects;
+    bool expectKey;
+    bool readingKey;
+    uint8_t keyLength;
+    uint8_t valueLength;
+    char key[JSON_KEY_LEN + 1];
+    char value[JSON_VALUE_LEN + 1];
+    jsonCallback_t callback;
+    void *context;
+} jsonScanner_t;
+
+void jsonScannerInit(jsonScanner_t *scanner, jsonCallback_t callback, void *context);
+void jsonScannerFeed(jsonScanner_t *scanner, const char *data, size_t length);
+
+#endif
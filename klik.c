@@ -15,23 +15,55 @@
 
 #include "button.h"
 #include "serial.h"
+#include "protocol.h"
+#include "telemetry.h"
 #include "led.h"
 #include "servo.h"
 #include "request.h"
+#include "http.h"
+#include "group.h"
+#include "ota.h"
+#include "journal.h"
 #include "config.h"
-
-#define BUTTON_PIN 26
-
-#define LED_BLUE 20
-#define LED_GREEN 19
-#define LED_RED 18
-
-#define SERVO_PIN 21
+#include "profiler.h"
+#include "event.h"
+#include "log.h"
+#include "crc.h"
 
 #define RESPONSE_VALUE_STRING "\"value\":\""
 
 #define TAP_BREAK_TIME 500
 #define BREAK_TIME 1000
+#define REQUEST_POLL_TIME 1
+#define CONFIG_POLL_TIME 10
+#define NETWORK_TICK_TIME 5
+/*
+ * After this many failed requests in a row, unit stops telling the group it reaches the cloud.
+ */
+#define OFFLINE_FAILURES 3
+/*
+ * Write rejected by the server is tried this many more times, then dropped.
+ */
+#define WRITE_RETRIES 3
+
+/*
+ * Each channel can follow its own feed, main feed is always first.
+ * Group leader polls feeds of the other units after its own ones.
+ */
+#define KLIK_LOCAL_FEEDS_MAX (CONFIG_CHANNELS_MAX + 1)
+#define KLIK_FEEDS_MAX (KLIK_LOCAL_FEEDS_MAX + GROUP_FEEDS_MAX)
+
+_Static_assert(KLIK_LOCAL_FEEDS_MAX <= JOURNAL_FEEDS_MAX, "journal must hold every local feed");
+
+/*
+ * Event values carrying feed value, or completed motion.
+ */
+#define KLIK_FEED_EVENT(feed, value) (((feed) << 8) | ((value) & 0xFF))
+#define KLIK_FEED_EVENT_FEED(event) (((event) >> 8) & 0xFF)
+#define KLIK_FEED_EVENT_VALUE(event) ((int8_t)((event) & 0xFF))
+#define KLIK_MOTION_EVENT(channel, id) (((channel) << 16) | (id))
+#define KLIK_MOTION_EVENT_CHANNEL(event) (((event) >> 16) & 0xFF)
+#define KLIK_MOTION_EVENT_ID(event) ((event) & 0xFFFF)
 
 typedef enum
 {
@@ -48,9 +80,80 @@ typedef enum
     KLIK_MODE_OFF,
     KLIK_MODE_ON,
     KLIK_MODE_TAP,
-    KLIK_MODE_DOUBLE_TAP
+    KLIK_MODE_DOUBLE_TAP,
+    /*
+     * Values from here on run macros, first value runs macro 0.
+     */
+    KLIK_MODE_MACRO
 } klik_mode_t;
 
+typedef enum
+{
+    KLIK_EVENT_TICK,
+    KLIK_EVENT_POLL,
+    KLIK_EVENT_SERVICE,
+    KLIK_EVENT_FEED_VALUE,
+    KLIK_EVENT_FEED_WRITE,
+    KLIK_EVENT_BUTTON_PRESSED,
+    KLIK_EVENT_BUTTON_QUEUED,
+    KLIK_EVENT_MOTION_DONE,
+    KLIK_EVENT_STATE,
+    KLIK_EVENT_SERIAL_INPUT,
+    KLIK_EVENT_NETWORK_TICK,
+    KLIK_EVENT_OTA
+} klik_event_t;
+
+/**
+ * @brief Network task state. Only one request is carried out at the time.
+ */
+typedef struct
+{
+    bool busy;
+    bool writing;
+    bool pollingGroup;
+    bool pollingMissing;
+    bool ota;
+    uint8_t feed;
+    uint8_t pollFeed;
+    bool writePending[KLIK_FEEDS_MAX];
+    bool writeApply[KLIK_FEEDS_MAX];
+    int8_t writeValue[KLIK_FEEDS_MAX];
+    uint8_t writeRetries[KLIK_FEEDS_MAX];
+    int8_t lastValue[KLIK_FEEDS_MAX];
+    int8_t polledValue[KLIK_FEEDS_MAX];
+    bool groupMissing[KLIK_FEEDS_MAX];
+    bool restored[KLIK_LOCAL_FEEDS_MAX];
+    uint8_t feedsLeftOut;
+    uint8_t failures;
+    uint32_t requestStart;
+    uint16_t latency;
+    uint16_t requestErrors;
+} networkState_t;
+
+/**
+ * @brief Servo channel, as set up from configuration.
+ */
+typedef struct
+{
+    bool enabled;
+    uint8_t feed;
+    uint8_t angleMax;
+    uint16_t actionId;
+} channel_t;
+
+static config_t g_config;
+static state_t g_state = KLIK_STATE_SETUP;
+static networkState_t g_network;
+
+static char *g_feeds[KLIK_FEEDS_MAX];
+static uint8_t g_feedsCount;
+static uint8_t g_localFeedsCount;
+static char g_groupFeeds[GROUP_FEEDS_MAX][REQUEST_API_FEED_NAME_LEN + 1];
+static channel_t g_channels[CONFIG_CHANNELS_MAX];
+static journalState_t g_appliedState;
+static journalState_t g_journaledState;
+static ledDiode_t g_led;
+
 /**
  * @brief Blinks led diode according to state.
  *
@@ -58,43 +161,54 @@ typedef enum
  */
 void diodeSetState(state_t state)
 {
-    static bool firstTimeSetupDone;
-    static ledDiode_t led;
-    static struct repeating_timer timer;
-
-    if (!firstTimeSetupDone)
-    {
-        ledDiodeSetup(&led, LED_BLUE, LED_GREEN, LED_RED);
-        firstTimeSetupDone = true;
-    }
-    else
-    {
-        cancel_repeating_timer(&timer);
-        ledDiodeDim(&led);
-    }
-
     switch (state)
     {
     case KLIK_STATE_SETUP:
-        ledCycle(&led, &timer, 200, COLOR_GREEN, COLOR_BLUE);
+        ledPlay(&g_led, LED_PATTERN_CYCLE_GREEN_BLUE);
         break;
     case KLIK_STATE_CONNECTING:
-        ledCycle(&led, &timer, 200, COLOR_BLUE, COLOR_RED);
+        ledPlay(&g_led, LED_PATTERN_CYCLE_BLUE_RED);
         break;
     case KLIK_STATE_CONNECTION_ERROR:
-        ledBlink(&led, &timer, COLOR_RED, 1000);
+        ledPlay(&g_led, LED_PATTERN_BLINK_RED);
         break;
     case KLIK_STATE_REQUEST_ERROR:
-        ledBlink(&led, &timer, COLOR_BLUE, 1000);
+        ledPlay(&g_led, LED_PATTERN_BLINK_BLUE);
         break;
     case KLIK_STATE_WORKING:
-        ledBlink(&led, &timer, COLOR_GREEN, 5000);
+        ledPlay(&g_led, LED_PATTERN_BLINK_GREEN_SLOW);
         break;
     case KLIK_STATE_UNDEFINED:
         break;
     }
 }
 
+/**
+ * @brief Parses feed value, the leading digits of the text.
+ *
+ * @param text      value text.
+ * @return int8_t   value, negative if there's no value or it's overfilled.
+ */
+int8_t parseFeedValue(const char *text)
+{
+    int value = 0;
+
+    if (!isdigit((unsigned char)text[0]))
+        return -1;
+
+    while (isdigit((unsigned char)text[0]))
+    {
+        value *= 10;
+        value += text[0] - '0';
+        text++;
+
+        if (value > INT8_MAX)
+            return -1;
+    }
+
+    return value;
+}
+
 /**
  * @brief Gets the value from request.
  *
@@ -104,188 +218,1056 @@ void diodeSetState(state_t state)
  */
 int8_t getValueFromResponse(char *response)
 {
-    int8_t value = 0;
     char *valueString = strstr(response, RESPONSE_VALUE_STRING);
 
     if (!valueString)
         return -1;
 
-    valueString += strlen(RESPONSE_VALUE_STRING);
+    return parseFeedValue(valueString + strlen(RESPONSE_VALUE_STRING));
+}
 
-    while (isdigit(valueString[0]))
+/**
+ * @brief Moves servos following the feed to corner positions by value.
+ *
+ * @param feed  feed index.
+ * @param max   true if to max allowed angle, false to position 0.
+ */
+void moveServoByValue(uint8_t feed, bool max)
+{
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
     {
-        value *= 10;
-        value += valueString[0] - '0';
-        valueString++;
+        if (g_channels[i].enabled && g_channels[i].feed == feed)
+            servoMotionQueue(i, SERVO_MOTION_MOVE, max ? g_channels[i].angleMax : 0, 0, 0);
     }
+}
 
-    return value;
+/**
+ * @brief Starts momentary action (tap or macro) on servos following the feed.
+ * Feed is switched back off, once all of them are done.
+ *
+ * @param feed      feed index.
+ * @param type      SERVO_MOTION_TAP or SERVO_MOTION_MACRO.
+ * @param count     how many times of back and forth motion, or macro index.
+ * @return true     at least one action queued.
+ * @return false    nothing to do.
+ */
+bool actionServoByFeed(uint8_t feed, servoMotionType_t type, uint8_t count)
+{
+    bool queued = false;
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        if (!g_channels[i].enabled || g_channels[i].feed != feed)
+            continue;
+
+        g_channels[i].actionId = servoMotionQueue(i, type, g_channels[i].angleMax, count, TAP_BREAK_TIME);
+        queued |= g_channels[i].actionId != 0;
+    }
+
+    return queued;
+}
+
+/**
+ * @brief Checks if any servo following the feed is still carrying out an action.
+ *
+ * @param feed  feed index.
+ * @return true tap or macro in progress.
+ */
+bool feedActionRunning(uint8_t feed)
+{
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        if (g_channels[i].enabled && g_channels[i].feed == feed && g_channels[i].actionId)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Adds feed to the list of polled feeds, unless it's already there.
+ *
+ * @param feedName  feed name.
+ * @return int      feed index, negative if there's no room for another local feed.
+ */
+int feedsAdd(char *feedName)
+{
+    for (int i = 0; i < g_feedsCount; i++)
+    {
+        if (!strcmp(g_feeds[i], feedName))
+            return i;
+    }
+
+    if (g_feedsCount == KLIK_LOCAL_FEEDS_MAX)
+    {
+        LOG_ERROR(LOG_MODULE_NETWORK, "feed table full, feed dropped");
+        return -1;
+    }
+
+    g_feeds[g_feedsCount] = feedName;
+    g_localFeedsCount = g_feedsCount + 1;
+
+    return g_feedsCount++;
+}
+
+/**
+ * @brief Appends feeds followed by other units of the group to the polled ones.
+ * Names are copied, so they stay valid till the next poll cycle, whatever the group does.
+ * Feeds that don't fit are left out and counted.
+ */
+void feedsSyncGroup()
+{
+    const char *feedName;
+    char *groupFeed;
+    uint8_t feed = g_localFeedsCount;
+    uint8_t leftOut = 0;
+    bool known;
+
+    for (int i = 0; i < GROUP_FEEDS_MAX; i++)
+    {
+        feedName = groupGetFeed(i);
+        if (!feedName)
+            continue;
+
+        known = false;
+        for (int j = 0; j < g_localFeedsCount; j++)
+            known |= !strcmp(g_feeds[j], feedName);
+        if (known)
+            continue;
+
+        if (feed == KLIK_FEEDS_MAX)
+        {
+            leftOut++;
+            continue;
+        }
+
+        groupFeed = g_groupFeeds[feed - g_localFeedsCount];
+        if (strcmp(groupFeed, feedName))
+        {
+            strcpy(groupFeed, feedName);
+            g_network.lastValue[feed] = -1;
+        }
+
+        g_feeds[feed++] = groupFeed;
+    }
+
+    g_feedsCount = feed;
+
+    if (leftOut != g_network.feedsLeftOut)
+    {
+        g_network.feedsLeftOut = leftOut;
+        if (leftOut)
+            LOG_WARNING(LOG_MODULE_NETWORK, "group: %u feeds left out, no room to poll them", leftOut);
+    }
+}
+
+/**
+ * @brief Sets servo channels up from configuration and starts them.
+ * Channels without own feed and angle follow main feed and ANGL.
+ */
+void channelsSetup()
+{
+    configChannel_t *channel;
+    int feed;
+
+    feedsAdd(g_config.feedName);
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        channel = &g_config.channels[i];
+
+        if (channel->pin == CONFIG_CHANNEL_PIN_NONE)
+            continue;
+
+        feed = feedsAdd(channel->feedName[0] ? channel->feedName : g_config.feedName);
+        if (feed < 0 || servoSetup(i, channel->pin) == SERVO_OUTPUT_NONE)
+            continue;
+
+        g_channels[i].enabled = true;
+        g_channels[i].angleMax = channel->angleMax ? channel->angleMax : g_config.angleMax;
+        g_channels[i].feed = feed;
+        servoSetAngleMax(i, g_channels[i].angleMax);
+    }
+
+    servoStart();
+}
+
+/**
+ * @brief Fingerprint of feeds and channels setup. Journaled state is restored only to the same one.
+ *
+ * @return uint16_t layout.
+ */
+uint16_t actuatorStateLayout()
+{
+    uint32_t crc = CRC32_INITIAL;
+
+    for (int i = 0; i < g_localFeedsCount; i++)
+        crc = crc32Update(crc, g_feeds[i], strlen(g_feeds[i]) + 1);
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        crc = crc32Update(crc, &g_config.channels[i].pin, sizeof g_config.channels[i].pin);
+        crc = crc32Update(crc, &g_channels[i].feed, sizeof g_channels[i].feed);
+        crc = crc32Update(crc, &g_channels[i].angleMax, sizeof g_channels[i].angleMax);
+    }
+
+    return ~crc;
+}
+
+/**
+ * @brief Puts servos back where they were before restart and starts feeds from their last values,
+ * long before Wi-Fi is up. First poll reconciles them with the cloud, like any other value.
+ */
+void actuatorStateRestore()
+{
+    journalState_t state;
+
+    g_appliedState.layout = actuatorStateLayout();
+    memset(g_appliedState.values, -1, sizeof g_appliedState.values);
+
+    if (!journalRestore(&state) || state.layout != g_appliedState.layout)
+        return;
+
+    for (int i = 0; i < g_localFeedsCount; i++)
+    {
+        if (state.values[i] != KLIK_MODE_ON && state.values[i] != KLIK_MODE_OFF)
+            continue;
+
+        g_appliedState.values[i] = state.values[i];
+        g_network.lastValue[i] = state.values[i];
+        g_network.restored[i] = true;
+    }
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        if (!g_channels[i].enabled || state.angles[i] > g_channels[i].angleMax)
+            continue;
+
+        g_appliedState.angles[i] = state.angles[i];
+        servoMoveToAngle(i, state.angles[i]);
+    }
+
+    g_journaledState = g_appliedState;
+}
+
+/**
+ * @brief Records value applied to the feed and where its servos end up.
+ * State is journaled only when it changed, repeated polls of the same value don't touch flash.
+ *
+ * @param feed  feed index.
+ * @param value KLIK_MODE_ON or KLIK_MODE_OFF for moves, KLIK_MODE_OFF once action is done.
+ * @param moved true if servos were sent to corner position, false if they rest after action.
+ */
+void actuatorStateSave(uint8_t feed, int8_t value, bool moved)
+{
+    g_appliedState.values[feed] = value;
+
+    for (int i = 0; i < CONFIG_CHANNELS_MAX; i++)
+    {
+        if (!g_channels[i].enabled || g_channels[i].feed != feed)
+            continue;
+
+        if (moved)
+            g_appliedState.angles[i] = value == KLIK_MODE_ON ? g_channels[i].angleMax : 0;
+        else
+            g_appliedState.angles[i] = servoGetAngle(i);
+    }
+
+    if (!memcmp(&g_appliedState, &g_journaledState, sizeof g_appliedState))
+        return;
+
+    if (journalAppend(&g_appliedState))
+        g_journaledState = g_appliedState;
+}
+
+/**
+ * @brief Sets device state and lets the LED task show it.
+ *
+ * @param state new device state.
+ */
+void setState(state_t state)
+{
+    g_state = state;
+    groupSetOnline(state == KLIK_STATE_WORKING);
+    eventPost(EVENT_TASK_LED, KLIK_EVENT_STATE, state);
+}
+
+/**
+ * @brief Counts failed requests in a row. After a few, unit goes offline for the group,
+ * so a unit that reaches the cloud takes the leadership over.
+ *
+ * @param failed true if request failed.
+ */
+void networkCountFailure(bool failed)
+{
+    if (!failed)
+    {
+        g_network.failures = 0;
+        groupSetOnline(g_state == KLIK_STATE_WORKING);
+        return;
+    }
+
+    if (g_network.failures < UINT8_MAX)
+        g_network.failures++;
+    if (g_network.failures >= OFFLINE_FAILURES)
+        groupSetOnline(false);
 }
 
 /**
- * @brief Moves servo to corner positions by value.
+ * @brief Takes feed value out of group response as it's parsed.
+ * Feeds in a group have keys prefixed with the group key, so both forms are matched.
+ * Called from network stack callbacks.
  *
- * @param max true if to max allowed angle, false to position 0.
- * @param maxAngle maximum angle of motion.
+ * @param feedKey   feed key.
+ * @param value     feed value text.
  */
-void moveServoByValue(bool max, uint8_t maxAngle)
+void feedValueReceived(const char *feedKey, const char *value)
 {
-    float angle = (float)maxAngle;
-    if (max)
-        servoMoveToAngle(SERVO_PIN, angle);
+    size_t keyLength = strlen(feedKey);
+    size_t nameLength;
+
+    for (int i = 0; i < g_feedsCount; i++)
+    {
+        nameLength = strlen(g_feeds[i]);
+
+        if (strcmp(feedKey, g_feeds[i]) &&
+            (keyLength <= nameLength || feedKey[keyLength - nameLength - 1] != '.' ||
+             strcmp(feedKey + keyLength - nameLength, g_feeds[i])))
+            continue;
+
+        g_network.polledValue[i] = parseFeedValue(value);
+    }
+}
+
+/**
+ * @brief Lets network task rest till next poll. Firmware update, if there's one,
+ *        takes the time instead.
+ */
+void networkRest()
+{
+    if (otaPending())
+        eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_OTA, 0);
     else
-        servoMoveToAngle(SERVO_PIN, 0);
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_POLL, 0, BREAK_TIME);
 }
 
 /**
- * @brief Moves servo back and forth.
+ * @brief Finds next feed missing from feed group response.
  *
- * @param count     how many times of back and forth motion.
- * @param maxAngle  maximum angle of motion.
+ * @param from  feed index to start with.
+ * @return int  feed index, -1 if there's none.
+ */
+int networkNextMissing(int from)
+{
+    for (int i = from; i < g_feedsCount; i++)
+    {
+        if (g_network.groupMissing[i])
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Starts next pending request. Writes take precedence over polling.
+ * With feed group set, all feeds are polled at once, then the ones missing
+ * from the group one by one. Otherwise all of them are polled one by one.
  */
-void servoTap(uint8_t count, uint8_t maxAngle)
+void networkStartRequest()
 {
-    bool tapState = false;
-    uint8_t cycles = (2 * count) + 1;
+    char *request;
+    int feed;
+
+    for (feed = 0; feed < g_feedsCount; feed++)
+    {
+        if (g_network.writePending[feed])
+            break;
+    }
 
-    for (int i = 0; i < cycles; i++)
+    if (feed < g_feedsCount)
     {
-        moveServoByValue(tapState, maxAngle);
-        tapState = !tapState;
-        sleep_ms(TAP_BREAK_TIME);
+        request = requestPreparePOST(g_network.writeValue[feed], g_config.username, g_feeds[feed], g_config.apiKey);
+        g_network.writing = true;
+    }
+    else
+    {
+        /*
+         * Group leader polls for the whole group, the others only their feeds it doesn't poll.
+         */
+        if (!groupIsLeader())
+        {
+            g_network.pollingMissing = false;
+            while (g_network.pollFeed < g_localFeedsCount && groupCoversFeed(g_network.pollFeed))
+                g_network.pollFeed++;
+
+            if (g_network.pollFeed >= g_localFeedsCount)
+            {
+                g_network.pollFeed = 0;
+                networkRest();
+                return;
+            }
+        }
+        else if (!g_network.pollFeed && !g_network.pollingMissing)
+        {
+            feedsSyncGroup();
+        }
+
+        feed = g_network.pollFeed;
+        g_network.writing = false;
+        g_network.pollingGroup = g_config.feedGroup[0] && groupIsLeader() && !g_network.pollingMissing;
+
+        if (g_network.pollingGroup)
+        {
+            memset(g_network.polledValue, -1, sizeof g_network.polledValue);
+            request = requestPrepareGroupGET(g_config.username, g_config.feedGroup, g_config.apiKey);
+        }
+        else
+        {
+            request = requestPrepareGET(g_config.username, g_feeds[feed], g_config.apiKey);
+        }
+    }
+
+    g_network.feed = feed;
+    g_network.requestStart = to_ms_since_boot(get_absolute_time());
+
+    if (!g_network.writing && g_network.pollingGroup)
+        g_network.busy = requestBeginGroup(request, feedValueReceived);
+    else
+        g_network.busy = requestBegin(request);
+
+    if (g_network.busy)
+    {
+        /*
+         * Write stays pending till it's on its way, so a connection that can't be opened doesn't lose it.
+         */
+        if (g_network.writing)
+            g_network.writePending[feed] = false;
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_SERVICE, 0, REQUEST_POLL_TIME);
+    }
+    else
+    {
+        g_network.requestErrors++;
+        networkCountFailure(true);
+        LOG_ERROR(LOG_MODULE_NETWORK, "feed %u: request not started", feed);
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_POLL, 0, BREAK_TIME);
     }
 }
 
 /**
- * @brief Updates config if data present on usb serial.
- * There's no USB serial interrupt, so it must be called manually.
+ * @brief Checks if any write is waiting.
+ *
+ * @return true write pending.
  */
-void usbSerialUpdateConfig()
+bool networkWritePending()
 {
-    char *configLine = serialUsbGetLastLine();
+    for (int i = 0; i < g_feedsCount; i++)
+    {
+        if (g_network.writePending[i])
+            return true;
+    }
 
-    if (configLine)
-        configHandler(configLine);
+    return false;
 }
 
 /**
- * @brief main(), lol.
+ * @brief Applies polled feed value.
+ * Value read before pending write is outdated, so it's skipped.
+ *
+ * @param feed      feed index.
+ * @param value     polled value, negative if there was none.
+ * @return true     value applied or skipped.
+ * @return false    no value.
  */
-int main()
+bool networkApplyValue(uint8_t feed, int8_t value)
 {
-    config_t config;
-    char *request, *response;
-    int8_t responseValue;
+    if (g_network.writePending[feed])
+        return true;
 
-    stdio_init_all();
+    if (value < 0)
+    {
+        g_network.requestErrors++;
+        LOG_WARNING(LOG_MODULE_NETWORK, "feed %u: no value in response", feed);
+        return false;
+    }
 
-    /*
-     * INITIAL SETUP
-     */
+    if (feed < g_localFeedsCount && g_network.restored[feed])
+    {
+        g_network.restored[feed] = false;
+        if (value != g_network.lastValue[feed])
+            LOG_INFO(LOG_MODULE_NETWORK, "feed %u: cloud value %d replaces restored %d", feed, value,
+                     g_network.lastValue[feed]);
+    }
 
-    diodeSetState(KLIK_STATE_SETUP);
-    configLoad(&config);
-    configApplyDefaults(false);
-    serialUartInit();
-    serialUartSetInterruptHandler(configUartInterruptHandler);
-    servoSetup(SERVO_PIN);
-    buttonSet(BUTTON_PIN);
+    g_network.lastValue[feed] = value;
+    groupPublish(g_feeds[feed], value);
+    if (feed < g_localFeedsCount)
+        eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE, KLIK_FEED_EVENT(feed, value));
 
-    /*
-     * CONNECT TO WI-FI
-     */
+    return true;
+}
 
-    diodeSetState(KLIK_STATE_CONNECTING);
+/**
+ * @brief Handles finished request.
+ * Feeds are polled one after another, or all at once with feed group,
+ * then the network task rests.
+ */
+void networkFinishRequest()
+{
+    uint8_t feed = g_network.feed;
+    bool applied = true;
+    bool missing;
+    uint16_t status;
+    int next;
 
-    if (!requestSetup(config.ssid, config.password))
+    g_network.busy = false;
+
+    if (g_network.ota)
     {
-        diodeSetState(KLIK_STATE_CONNECTION_ERROR);
-        goto error;
+        /*
+         * Update is downloaded a range at a time, feeds are polled in between.
+         */
+        g_network.ota = false;
+        otaRequestDone();
+        networkStartRequest();
+        return;
     }
 
-    /*
-     * SEND INITIAL REQUEST
-     */
+    g_network.latency = MIN(to_ms_since_boot(get_absolute_time()) - g_network.requestStart, UINT16_MAX);
+    LOG_INFO(LOG_MODULE_NETWORK, "feed %u: %s done in %u ms", feed, g_network.writing ? "write" : "read",
+             g_network.latency);
 
-    diodeSetState(KLIK_STATE_WORKING);
+    if (g_network.writing)
+    {
+        status = requestGetStatus();
+        if (status < 200 || status > 299)
+        {
+            /*
+             * Write is tried again, unless a newer one is queued already, then dropped.
+             */
+            g_network.requestErrors++;
+            networkCountFailure(true);
+            LOG_WARNING(LOG_MODULE_NETWORK, "feed %u: write failed, status %u", feed, status);
 
-    request = requestPrepareGET(config.username, config.feedName, config.apiKey);
-    response = requestSend(request);
-    responseValue = getValueFromResponse(response);
+            if (!g_network.writePending[feed] && g_network.writeRetries[feed]++ < WRITE_RETRIES)
+                g_network.writePending[feed] = true;
+
+            networkRest();
+            return;
+        }
 
-    if (responseValue < 0)
+        networkCountFailure(false);
+        g_network.lastValue[feed] = g_network.writeValue[feed];
+        groupWritten(g_feeds[feed], g_network.writeValue[feed]);
+        if (g_network.writeApply[feed])
+            eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE, KLIK_FEED_EVENT(feed, g_network.writeValue[feed]));
+    }
+    else
     {
-        diodeSetState(KLIK_STATE_REQUEST_ERROR);
-        goto error;
+        if (g_network.pollingGroup)
+        {
+            /*
+             * Feeds not in the group are polled one by one after it, each reported once.
+             * Response without any value at all counts as failed.
+             */
+            applied = false;
+            for (int i = 0; i < g_feedsCount; i++)
+            {
+                missing = g_network.polledValue[i] < 0 && !g_network.writePending[i];
+                if (missing && !g_network.groupMissing[i])
+                    LOG_WARNING(LOG_MODULE_NETWORK, "feed %u: not in feed group, polled on its own", i);
+                g_network.groupMissing[i] = missing;
+
+                if (!missing)
+                    applied |= networkApplyValue(i, g_network.polledValue[i]);
+            }
+            next = networkNextMissing(0);
+        }
+        else
+        {
+            applied = networkApplyValue(feed, getValueFromResponse(requestGetResponse()));
+            next = g_network.pollingMissing ? networkNextMissing(feed + 1) : -1;
+        }
+
+        g_network.pollingMissing = next >= 0;
+        if (g_network.pollingMissing)
+            g_network.pollFeed = next;
+        else
+            g_network.pollFeed = g_network.pollingGroup ? 0 : (feed + 1) % g_feedsCount;
+
+        networkCountFailure(!applied);
+
+        if (!applied && g_state != KLIK_STATE_WORKING)
+        {
+            /*
+             * Polling goes on, device starts working once a whole cycle goes through.
+             */
+            setState(KLIK_STATE_REQUEST_ERROR);
+            networkRest();
+            return;
+        }
+
+        if (g_state != KLIK_STATE_WORKING && !g_network.pollFeed && !g_network.pollingMissing)
+            setState(KLIK_STATE_WORKING);
     }
 
-    /*
-     * LOOP PHRASE
-     * At this phrase everything should be working.
-     */
+    if (networkWritePending() || g_network.pollFeed || g_network.pollingMissing)
+        networkStartRequest();
+    else
+        networkRest();
+}
+
+/**
+ * @brief Does next piece of firmware update, when there's no write waiting.
+ * Flash work is done in short steps, each one a separate event.
+ */
+void networkUpdateFirmware()
+{
+    if (g_network.busy)
+        return;
+
+    if (networkWritePending())
+    {
+        networkStartRequest();
+        return;
+    }
 
-    while (true)
+    switch (otaStep())
     {
-        request = requestPrepareGET(config.username, config.feedName, config.apiKey);
-        response = requestSend(request);
-        responseValue = getValueFromResponse(response);
+    case OTA_STEP_BUSY:
+        eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_OTA, 0);
+        break;
+    case OTA_STEP_REQUEST:
+        g_network.busy = true;
+        g_network.ota = true;
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_SERVICE, 0, REQUEST_POLL_TIME);
+        break;
+    case OTA_STEP_IDLE:
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_POLL, 0, BREAK_TIME);
+        break;
+    }
+}
+
+/**
+ * @brief Queues value to be written to the feed.
+ *
+ * @param feed  feed index.
+ * @param value value.
+ * @param apply true if value should be passed to actuator once written.
+ */
+void networkQueueWrite(uint8_t feed, int8_t value, bool apply)
+{
+    g_network.writeValue[feed] = value;
+    g_network.writeApply[feed] = apply;
+    g_network.writeRetries[feed] = 0;
+    g_network.writePending[feed] = true;
+
+    if (!g_network.busy)
+    {
+        eventCancel(EVENT_TASK_NETWORK, KLIK_EVENT_POLL);
+        networkStartRequest();
+    }
+}
 
+/**
+ * @brief Gets the value feed is going to have, once pending or ongoing write is done.
+ *
+ * @param feed      feed index.
+ * @return int8_t   value being written, or last value read.
+ */
+int8_t networkDesiredValue(uint8_t feed)
+{
+    if (g_network.writePending[feed] || (g_network.busy && g_network.writing && g_network.feed == feed))
+        return g_network.writeValue[feed];
+
+    return g_network.lastValue[feed];
+}
+
+/**
+ * @brief Network task. Polls the feeds and writes values to them, one request at a time.
+ *
+ * @param event event.
+ */
+void networkTaskHandler(event_t *event)
+{
+    int8_t value;
+
+    switch (event->type)
+    {
+    case KLIK_EVENT_POLL:
+        if (!g_network.busy)
+            networkStartRequest();
+        break;
+    case KLIK_EVENT_SERVICE:
+        if (requestPoll() == REQUEST_STATUS_BUSY)
+            eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_SERVICE, 0, REQUEST_POLL_TIME);
+        else
+            networkFinishRequest();
+        break;
+    case KLIK_EVENT_FEED_WRITE:
+        networkQueueWrite(KLIK_FEED_EVENT_FEED(event->value), KLIK_FEED_EVENT_VALUE(event->value), false);
+        break;
+    case KLIK_EVENT_BUTTON_PRESSED:
+        /*
+         * Button flips only between on and off, and only the main feed.
+         * In local first mode servo moves straight away, and the feed catches up in background.
+         * Values read before the write is done are skipped, so they can't move the servo back.
+         */
+        value = networkDesiredValue(0);
+        if (value != KLIK_MODE_ON && value != KLIK_MODE_OFF)
+            break;
+
+        if (g_config.localFirst)
+            eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE, KLIK_FEED_EVENT(0, !value));
+        networkQueueWrite(0, !value, !g_config.localFirst);
+        break;
+    case KLIK_EVENT_NETWORK_TICK:
         /*
-         * Overwrite responseValue if button pressed
+         * Network stack runs in poll mode, LAN server and group need it serviced between requests too.
          */
-        if (buttonReadState(BUTTON_PIN) &&
-            (responseValue == KLIK_MODE_ON || responseValue == KLIK_MODE_OFF))
+        requestPollNetwork();
+        groupUpdate();
+        eventPostDelayed(EVENT_TASK_NETWORK, KLIK_EVENT_NETWORK_TICK, 0, NETWORK_TICK_TIME);
+        break;
+    case KLIK_EVENT_OTA:
+        networkUpdateFirmware();
+        break;
+    }
+}
+
+/**
+ * @brief Takes feed value relayed by group leader, like it was polled by this unit.
+ * Value is skipped while own write to the feed is pending, as it's outdated.
+ * Called from network stack callbacks.
+ *
+ * @param feedName  feed name.
+ * @param value     feed value.
+ */
+void feedValueRelayed(const char *feedName, int8_t value)
+{
+    for (int i = 0; i < g_localFeedsCount; i++)
+    {
+        if (strcmp(g_feeds[i], feedName) || g_network.writePending[i] ||
+            (g_network.busy && g_network.writing && g_network.feed == i))
+            continue;
+
+        if (value != g_network.lastValue[i])
         {
-            responseValue = !responseValue;
-            request = requestPreparePOST(responseValue, config.username, config.feedName, config.apiKey);
-            requestSend(request);
+            g_network.lastValue[i] = value;
+            eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE, KLIK_FEED_EVENT(i, value));
         }
+    }
+
+    if (g_state != KLIK_STATE_WORKING)
+        setState(KLIK_STATE_WORKING);
+}
+
+/**
+ * @brief Carries out command received by LAN server.
+ * Commands go through the actuator like feed values, state is written to the feed
+ * in background, the same way as for button presses.
+ * Called from network stack callbacks, so the feed write is posted rather than started here.
+ *
+ * @param command   command.
+ * @param feed      feed index.
+ * @param value     state value or tap count.
+ * @param body      JSON response body.
+ * @return int      HTTP status code.
+ */
+int lanCommandHandler(httpCommand_t command, uint8_t feed, int32_t value, char *body)
+{
+    if (feed >= g_localFeedsCount)
+        return 404;
+
+    switch (command)
+    {
+    case HTTP_COMMAND_STATUS:
+        snprintf(body, HTTP_RESPONSE_BODY_LEN,
+                 "{\"state\":%d,\"feed\":%u,\"value\":%d,\"desired\":%d,\"busy\":%s,\"latency\":%u}",
+                 g_state, feed, g_network.lastValue[feed], networkDesiredValue(feed),
+                 feedActionRunning(feed) ? "true" : "false", g_network.latency);
+        return 200;
+    case HTTP_COMMAND_STATE:
+        if (value != KLIK_MODE_ON && value != KLIK_MODE_OFF)
+            return 400;
 
-        switch (responseValue)
+        eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE, KLIK_FEED_EVENT(feed, value));
+        eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_FEED_WRITE, KLIK_FEED_EVENT(feed, value));
+        break;
+    case HTTP_COMMAND_TAP:
+        if (value != 1 && value != 2)
+            return 400;
+        if (feedActionRunning(feed))
+            return 409;
+
+        eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE,
+                  KLIK_FEED_EVENT(feed, value == 1 ? KLIK_MODE_TAP : KLIK_MODE_DOUBLE_TAP));
+        break;
+    }
+
+    snprintf(body, HTTP_RESPONSE_BODY_LEN, "{\"feed\":%u,\"value\":%ld}", feed, value);
+
+    return 200;
+}
+
+/**
+ * @brief Reports completed motions to the actuator task.
+ * Called from PWM interrupt.
+ *
+ * @param channel   servo channel.
+ * @param id        completed motion id.
+ */
+void servoMotionCompleted(uint8_t channel, uint16_t id)
+{
+    eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_MOTION_DONE, KLIK_MOTION_EVENT(channel, id));
+}
+
+/**
+ * @brief Actuator task. Queues servo motions according to feed values.
+ * Motions are carried out by servo motion engine, so nothing waits for them.
+ *
+ * @param event event.
+ */
+void actuatorTaskHandler(event_t *event)
+{
+    uint8_t feed, channel;
+    int8_t value;
+
+    switch (event->type)
+    {
+    case KLIK_EVENT_FEED_VALUE:
+        feed = KLIK_FEED_EVENT_FEED(event->value);
+        value = KLIK_FEED_EVENT_VALUE(event->value);
+
+        if (feedActionRunning(feed))
+            break;
+
+        switch (value)
         {
         case KLIK_MODE_OFF:
-            moveServoByValue(KLIK_MODE_OFF, config.angleMax);
+            moveServoByValue(feed, false);
+            actuatorStateSave(feed, value, true);
             break;
         case KLIK_MODE_ON:
-            moveServoByValue(KLIK_MODE_ON, config.angleMax);
+            moveServoByValue(feed, true);
+            actuatorStateSave(feed, value, true);
             break;
         case KLIK_MODE_TAP:
-            servoTap(1, config.angleMax);
-            request = requestPreparePOST(KLIK_MODE_OFF, config.username, config.feedName, config.apiKey);
-            requestSend(request);
+            actionServoByFeed(feed, SERVO_MOTION_TAP, 1);
             break;
         case KLIK_MODE_DOUBLE_TAP:
-            servoTap(2, config.angleMax);
-            request = requestPreparePOST(KLIK_MODE_OFF, config.username, config.feedName, config.apiKey);
-            requestSend(request);
+            actionServoByFeed(feed, SERVO_MOTION_TAP, 2);
             break;
         default:
+            if (servoMacroIsDefined(value - KLIK_MODE_MACRO))
+                actionServoByFeed(feed, SERVO_MOTION_MACRO, value - KLIK_MODE_MACRO);
             break;
         }
+        break;
+    case KLIK_EVENT_MOTION_DONE:
+        channel = KLIK_MOTION_EVENT_CHANNEL(event->value);
+
+        if (!g_channels[channel].actionId || KLIK_MOTION_EVENT_ID(event->value) != g_channels[channel].actionId)
+            break;
+
+        g_channels[channel].actionId = 0;
+        feed = g_channels[channel].feed;
+
+        if (feedActionRunning(feed))
+            break;
 
-        usbSerialUpdateConfig();
-        sleep_ms(BREAK_TIME);
+        eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_FEED_WRITE, KLIK_FEED_EVENT(feed, KLIK_MODE_OFF));
+        actuatorStateSave(feed, KLIK_MODE_OFF, false);
+        break;
+    }
+}
+
+/**
+ * @brief Wakes button task up, when button event is queued.
+ * Called from interrupt.
+ */
+void buttonEventQueued()
+{
+    eventPost(EVENT_TASK_BUTTON, KLIK_EVENT_BUTTON_QUEUED, 0);
+}
+
+/**
+ * @brief Button task. Takes button events and reports presses.
+ * When device is not working (error), button toggles servo directly.
+ *
+ * @param event event.
+ */
+void buttonTaskHandler(event_t *event)
+{
+    buttonEvent_t buttonEvent;
+
+    if (event->type != KLIK_EVENT_BUTTON_QUEUED)
+        return;
+
+    while (buttonEventPop(&buttonEvent))
+    {
+        /*
+         * Release and long press have no action yet.
+         */
+        if (buttonEvent.type != BUTTON_EVENT_PRESS)
+            continue;
+
+        if (g_state == KLIK_STATE_WORKING)
+            eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_BUTTON_PRESSED, 0);
+        else if (g_state == KLIK_STATE_CONNECTION_ERROR || g_state == KLIK_STATE_REQUEST_ERROR)
+        {
+            eventPost(EVENT_TASK_ACTUATOR, KLIK_EVENT_FEED_VALUE,
+                      KLIK_FEED_EVENT(0, g_appliedState.values[0] != KLIK_MODE_ON));
+        }
     }
+}
+
+/**
+ * @brief LED task. Shows device state.
+ *
+ * @param event event.
+ */
+void ledTaskHandler(event_t *event)
+{
+    if (event->type == KLIK_EVENT_STATE)
+        diodeSetState(event->value);
+}
+
+/**
+ * @brief Fills application part of telemetry record.
+ *
+ * @param record telemetry record.
+ */
+void telemetryFill(telemetryRecord_t *record)
+{
+    record->state = g_state;
+    record->lastValue = g_network.lastValue[0];
+    record->pollLatency = g_network.latency;
+    record->requestErrors = g_network.requestErrors;
 
     /*
-     * ERROR
-     * End here if anything fails during first 3 phrases.
-     * Device will blink LED, with error code.
+     * Wi-Fi chip is up only once connected.
      */
+    if (g_state == KLIK_STATE_WORKING || g_state == KLIK_STATE_REQUEST_ERROR)
+        record->rssi = requestGetRssi();
+}
 
-error:
-    responseValue = KLIK_MODE_OFF;
+/**
+ * @brief Wakes config task up, when there's serial input.
+ * Called from interrupt.
+ */
+void serialInputReady()
+{
+    eventPost(EVENT_TASK_CONFIG, KLIK_EVENT_SERIAL_INPUT, 0);
+}
 
-    while (1)
+/**
+ * @brief Config task. Handles configuration over uart and usb serial, commits it to flash
+ * and prints profiler output.
+ *
+ * @param event event.
+ */
+void configTaskHandler(event_t *event)
+{
+    if (event->type == KLIK_EVENT_SERIAL_INPUT)
     {
-        usbSerialUpdateConfig();
+        configSerialUpdate();
+        return;
+    }
+
+    if (event->type != KLIK_EVENT_TICK)
+        return;
+
+    configUpdate();
+    telemetryUpdate();
+    profilerUpdate();
+    eventPostDelayed(EVENT_TASK_CONFIG, KLIK_EVENT_TICK, 0, CONFIG_POLL_TIME);
+}
+
+/**
+ * @brief main(), lol.
+ */
+int main()
+{
+    bool networkTick;
+
+    stdio_init_all();
+    memset(g_network.lastValue, -1, sizeof g_network.lastValue);
+
+    /*
+     * INITIAL SETUP
+     */
+
+    ledDiodeSetup(&g_led, CONFIG_LED_BLUE_PIN, CONFIG_LED_GREEN_PIN, CONFIG_LED_RED_PIN);
+    diodeSetState(KLIK_STATE_SETUP);
+    configApplyDefaults(false);
+    configLoad(&g_config);
+    ledSetBrightness(&g_led, g_config.ledBrightness);
+    serialSetCallback(serialInputReady);
+    serialUartInit();
+    serialUsbInit();
+    servoCalibrate(g_config.servoMinPulse, g_config.servoMaxPulse, g_config.servoReversed);
+    servoMotionSetCallback(servoMotionCompleted);
+    servoMotionSetProfile(g_config.motionProfile, g_config.motionDuration, g_config.motionVelocity);
+    servoSetHoldTime(g_config.servoHoldTime);
+    telemetrySetSource(telemetryFill);
+    telemetrySetPeriod(g_config.telemetryPeriod, 0);
+    for (int i = 0; i < CONFIG_MACROS_MAX; i++)
+        servoMacroSet(i, g_config.macros[i]);
+    channelsSetup();
+    actuatorStateRestore();
+    buttonSetCallback(buttonEventQueued);
+    buttonSet(CONFIG_BUTTON_PIN);
+
+    eventTaskRegister(EVENT_TASK_NETWORK, "NETWORK", networkTaskHandler);
+    eventTaskRegister(EVENT_TASK_ACTUATOR, "ACTUATOR", actuatorTaskHandler);
+    eventTaskRegister(EVENT_TASK_BUTTON, "BUTTON", buttonTaskHandler);
+    eventTaskRegister(EVENT_TASK_LED, "LED", ledTaskHandler);
+    eventTaskRegister(EVENT_TASK_CONFIG, "CONFIG", configTaskHandler);
 
-        if (buttonReadState(BUTTON_PIN))
-            responseValue = !responseValue;
+    /*
+     * CONNECT TO WI-FI
+     */
+
+    g_state = KLIK_STATE_CONNECTING;
+    diodeSetState(KLIK_STATE_CONNECTING);
+
+    if (requestSetup(g_config.ssid, g_config.password))
+    {
+        /*
+         * First request decides if device works, or ends in request error.
+         */
+        eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_POLL, 0);
+        g_state = KLIK_STATE_UNDEFINED;
+        otaResume();
 
-        moveServoByValue(responseValue, config.angleMax);
-        sleep_ms(BREAK_TIME);
+        networkTick = httpServerStart(g_config.lanPort, g_config.lanKey, lanCommandHandler);
+        if (g_config.groupMode)
+            networkTick |= groupStart(g_config.username, g_config.apiKey, g_feeds, g_localFeedsCount,
+                                      feedValueRelayed);
+        if (networkTick)
+            eventPost(EVENT_TASK_NETWORK, KLIK_EVENT_NETWORK_TICK, 0);
+    }
+    else
+    {
+        /*
+         * ERROR
+         * Device will blink LED with error code, button still moves the servo.
+         * Servos with restored state stay where they are.
+         */
+        setState(KLIK_STATE_CONNECTION_ERROR);
+        for (int i = 0; i < g_feedsCount; i++)
+        {
+            if (g_network.lastValue[i] < 0)
+                moveServoByValue(i, false);
+        }
     }
 
+    /*
+     * LOOP PHRASE
+     */
+
+    eventPost(EVENT_TASK_CONFIG, KLIK_EVENT_TICK, 0);
+    eventLoopRun();
+
     return 0;
 }
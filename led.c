@@ -8,25 +8,130 @@
  * Copyright 2022 - 2023 M.Kusiak (timax)
  */
 
+/*
+ * LED pattern engine.
+ *
+ * Patterns are compile time tables of steps (colours, brightness and time). Playing
+ * a pattern copies it to RAM, scaled to current brightness, then one DMA channel feeds
+ * the steps to PIO program (see led.pio) and the other one restarts the first one,
+ * when it reaches the end. Once started, pattern plays with no CPU involvement.
+ */
+
 #include <stdio.h>
 #include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
 
 #include "led.h"
+#include "led.pio.h"
+
+/*
+ * Servo program lives on pio1.
+ */
+#define LED_PIO pio0
+#define LED_PINS_COUNT 3
+/*
+ * PWM period is a milisecond, so step time is just the number of periods.
+ */
+#define LED_PWM_FREQUENCY 1000
+#define LED_LEVEL_MAX 255
+#define LED_PERIOD_CYCLES (LED_LEVEL_MAX + 8)
+#define LED_STEP_TIME_MAX 8192
+
+#define LED_STEP_COLORS_MASK 0x7
+#define LED_STEP_ON_SHIFT 3
+#define LED_STEP_OFF_SHIFT 11
+#define LED_STEP_PERIODS_SHIFT 19
+
+#define LED_BLUE (1 << (COLOR_BLUE - 1))
+#define LED_GREEN (1 << (COLOR_GREEN - 1))
+#define LED_RED (1 << (COLOR_RED - 1))
 
 /**
- * @brief Converts miliseconds to microseconds.
+ * @brief Pattern step. Colours are LED_[...] bits, they are mapped to pins when played.
+ *
+ * @param colors    colours lit.
+ * @param on        brightness (0-255).
+ * @param time      step time in miliseconds (1-8192).
  */
-#define MS_TO_US(m) ((m) * (1000))
+#define LED_STEP(colors, on, time) ((colors) |                                         \
+                                    ((on) << LED_STEP_ON_SHIFT) |                      \
+                                    ((LED_LEVEL_MAX - (on)) << LED_STEP_OFF_SHIFT) |   \
+                                    (((uint32_t)(time) - 1) << LED_STEP_PERIODS_SHIFT))
+
+#define LED_BREATHE_STEP_TIME 50
+#define LED_BREATHE(level) LED_STEP(LED_GREEN, level, LED_BREATHE_STEP_TIME)
+
+#define LED_ERROR_PAUSE 1500
+#define LED_ERROR_BLINK LED_STEP(LED_RED, LED_LEVEL_MAX, LED_BLINK_TIME), LED_STEP(0, 0, LED_BLINK_TIME)
 
 /**
- * @brief A structure for blink pattern.
+ * @brief Pattern, steps are played in a loop.
  */
 typedef struct
 {
-    uint8_t pin;
-    uint delay;
-    uint length;
-} blinkPattern_t;
+    const uint32_t *steps;
+    uint8_t length;
+} ledPatternEntry_t;
+
+static const uint32_t g_patternOff[] = {LED_STEP(0, 0, 1000)};
+
+static const uint32_t g_patternCycleGreenBlue[] = {
+    LED_STEP(LED_GREEN, LED_LEVEL_MAX, 200),
+    LED_STEP(LED_BLUE, LED_LEVEL_MAX, 200)};
+
+static const uint32_t g_patternCycleBlueRed[] = {
+    LED_STEP(LED_BLUE, LED_LEVEL_MAX, 200),
+    LED_STEP(LED_RED, LED_LEVEL_MAX, 200)};
+
+static const uint32_t g_patternBlinkRed[] = {
+    LED_STEP(LED_RED, LED_LEVEL_MAX, LED_BLINK_TIME),
+    LED_STEP(0, 0, 1000)};
+
+static const uint32_t g_patternBlinkBlue[] = {
+    LED_STEP(LED_BLUE, LED_LEVEL_MAX, LED_BLINK_TIME),
+    LED_STEP(0, 0, 1000)};
+
+static const uint32_t g_patternBlinkGreenSlow[] = {
+    LED_STEP(LED_GREEN, LED_LEVEL_MAX, LED_BLINK_TIME),
+    LED_STEP(0, 0, 5000)};
+
+/*
+ * Brightness rises and falls with the square of time, eye sees it as linear.
+ */
+static const uint32_t g_patternBreatheGreen[] = {
+    LED_BREATHE(0), LED_BREATHE(1), LED_BREATHE(4), LED_BREATHE(9),
+    LED_BREATHE(16), LED_BREATHE(25), LED_BREATHE(36), LED_BREATHE(49),
+    LED_BREATHE(64), LED_BREATHE(81), LED_BREATHE(100), LED_BREATHE(121),
+    LED_BREATHE(143), LED_BREATHE(168), LED_BREATHE(195), LED_BREATHE(224),
+    LED_BREATHE(255), LED_BREATHE(224), LED_BREATHE(195), LED_BREATHE(168),
+    LED_BREATHE(143), LED_BREATHE(121), LED_BREATHE(100), LED_BREATHE(81),
+    LED_BREATHE(64), LED_BREATHE(49), LED_BREATHE(36), LED_BREATHE(25),
+    LED_BREATHE(16), LED_BREATHE(9), LED_BREATHE(4), LED_BREATHE(1)};
+
+static const uint32_t g_patternErrorCode2[] = {
+    LED_ERROR_BLINK, LED_ERROR_BLINK,
+    LED_STEP(0, 0, LED_ERROR_PAUSE)};
+
+static const uint32_t g_patternErrorCode3[] = {
+    LED_ERROR_BLINK, LED_ERROR_BLINK, LED_ERROR_BLINK,
+    LED_STEP(0, 0, LED_ERROR_PAUSE)};
+
+#define LED_PATTERN(steps) {steps, sizeof steps / sizeof steps[0]}
+
+static const ledPatternEntry_t g_patterns[LED_PATTERN_COUNT] = {
+    [LED_PATTERN_OFF] = LED_PATTERN(g_patternOff),
+    [LED_PATTERN_CYCLE_GREEN_BLUE] = LED_PATTERN(g_patternCycleGreenBlue),
+    [LED_PATTERN_CYCLE_BLUE_RED] = LED_PATTERN(g_patternCycleBlueRed),
+    [LED_PATTERN_BLINK_RED] = LED_PATTERN(g_patternBlinkRed),
+    [LED_PATTERN_BLINK_BLUE] = LED_PATTERN(g_patternBlinkBlue),
+    [LED_PATTERN_BLINK_GREEN_SLOW] = LED_PATTERN(g_patternBlinkGreenSlow),
+    [LED_PATTERN_BREATHE_GREEN] = LED_PATTERN(g_patternBreatheGreen),
+    [LED_PATTERN_ERROR_CODE_2] = LED_PATTERN(g_patternErrorCode2),
+    [LED_PATTERN_ERROR_CODE_3] = LED_PATTERN(g_patternErrorCode3)};
+
+static int g_pioOffset = -1;
 
 /**
  * @brief Get diode's pin corresponding to color.
@@ -51,75 +156,103 @@ uint8_t getPinByColor(ledDiode_t *diode, color_t color)
 }
 
 /**
- * @brief Cycle power between two led pins. Used as callback.
- *
- * @param timer timer.
- * @return true
- */
-bool cycle(struct repeating_timer *timer)
-{
-    uint8_t *pins = (char *)timer->user_data;
-
-    gpio_put(pins[0], !gpio_get_out_level(pins[0]));
-    gpio_put(pins[1], !gpio_get_out_level(pins[1]));
-
-    return true;
-}
-
-/**
- * @brief Blink diode shortly.
+ * @brief Converts step to diode pins and brightness.
  *
- * @param timer timer.
- * @return true
+ * @param diode     diode.
+ * @param step      pattern step.
+ * @return uint32_t step ready for PIO program.
  */
-bool blink(struct repeating_timer *timer)
+uint32_t stepPrepare(ledDiode_t *diode, uint32_t step)
 {
-    blinkPattern_t *pattern = (blinkPattern_t *)timer->user_data;
+    uint32_t pins = 0;
+    uint32_t on = (step >> LED_STEP_ON_SHIFT) & LED_LEVEL_MAX;
 
-    if (gpio_get_out_level(pattern->pin))
-    {
-        gpio_put(pattern->pin, 0);
-        timer->delay_us = MS_TO_US(pattern->delay);
-    }
-    else
+    for (color_t color = COLOR_BLUE; color <= COLOR_RED; color++)
     {
-        gpio_put(pattern->pin, 1);
-        timer->delay_us = MS_TO_US(pattern->length);
+        if (step & (1 << (color - 1)))
+            pins |= 1 << (getPinByColor(diode, color) - diode->basePin);
     }
 
-    return true;
+    on = on * diode->brightness / LED_BRIGHTNESS_MAX;
+
+    return pins |
+           (on << LED_STEP_ON_SHIFT) |
+           ((LED_LEVEL_MAX - on) << LED_STEP_OFF_SHIFT) |
+           (step & ~((1u << LED_STEP_PERIODS_SHIFT) - 1));
 }
 
 /**
- * @brief Initiates and sets direction for diode pins.
+ * @brief Stops DMA and the state machine, and switches diode off.
  *
  * @param diode diode.
  */
-void ledDiodeInit(ledDiode_t *diode)
+void ledStop(ledDiode_t *diode)
 {
-    gpio_init(diode->bluePin);
-    gpio_init(diode->greenPin);
-    gpio_init(diode->redPin);
-    gpio_set_dir(diode->bluePin, GPIO_OUT);
-    gpio_set_dir(diode->greenPin, GPIO_OUT);
-    gpio_set_dir(diode->redPin, GPIO_OUT);
+    dma_channel_config config = dma_channel_get_default_config(diode->dataChannel);
+
+    /*
+     * Data channel must not trigger control channel while being aborted.
+     */
+    channel_config_set_chain_to(&config, diode->dataChannel);
+    dma_channel_set_config(diode->dataChannel, &config, false);
+    dma_channel_abort(diode->controlChannel);
+    dma_channel_abort(diode->dataChannel);
+
+    pio_sm_set_enabled(LED_PIO, diode->sm, false);
+    pio_sm_clear_fifos(LED_PIO, diode->sm);
+    pio_sm_restart(LED_PIO, diode->sm);
+    pio_sm_exec(LED_PIO, diode->sm, pio_encode_jmp(g_pioOffset));
+    pio_sm_set_pins_with_mask(LED_PIO, diode->sm, 0, ((1u << LED_PINS_COUNT) - 1) << diode->basePin);
 }
 
 /**
- * @brief Quickly setups diode. Sets the pins, initiates, and sets direction.
+ * @brief Sets diode up on PIO state machine and two DMA channels.
  *
  * @param diode     diode.
  * @param bluePin   blue pin.
  * @param greenPin  green pin.
  * @param redPin    red pin.
+ * @return true     diode ready.
+ * @return false    pins are not consecutive, or no free state machine or DMA channel.
  */
-void ledDiodeSetup(ledDiode_t *diode, uint8_t bluePin, uint8_t greenPin, uint8_t redPin)
+bool ledDiodeSetup(ledDiode_t *diode, uint8_t bluePin, uint8_t greenPin, uint8_t redPin)
 {
+    uint8_t basePin = MIN(bluePin, MIN(greenPin, redPin));
+    float divider = (float)clock_get_hz(clk_sys) / (LED_PWM_FREQUENCY * LED_PERIOD_CYCLES);
+
+    diode->sm = -1;
+    diode->dataChannel = -1;
+    diode->controlChannel = -1;
+
+    if ((1u << (bluePin - basePin) | 1u << (greenPin - basePin) | 1u << (redPin - basePin)) != LED_STEP_COLORS_MASK)
+        return false;
+
     diode->bluePin = bluePin;
     diode->greenPin = greenPin;
     diode->redPin = redPin;
+    diode->basePin = basePin;
+    diode->brightness = LED_BRIGHTNESS_MAX;
+    diode->pattern = LED_PATTERN_OFF;
+    diode->stepsAddress = diode->steps;
 
-    ledDiodeInit(diode);
+    if (g_pioOffset < 0)
+    {
+        if (!pio_can_add_program(LED_PIO, &led_program))
+            return false;
+        g_pioOffset = pio_add_program(LED_PIO, &led_program);
+    }
+
+    diode->sm = pio_claim_unused_sm(LED_PIO, false);
+    diode->dataChannel = dma_claim_unused_channel(false);
+    diode->controlChannel = dma_claim_unused_channel(false);
+
+    if (diode->sm < 0 || diode->dataChannel < 0 || diode->controlChannel < 0)
+        return false;
+
+    led_program_init(LED_PIO, diode->sm, g_pioOffset, basePin, divider);
+    ledPlay(diode, LED_PATTERN_OFF);
+
+    return true;
 }
 
 /**
@@ -129,48 +262,63 @@ void ledDiodeSetup(ledDiode_t *diode, uint8_t bluePin, uint8_t greenPin, uint8_t
  */
 void ledDiodeDim(ledDiode_t *diode)
 {
-    gpio_put(diode->bluePin, 0);
-    gpio_put(diode->greenPin, 0);
-    gpio_put(diode->redPin, 0);
+    ledPlay(diode, LED_PATTERN_OFF);
 }
 
 /**
- * @brief Cycles diode colors by specified time.
- * Function is non blocking, colors cycle independent from code.
+ * @brief Plays pattern in a loop, until another one is played.
+ * Function is non blocking, pattern plays independent from code.
  *
  * @param diode     diode.
- * @param timer     timer.
- * @param delay     delay between color changes.
- * @param color1    first color.
- * @param color2    second color.
+ * @param pattern   pattern (LED_PATTERN_[...]).
  */
-void ledCycle(ledDiode_t *diode, struct repeating_timer *timer, uint delay, color_t color1, color_t color2)
+void ledPlay(ledDiode_t *diode, ledPattern_t pattern)
 {
-    static uint8_t pins[2];
+    const ledPatternEntry_t *entry;
+    dma_channel_config config;
+
+    if (pattern >= LED_PATTERN_COUNT || diode->sm < 0 || diode->dataChannel < 0 || diode->controlChannel < 0)
+        return;
 
-    pins[0] = getPinByColor(diode, color1);
-    pins[1] = getPinByColor(diode, color2);
+    ledStop(diode);
 
-    gpio_put(pins[0], 1);
-    gpio_put(pins[1], 0);
-    add_repeating_timer_ms(delay, cycle, &pins, timer);
+    entry = &g_patterns[pattern];
+    diode->pattern = pattern;
+
+    for (int i = 0; i < entry->length; i++)
+        diode->steps[i] = stepPrepare(diode, entry->steps[i]);
+
+    config = dma_channel_get_default_config(diode->dataChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, pio_get_dreq(LED_PIO, diode->sm, true));
+    channel_config_set_chain_to(&config, diode->controlChannel);
+    dma_channel_configure(diode->dataChannel, &config, pio_txf_addr(LED_PIO, diode->sm),
+                          diode->steps, entry->length, false);
+
+    /*
+     * Control channel just points data channel back at the first step, which restarts it.
+     */
+    config = dma_channel_get_default_config(diode->controlChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, false);
+    dma_channel_configure(diode->controlChannel, &config,
+                          &dma_channel_hw_addr(diode->dataChannel)->al3_read_addr_trig,
+                          &diode->stepsAddress, 1, true);
+
+    pio_sm_set_enabled(LED_PIO, diode->sm, true);
 }
 
 /**
- * @brief Blinks led every given time for LED_BLINK_TIME
+ * @brief Sets diode brightness, current pattern is restarted with it.
  *
- * @param diode diode.
- * @param timer timer.
- * @param color color.
- * @param delay delay between blinks.
+ * @param diode         diode.
+ * @param brightness    brightness (0-255).
  */
-void ledBlink(ledDiode_t *diode, struct repeating_timer *timer, color_t color, uint delay)
+void ledSetBrightness(ledDiode_t *diode, uint8_t brightness)
 {
-    static blinkPattern_t pattern;
-
-    pattern.delay = delay;
-    pattern.length = LED_BLINK_TIME;
-    pattern.pin = getPinByColor(diode, color);
-
-    add_repeating_timer_ms(500, blink, &pattern, timer);
+    diode->brightness = brightness;
+    ledPlay(diode, diode->pattern);
 }
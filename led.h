@@ -12,13 +12,8 @@
 #define LED_H
 
 #define LED_BLINK_TIME 200
-
-typedef struct
-{
-    uint8_t bluePin;
-    uint8_t greenPin;
-    uint8_t redPin;
-} ledDiode_t;
+#define LED_BRIGHTNESS_MAX 255
+#define LED_PATTERN_STEPS_MAX 64
 
 typedef enum
 {
@@ -28,11 +23,42 @@ typedef enum
     COLOR_RED
 } color_t;
 
-void ledDiodeInit(ledDiode_t *diode);
-void ledDiodeSetup(ledDiode_t *diode, uint8_t bluePin, uint8_t greenPin, uint8_t redPin);
+typedef enum
+{
+    LED_PATTERN_OFF,
+    LED_PATTERN_CYCLE_GREEN_BLUE,
+    LED_PATTERN_CYCLE_BLUE_RED,
+    LED_PATTERN_BLINK_RED,
+    LED_PATTERN_BLINK_BLUE,
+    LED_PATTERN_BLINK_GREEN_SLOW,
+    LED_PATTERN_BREATHE_GREEN,
+    LED_PATTERN_ERROR_CODE_2,
+    LED_PATTERN_ERROR_CODE_3,
+    LED_PATTERN_COUNT
+} ledPattern_t;
+
+/**
+ * @brief RGB diode, with PIO state machine and DMA channels playing its patterns.
+ * Pins must be consecutive, in any order.
+ */
+typedef struct
+{
+    uint8_t bluePin;
+    uint8_t greenPin;
+    uint8_t redPin;
+    uint8_t basePin;
+    int8_t sm;
+    int8_t dataChannel;
+    int8_t controlChannel;
+    ledPattern_t pattern;
+    uint8_t brightness;
+    uint32_t steps[LED_PATTERN_STEPS_MAX];
+    uint32_t *stepsAddress;
+} ledDiode_t;
+
+bool ledDiodeSetup(ledDiode_t *diode, uint8_t bluePin, uint8_t greenPin, uint8_t redPin);
 void ledDiodeDim(ledDiode_t *diode);
-void ledCycle(ledDiode_t *diode, struct repeating_timer *timer, uint delay, color_t color1, color_t color2);
-void ledBlink(ledDiode_t *diode, struct repeating_timer *timer, color_t color, uint delay);
-void ledTest();
+void ledPlay(ledDiode_t *diode, ledPattern_t pattern);
+void ledSetBrightness(ledDiode_t *diode, uint8_t brightness);
 
-#endif
\ No newline at end of file
+#endif
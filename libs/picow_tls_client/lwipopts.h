@@ -39,5 +39,13 @@
 #define LWIP_DEBUG 1
 #define ALTCP_MBEDTLS_DEBUG  LWIP_DBG_ON
 
+/* LAN control server, advertised over mDNS */
+#define LWIP_IGMP                       1
+#define LWIP_MDNS_RESPONDER             1
+#define LWIP_NUM_NETIF_CLIENT_DATA      1
+#define LWIP_NETIF_EXT_STATUS_CALLBACK  1
+#define MDNS_RESP_USENETIF_EXTCALLBACK  1
+#define MEMP_NUM_SYS_TIMEOUT            (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 3)
+
 #endif
 
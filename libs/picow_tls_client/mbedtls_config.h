@@ -83,4 +83,6 @@
 #define MBEDTLS_ECDH_C
 #define MBEDTLS_ECP_C
 #define MBEDTLS_ECDSA_C
+/* Lets firmware image signature be checked in steps */
+#define MBEDTLS_ECP_RESTARTABLE
 #define MBEDTLS_ASN1_WRITE_C
@@ -56,6 +56,7 @@
 #include "lwip/dns.h"
 
 #include "picow_tls_client.h"
+#include "log.h"
 
 #define RESPONSE_BUF_SIZE 4096
 
@@ -100,7 +101,7 @@ static err_t tls_client_close(void *arg)
         err = altcp_close(state->pcb);
         if (err != ERR_OK)
         {
-            // printf("TLS: close failed %d, calling abort\n", err);
+            LOG_WARNING(LOG_MODULE_TLS, "close failed %d, calling abort", err);
             altcp_abort(state->pcb);
             err = ERR_ABRT;
         }
@@ -114,15 +115,15 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err)
     TLS_CLIENT_T *state = (TLS_CLIENT_T *)arg;
     if (err != ERR_OK)
     {
-        // printf("TLS: connect failed %d\n", err);
+        LOG_ERROR(LOG_MODULE_TLS, "connect failed %d", err);
         return tls_client_close(state);
     }
 
-    // printf("TLS: connected to server, sending request\n");
+    LOG_INFO(LOG_MODULE_TLS, "connected to server, sending request");
     err = altcp_write(state->pcb, state->request, strlen(state->request), TCP_WRITE_FLAG_COPY);
     if (err != ERR_OK)
     {
-        // printf("TLS: error writing data, err=%d", err);
+        LOG_ERROR(LOG_MODULE_TLS, "error writing data, err=%d", err);
         return tls_client_close(state);
     }
 
@@ -131,14 +132,14 @@ static err_t tls_client_connected(void *arg, struct altcp_pcb *pcb, err_t err)
 
 static err_t tls_client_poll(void *arg, struct altcp_pcb *pcb)
 {
-    // printf("TLS: timed out");
+    LOG_WARNING(LOG_MODULE_TLS, "timed out");
     return tls_client_close(arg);
 }
 
 static void tls_client_err(void *arg, err_t err)
 {
     TLS_CLIENT_T *state = (TLS_CLIENT_T *)arg;
-    // printf("TLS: tls_client_err %d\n", err);
+    LOG_ERROR(LOG_MODULE_TLS, "tls_client_err %d", err);
     state->pcb = NULL; /* pcb freed by lwip when _err function is called */
 }
 
@@ -147,7 +148,7 @@ static err_t tls_client_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, e
     TLS_CLIENT_T *state = (TLS_CLIENT_T *)arg;
     if (!p)
     {
-        // printf("TLS: connection closed\n");
+        LOG_DEBUG(LOG_MODULE_TLS, "connection closed");
         return tls_client_close(state);
     }
 
@@ -158,6 +159,12 @@ static err_t tls_client_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, e
            Do be aware that the amount of data can potentially be a bit large (TLS record size can be 16 KB),
            so you may want to use a smaller fixed size buffer and copy the data to it using a loop, if memory is a concern */
 
+        if (state->receive)
+        {
+            for (struct pbuf *q = p; q; q = q->next)
+                state->receive((const char *)q->payload, q->len);
+        }
+
         pbuf_copy_partial(p, g_responseBuf, RESPONSE_BUF_SIZE, 0);
         g_responseBuf[RESPONSE_BUF_SIZE - 1] = 0;
 
@@ -171,13 +178,15 @@ static err_t tls_client_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, e
 static void tls_client_connect_to_server_ip(const ip_addr_t *ipaddr, TLS_CLIENT_T *state)
 {
     err_t err;
-    u16_t port = 443;
+    u16_t port = state->port;
 
-    // printf("TLS: connecting to server IP %s port %d\n", ipaddr_ntoa(ipaddr), port);
+    LOG_DEBUG(LOG_MODULE_TLS, "connecting to server IP %u.%u.%u.%u port %d",
+              ip4_addr1(ip_2_ip4(ipaddr)), ip4_addr2(ip_2_ip4(ipaddr)),
+              ip4_addr3(ip_2_ip4(ipaddr)), ip4_addr4(ip_2_ip4(ipaddr)), port);
     err = altcp_connect(state->pcb, ipaddr, port, tls_client_connected);
     if (err != ERR_OK)
     {
-        fprintf(stderr, "error initiating connect, err=%d\n", err);
+        LOG_ERROR(LOG_MODULE_TLS, "error initiating connect, err=%d", err);
         tls_client_close(state);
     }
 }
@@ -186,12 +195,12 @@ static void tls_client_dns_found(const char *hostname, const ip_addr_t *ipaddr,
 {
     if (ipaddr)
     {
-        // printf("TLS: DNS resolving complete\n");
+        LOG_DEBUG(LOG_MODULE_TLS, "DNS resolving complete");
         tls_client_connect_to_server_ip(ipaddr, (TLS_CLIENT_T *)arg);
     }
     else
     {
-        // printf("TLS: error resolving hostname %s\n", hostname);
+        LOG_ERROR(LOG_MODULE_TLS, "error resolving hostname");
         tls_client_close(arg);
     }
 }
@@ -205,7 +214,7 @@ bool tls_client_open(void *arg)
     state->pcb = altcp_tls_new(tls_config, IPADDR_TYPE_ANY);
     if (!state->pcb)
     {
-        // printf("TLS: failed to create pcb\n");
+        LOG_ERROR(LOG_MODULE_TLS, "failed to create pcb");
         return false;
     }
 
@@ -217,7 +226,7 @@ bool tls_client_open(void *arg)
     /* Set SNI */
     mbedtls_ssl_set_hostname(altcp_tls_context(state->pcb), state->hostname);
 
-    // printf("TLS: resolving %s\n", state->hostname);
+    LOG_DEBUG(LOG_MODULE_TLS, "resolving hostname");
 
     // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
     // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
@@ -233,7 +242,7 @@ bool tls_client_open(void *arg)
     }
     else if (err != ERR_INPROGRESS)
     {
-        // printf("TLS: error initiating DNS resolving, err=%d\n", err);
+        LOG_ERROR(LOG_MODULE_TLS, "error initiating DNS resolving, err=%d", err);
         tls_client_close(state->pcb);
     }
 
@@ -248,7 +257,7 @@ TLS_CLIENT_T *tls_client_init(void)
     TLS_CLIENT_T *state = calloc(1, sizeof(TLS_CLIENT_T));
     if (!state)
     {
-        // printf("TLS: failed to allocate state\n");
+        LOG_ERROR(LOG_MODULE_TLS, "failed to allocate state");
         return NULL;
     }
 
@@ -280,14 +289,14 @@ bool altcp_tls_setup_cyw43(char *ssid, char *password, uint timeout)
 {
     if (cyw43_arch_init())
     {
-        // printf("TLS: failed to initialise\n");
+        LOG_ERROR(LOG_MODULE_TLS, "failed to initialise");
         return false;
     }
     cyw43_arch_enable_sta_mode();
 
     if (cyw43_arch_wifi_connect_timeout_ms(ssid, password, CYW43_AUTH_WPA2_AES_PSK, timeout))
     {
-        // printf("TLS: failed to connect\n");
+        LOG_ERROR(LOG_MODULE_TLS, "failed to connect");
         return false;
     }
 
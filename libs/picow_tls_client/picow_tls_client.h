@@ -23,6 +23,9 @@ typedef struct TLS_CLIENT_T_
     bool complete;
     char *request;
     char *hostname;
+    uint16_t port;
+    // optional, gets received data as it comes, piece by piece
+    void (*receive)(const char *data, size_t length);
 } TLS_CLIENT_T;
 
 bool tls_client_open(void *arg);
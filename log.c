@@ -0,0 +1,169 @@
+/*
+ * File: log.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Deferred binary logging.
+ *
+ * Formatting over stdio takes long enough to change the timing it's meant to diagnose,
+ * so nothing is formatted on the device. A record is the header, timestamp, address of
+ * the format string in flash and raw arguments, copied into a RAM ring with interrupts off.
+ * "LOG DUMP" prints the records as hex words, tools/log.py looks format strings up
+ * in the firmware ELF and formats them.
+ *
+ * When the ring is full new records are dropped and counted.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#include "log.h"
+
+/*
+ * Header, timestamp and format string address.
+ */
+#define LOG_RECORD_HEADER_LEN 3
+
+#define LOG_MESSAGE_BEGIN "LOG BEGIN"
+#define LOG_MESSAGE_END "LOG END"
+
+static const char *g_moduleNames[LOG_MODULE_COUNT] = {
+    [LOG_MODULE_TLS] = "TLS",
+    [LOG_MODULE_NETWORK] = "NET",
+    [LOG_MODULE_OTA] = "OTA",
+};
+
+static uint8_t g_levels[LOG_MODULE_COUNT] = {
+    [LOG_MODULE_TLS] = LOG_LEVEL_INFO,
+    [LOG_MODULE_NETWORK] = LOG_LEVEL_INFO,
+    [LOG_MODULE_OTA] = LOG_LEVEL_INFO,
+};
+
+static uint32_t g_ring[LOG_RING_LEN];
+static volatile uint32_t g_head;
+static volatile uint32_t g_tail;
+static volatile uint32_t g_dropped;
+
+/**
+ * @brief Puts record into the ring. Use LOG() macros rather than calling it directly.
+ * Runs from RAM, so it doesn't stall on flash cache misses. Can be called from interrupts.
+ *
+ * @param header    record header, see LOG_HEADER().
+ * @param format    format string.
+ * @param ...       arguments, up to LOG_ARGS_MAX, 32 bits each.
+ */
+void __not_in_flash_func(logWrite)(uint32_t header, const char *format, ...)
+{
+    uint32_t length = LOG_RECORD_HEADER_LEN + LOG_HEADER_COUNT(header);
+    uint32_t interrupts;
+    va_list args;
+
+    if (LOG_HEADER_LEVEL(header) > g_levels[LOG_HEADER_MODULE(header)])
+        return;
+
+    va_start(args, format);
+    interrupts = save_and_disable_interrupts();
+
+    if (LOG_RING_LEN - (g_head - g_tail) < length)
+    {
+        g_dropped++;
+        restore_interrupts(interrupts);
+        va_end(args);
+        return;
+    }
+
+    g_ring[g_head++ & (LOG_RING_LEN - 1)] = header;
+    g_ring[g_head++ & (LOG_RING_LEN - 1)] = time_us_32();
+    g_ring[g_head++ & (LOG_RING_LEN - 1)] = (uint32_t)(uintptr_t)format;
+
+    for (uint32_t i = LOG_RECORD_HEADER_LEN; i < length; i++)
+        g_ring[g_head++ & (LOG_RING_LEN - 1)] = va_arg(args, uint32_t);
+
+    restore_interrupts(interrupts);
+    va_end(args);
+}
+
+/**
+ * @brief Sets level of given module.
+ *
+ * @param module    module name, "ALL" for every module.
+ * @param level     messages above this level are not recorded.
+ * @return true     level set.
+ * @return false    unknown module or level.
+ */
+bool logSetLevel(const char *module, logLevel_t level)
+{
+    bool all = !strcmp(module, "ALL");
+    bool found = false;
+
+    if ((uint32_t)level > LOG_LEVEL_DEBUG)
+        return false;
+
+    for (int i = 0; i < LOG_MODULE_COUNT; i++)
+    {
+        if (all || !strcmp(module, g_moduleNames[i]))
+        {
+            g_levels[i] = level;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * @brief Prints level of every module on serial.
+ */
+void logPrintLevels()
+{
+    for (int i = 0; i < LOG_MODULE_COUNT; i++)
+        printf("%s: %u\n", g_moduleNames[i], g_levels[i]);
+}
+
+/**
+ * @brief Prints recorded messages on serial and removes them from the ring.
+ * Begins with words pending and records dropped, then one line per record,
+ * all words in hex: header, time, format, arguments.
+ */
+void logDump()
+{
+    uint32_t head = g_head;
+
+    printf("%s %lu %lu\n", LOG_MESSAGE_BEGIN, head - g_tail, g_dropped);
+
+    while (g_tail != head)
+    {
+        uint32_t length = LOG_RECORD_HEADER_LEN + LOG_HEADER_COUNT(g_ring[g_tail & (LOG_RING_LEN - 1)]);
+
+        for (uint32_t i = 0; i < length; i++)
+            printf(i ? " %08lx" : "%08lx", g_ring[(g_tail + i) & (LOG_RING_LEN - 1)]);
+        printf("\n");
+
+        g_tail += length;
+    }
+
+    g_dropped = 0;
+    printf("%s\n", LOG_MESSAGE_END);
+}
+
+/**
+ * @brief Drops all recorded messages.
+ */
+void logClear()
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    g_tail = g_head;
+    g_dropped = 0;
+
+    restore_interrupts(interrupts);
+}
@@ -0,0 +1,74 @@
+/*
+ * File: log.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Ring length in 32-bit words, must be a power of 2.
+ */
+#define LOG_RING_LEN 1024
+#define LOG_ARGS_MAX 6
+
+typedef enum
+{
+    LOG_LEVEL_OFF,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} logLevel_t;
+
+/*
+ * Keep in sync with MODULES in tools/log.py.
+ */
+typedef enum
+{
+    LOG_MODULE_TLS,
+    LOG_MODULE_NETWORK,
+    LOG_MODULE_OTA,
+    LOG_MODULE_COUNT
+} logModule_t;
+
+/*
+ * Record header: module, level and number of arguments.
+ */
+#define LOG_HEADER(module, level, count) (((module) << 8) | ((level) << 4) | (count))
+#define LOG_HEADER_MODULE(header) (((header) >> 8) & 0xff)
+#define LOG_HEADER_LEVEL(header) (((header) >> 4) & 0x0f)
+#define LOG_HEADER_COUNT(header) ((header) & 0x0f)
+
+#define LOG_ARGS_COUNT(...) LOG_ARGS_COUNT_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_ARGS_COUNT_(_0, _1, _2, _3, _4, _5, _6, count, ...) count
+
+/*
+ * Logs message without formatting it. Only the format string address and
+ * arguments are stored, tools/log.py formats them on the host.
+ * Arguments must fit in 32 bits, "%s" is decoded only for strings in flash.
+ */
+#define LOG(module, level, format, ...)                                                                   \
+    do                                                                                                    \
+    {                                                                                                     \
+        static const char logFormat[] __attribute__((section(".rodata.log"))) = format;                   \
+        logWrite(LOG_HEADER(module, level, LOG_ARGS_COUNT(__VA_ARGS__)), logFormat, ##__VA_ARGS__);      \
+    } while (0)
+
+#define LOG_ERROR(module, format, ...) LOG(module, LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARNING(module, format, ...) LOG(module, LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#define LOG_INFO(module, format, ...) LOG(module, LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_DEBUG(module, format, ...) LOG(module, LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+
+void logWrite(uint32_t header, const char *format, ...);
+bool logSetLevel(const char *module, logLevel_t level);
+void logPrintLevels();
+void logDump();
+void logClear();
+
+#endif
@@ -0,0 +1,1077 @@
+/*
+ * File: ota.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Over-the-air firmware update.
+ *
+ * Image is downloaded over HTTPS into the staging slot, a range of blocks at a time,
+ * taking turns with feed polling. Image file is a signed header followed by blocks,
+ * each block being one flash sector of firmware compressed on its own (LZ4 block format),
+ * so it's decompressed as it streams in and programmed page by page.
+ * Every flash operation is short and done on its own, the longest being sector erase.
+ *
+ * Signature is checked before anything is downloaded, image hash once everything is.
+ * Only then the image is copied over running firmware, by code running from RAM,
+ * and device restarts. Downloaded blocks are marked in the state sector, so download
+ * resumes where it stopped, after lost connection or restart.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/structs/scb.h"
+#include "pico/flash.h"
+#include "mbedtls/md.h"
+#include "mbedtls/ecdsa.h"
+
+#include "ota.h"
+#include "request.h"
+#include "crc.h"
+#include "log.h"
+
+/*
+ * Image public key, uncompressed P-256 point in hex, given at build time.
+ * Without it updates are refused.
+ */
+#ifndef OTA_PUBLIC_KEY
+#define OTA_PUBLIC_KEY ""
+#endif
+#define OTA_PUBLIC_KEY_LEN 65
+
+#define OTA_IMAGE_MAGIC 0x41544F4B
+#define OTA_IMAGE_FORMAT 1
+#define OTA_RECORD_MAGIC 0x5445534B
+
+#define OTA_BLOCK_SIZE FLASH_SECTOR_SIZE
+#define OTA_BLOCKS_MAX (OTA_SLOT_SIZE / OTA_BLOCK_SIZE)
+#define OTA_BLOCK_COMPRESSED_MAX (OTA_BLOCK_SIZE + OTA_BLOCK_SIZE / 255 + 16)
+#define OTA_HASH_LEN 32
+#define OTA_SIGNATURE_MAX 72
+#define OTA_HEADER_MAX (sizeof(otaHeader_t) + OTA_BLOCKS_MAX * 2 + 1 + OTA_SIGNATURE_MAX)
+
+/*
+ * State sector holds the record (where image is and its header), followed by progress bitmap.
+ * Bitmap is programmed over and over, clearing a bit per downloaded block.
+ */
+#define OTA_PROGRESS_OFFSET 1024
+
+/*
+ * Blocks downloaded in one request. Feeds are polled between requests.
+ */
+#define OTA_RANGE_BLOCKS 8
+#define OTA_RETRIES_MAX 10
+/*
+ * Signature check is split into steps of this many ECC operations.
+ */
+#define OTA_VERIFY_MAX_OPS 256
+#define OTA_FLASH_TIMEOUT 100
+
+#define OTA_HTTP_OK 200
+#define OTA_HTTP_PARTIAL 206
+#define OTA_PORT_DEFAULT 443
+#define OTA_URL_SCHEME "https://"
+
+#define OTA_LZ4_MATCH_MIN 4
+#define OTA_LZ4_LENGTH_EXTENDED 15
+#define OTA_POSITION_UNKNOWN UINT32_MAX
+
+/**
+ * @brief Image file header, followed by compressed length of every block (16-bit),
+ *        signature length and signature (DER, padded to OTA_SIGNATURE_MAX).
+ *        Signature covers header and block lengths.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint8_t format;
+    uint8_t reserved;
+    uint16_t blockCount;
+    uint32_t imageLength;
+    uint8_t imageHash[OTA_HASH_LEN];
+} otaHeader_t;
+
+/**
+ * @brief Update record, kept in the state sector for download to be resumed.
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t port;
+    char host[OTA_HOST_LEN + 1];
+    char path[OTA_PATH_LEN + 1];
+    uint8_t header[OTA_HEADER_MAX];
+    uint32_t crc;
+} otaRecord_t;
+
+_Static_assert(sizeof(otaRecord_t) <= OTA_PROGRESS_OFFSET, "otaRecord_t must fit before progress bitmap");
+_Static_assert(OTA_BLOCKS_MAX <= FLASH_PAGE_SIZE * 8, "progress bitmap must fit a page");
+
+typedef enum
+{
+    OTA_STATE_IDLE,
+    OTA_STATE_HEADER,
+    OTA_STATE_SIGNATURE,
+    OTA_STATE_ERASE,
+    OTA_STATE_DOWNLOAD,
+    OTA_STATE_VERIFY,
+    OTA_STATE_SWAP
+} otaState_t;
+
+typedef enum
+{
+    OTA_LZ4_TOKEN,
+    OTA_LZ4_LITERAL_LENGTH,
+    OTA_LZ4_LITERALS,
+    OTA_LZ4_OFFSET_LOW,
+    OTA_LZ4_OFFSET_HIGH,
+    OTA_LZ4_MATCH_LENGTH
+} otaLz4State_t;
+
+/**
+ * @brief Flash operation, carried out by otaFlash(). Erase when there's no data.
+ */
+typedef struct
+{
+    uint32_t offset;
+    const uint8_t *data;
+    size_t length;
+} otaFlashOperation_t;
+
+typedef struct
+{
+    otaState_t state;
+    union
+    {
+        otaRecord_t record;
+        uint8_t recordPages[OTA_PROGRESS_OFFSET];
+    };
+
+    /*
+     * Request, positions are in image file.
+     */
+    bool requestActive;
+    bool requestFailed;
+    uint32_t rangeFrom;
+    uint32_t rangeTo;
+    uint32_t position;
+
+    /*
+     * Blocks of current range, erased then downloaded.
+     */
+    uint16_t blockFirst;
+    uint16_t blockEnd;
+    uint16_t eraseBlock;
+    uint16_t block;
+
+    /*
+     * Decompression of current block, sector is the window.
+     */
+    otaLz4State_t lz4;
+    uint8_t token;
+    uint16_t offset;
+    uint32_t length;
+    uint16_t blockLeft;
+    uint16_t blockOut;
+    uint16_t out;
+    uint8_t sector[OTA_BLOCK_SIZE];
+
+    mbedtls_ecdsa_context ecdsa;
+    mbedtls_ecdsa_restart_ctx restart;
+    mbedtls_md_context_t md;
+    uint32_t verified;
+
+    uint16_t failures;
+    uint32_t downloaded;
+    uint32_t requests;
+    uint32_t retries;
+    const char *error;
+} ota_t;
+
+static ota_t g_ota;
+static const char g_publicKey[] = OTA_PUBLIC_KEY;
+
+/*
+ * Programmed over progress bitmap, 0xFF leaves bits as they are.
+ */
+static uint8_t g_progressPage[FLASH_PAGE_SIZE];
+
+/**
+ * @brief Carries out flash operation. Called by flash_safe_execute(),
+ * with the other core and interrupts locked out.
+ *
+ * @param param flash operation (otaFlashOperation_t).
+ */
+void otaFlash(void *param)
+{
+    otaFlashOperation_t *operation = param;
+
+    if (operation->data)
+        flash_range_program(operation->offset, operation->data, operation->length);
+    else
+        flash_range_erase(operation->offset, operation->length);
+}
+
+/**
+ * @brief Erases or programs flash.
+ *
+ * @param offset    flash offset, sector aligned for erase, page aligned for programming.
+ * @param data      data to program, NULL to erase.
+ * @param length    length, whole sectors or pages.
+ * @return true     done.
+ * @return false    flash could not be accessed.
+ */
+bool otaFlashRun(uint32_t offset, const uint8_t *data, size_t length)
+{
+    otaFlashOperation_t operation = {.offset = offset, .data = data, .length = length};
+
+    return flash_safe_execute(otaFlash, &operation, OTA_FLASH_TIMEOUT) == PICO_OK;
+}
+
+/**
+ * @brief Gets header of the image being downloaded.
+ *
+ * @return const otaHeader_t* header.
+ */
+const otaHeader_t *otaHeader()
+{
+    return (const otaHeader_t *)g_ota.record.header;
+}
+
+/**
+ * @brief Gets length of header, block lengths and signature, the part of image file before blocks.
+ *
+ * @param blockCount    image block count.
+ * @return uint32_t     length.
+ */
+uint32_t otaHeaderLength(uint16_t blockCount)
+{
+    return sizeof(otaHeader_t) + blockCount * 2 + 1 + OTA_SIGNATURE_MAX;
+}
+
+/**
+ * @brief Gets compressed length of the block.
+ *
+ * @param block     block index.
+ * @return uint16_t length.
+ */
+uint16_t otaBlockLength(uint16_t block)
+{
+    const uint8_t *lengths = g_ota.record.header + sizeof(otaHeader_t);
+
+    return lengths[block * 2] | lengths[block * 2 + 1] << 8;
+}
+
+/**
+ * @brief Gets decompressed length of the block, all but the last one fill a sector.
+ *
+ * @param block     block index.
+ * @return uint16_t length.
+ */
+uint16_t otaBlockOutput(uint16_t block)
+{
+    const otaHeader_t *header = otaHeader();
+
+    if (block < header->blockCount - 1)
+        return OTA_BLOCK_SIZE;
+
+    return header->imageLength - (header->blockCount - 1) * OTA_BLOCK_SIZE;
+}
+
+/**
+ * @brief Gets position of the block in image file.
+ *
+ * @param block     block index, block count for the end of file.
+ * @return uint32_t position.
+ */
+uint32_t otaBlockPosition(uint16_t block)
+{
+    uint32_t position = otaHeaderLength(otaHeader()->blockCount);
+
+    for (int i = 0; i < block; i++)
+        position += otaBlockLength(i);
+
+    return position;
+}
+
+/**
+ * @brief Checks if the block is downloaded.
+ *
+ * @param block     block index.
+ * @return true     downloaded.
+ */
+bool otaBlockDone(uint16_t block)
+{
+    const uint8_t *progress = (const uint8_t *)(XIP_BASE + OTA_STATE_OFFSET + OTA_PROGRESS_OFFSET);
+
+    return !(progress[block / 8] & (1 << block % 8));
+}
+
+/**
+ * @brief Marks the block as downloaded, by clearing its bit in progress bitmap.
+ *
+ * @param block     block index.
+ * @return true     marked.
+ */
+bool otaBlockMark(uint16_t block)
+{
+    bool marked;
+
+    memset(g_progressPage, 0xFF, sizeof g_progressPage);
+    g_progressPage[block / 8] = ~(1 << block % 8);
+    marked = otaFlashRun(OTA_STATE_OFFSET + OTA_PROGRESS_OFFSET, g_progressPage, FLASH_PAGE_SIZE);
+
+    return marked && otaBlockDone(block);
+}
+
+/**
+ * @brief Checks image header as received, before signature is checked.
+ *
+ * @return true     header complete and sane.
+ */
+bool otaHeaderValid()
+{
+    const otaHeader_t *header = otaHeader();
+    uint8_t signatureLength;
+    uint16_t length;
+
+    if (g_ota.position < sizeof(otaHeader_t) ||
+        header->magic != OTA_IMAGE_MAGIC || header->format != OTA_IMAGE_FORMAT ||
+        !header->blockCount || header->blockCount > OTA_BLOCKS_MAX ||
+        header->imageLength <= (header->blockCount - 1) * OTA_BLOCK_SIZE ||
+        header->imageLength > header->blockCount * OTA_BLOCK_SIZE ||
+        g_ota.position < otaHeaderLength(header->blockCount))
+        return false;
+
+    signatureLength = g_ota.record.header[sizeof(otaHeader_t) + header->blockCount * 2];
+    if (!signatureLength || signatureLength > OTA_SIGNATURE_MAX)
+        return false;
+
+    for (int i = 0; i < header->blockCount; i++)
+    {
+        length = otaBlockLength(i);
+        if (!length || length > OTA_BLOCK_COMPRESSED_MAX)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Computes record CRC.
+ *
+ * @param record    record.
+ * @return uint32_t CRC.
+ */
+uint32_t otaRecordCrc(const otaRecord_t *record)
+{
+    return crc32(record, offsetof(otaRecord_t, crc));
+}
+
+/**
+ * @brief Writes update record to the state sector, which clears progress too.
+ *
+ * @return true     written and verified.
+ */
+bool otaRecordSave()
+{
+    const otaRecord_t *saved = (const otaRecord_t *)(XIP_BASE + OTA_STATE_OFFSET);
+
+    g_ota.record.magic = OTA_RECORD_MAGIC;
+    g_ota.record.crc = otaRecordCrc(&g_ota.record);
+
+    if (!otaFlashRun(OTA_STATE_OFFSET, NULL, FLASH_SECTOR_SIZE) ||
+        !otaFlashRun(OTA_STATE_OFFSET, g_ota.recordPages, sizeof g_ota.recordPages))
+        return false;
+
+    return !memcmp(saved, &g_ota.record, sizeof g_ota.record);
+}
+
+/**
+ * @brief Loads public key for signature check.
+ *
+ * @return true     key loaded.
+ */
+bool otaKeyLoad()
+{
+    uint8_t key[OTA_PUBLIC_KEY_LEN];
+    unsigned int byte;
+
+    if (strlen(g_publicKey) != OTA_PUBLIC_KEY_LEN * 2)
+        return false;
+
+    for (int i = 0; i < OTA_PUBLIC_KEY_LEN; i++)
+    {
+        if (sscanf(&g_publicKey[i * 2], "%2x", &byte) != 1)
+            return false;
+        key[i] = byte;
+    }
+
+    mbedtls_ecdsa_init(&g_ota.ecdsa);
+    mbedtls_ecdsa_restart_init(&g_ota.restart);
+
+    if (mbedtls_ecp_group_load(&g_ota.ecdsa.grp, MBEDTLS_ECP_DP_SECP256R1) ||
+        mbedtls_ecp_point_read_binary(&g_ota.ecdsa.grp, &g_ota.ecdsa.Q, key, sizeof key))
+    {
+        mbedtls_ecdsa_free(&g_ota.ecdsa);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Frees signature and hash check contexts, if in use.
+ */
+void otaRelease()
+{
+    if (g_ota.state == OTA_STATE_SIGNATURE)
+    {
+        mbedtls_ecdsa_restart_free(&g_ota.restart);
+        mbedtls_ecdsa_free(&g_ota.ecdsa);
+    }
+    else if (g_ota.state == OTA_STATE_VERIFY)
+    {
+        mbedtls_md_free(&g_ota.md);
+    }
+}
+
+/**
+ * @brief Abandons the update. Image is not resumed after restart.
+ *
+ * @param error reason.
+ */
+void otaFail(const char *error)
+{
+    LOG_ERROR(LOG_MODULE_OTA, "update failed: %s", error);
+
+    otaRelease();
+    g_ota.state = OTA_STATE_IDLE;
+    g_ota.error = error;
+    otaFlashRun(OTA_STATE_OFFSET, NULL, FLASH_SECTOR_SIZE);
+}
+
+/**
+ * @brief Counts failed attempt, after too many in a row update is paused till restart,
+ *        which resumes it.
+ *
+ * @param error reason.
+ */
+void otaRetry(const char *error)
+{
+    LOG_WARNING(LOG_MODULE_OTA, "attempt failed: %s", error);
+
+    g_ota.error = error;
+    g_ota.retries++;
+
+    if (++g_ota.failures < OTA_RETRIES_MAX)
+        return;
+
+    LOG_ERROR(LOG_MODULE_OTA, "update paused after %u attempts", g_ota.failures);
+    otaRelease();
+    g_ota.state = OTA_STATE_IDLE;
+}
+
+/**
+ * @brief Picks next range of blocks to download, or starts image check once all are there.
+ */
+void otaPlan()
+{
+    uint16_t count = otaHeader()->blockCount;
+    uint16_t block = 0;
+
+    while (block < count && otaBlockDone(block))
+        block++;
+
+    if (block == count)
+    {
+        mbedtls_md_init(&g_ota.md);
+        if (mbedtls_md_setup(&g_ota.md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) ||
+            mbedtls_md_starts(&g_ota.md))
+        {
+            mbedtls_md_free(&g_ota.md);
+            otaFail("hash setup");
+            return;
+        }
+
+        g_ota.verified = 0;
+        g_ota.state = OTA_STATE_VERIFY;
+        return;
+    }
+
+    g_ota.blockFirst = block;
+    g_ota.eraseBlock = block;
+
+    while (block < count && block - g_ota.blockFirst < OTA_RANGE_BLOCKS && !otaBlockDone(block))
+        block++;
+
+    g_ota.blockEnd = block;
+    g_ota.state = OTA_STATE_ERASE;
+}
+
+/**
+ * @brief Prepares decompression of the block.
+ *
+ * @param block block index.
+ */
+void otaBlockStart(uint16_t block)
+{
+    g_ota.block = block;
+    g_ota.lz4 = OTA_LZ4_TOKEN;
+    g_ota.blockLeft = otaBlockLength(block);
+    g_ota.blockOut = otaBlockOutput(block);
+    g_ota.out = 0;
+}
+
+/**
+ * @brief Puts decompressed byte into the sector, programming every page once it's filled.
+ *
+ * @param byte      byte.
+ * @return true     byte taken.
+ * @return false    block overflow, or flash could not be programmed.
+ */
+bool otaOutput(uint8_t byte)
+{
+    if (g_ota.out >= g_ota.blockOut)
+        return false;
+
+    g_ota.sector[g_ota.out++] = byte;
+
+    if (g_ota.out % FLASH_PAGE_SIZE)
+        return true;
+
+    return otaFlashRun(OTA_STAGING_OFFSET + g_ota.block * OTA_BLOCK_SIZE + g_ota.out - FLASH_PAGE_SIZE,
+                       &g_ota.sector[g_ota.out - FLASH_PAGE_SIZE], FLASH_PAGE_SIZE);
+}
+
+/**
+ * @brief Copies match from already decompressed part of the block.
+ *
+ * @return true     copied.
+ * @return false    match out of the block.
+ */
+bool otaMatch()
+{
+    if (!g_ota.offset || g_ota.offset > g_ota.out || g_ota.out + g_ota.length > g_ota.blockOut)
+        return false;
+
+    for (uint32_t i = 0; i < g_ota.length; i++)
+    {
+        if (!otaOutput(g_ota.sector[g_ota.out - g_ota.offset]))
+            return false;
+    }
+
+    g_ota.lz4 = OTA_LZ4_TOKEN;
+
+    return true;
+}
+
+/**
+ * @brief Finishes the block, programs what's left of it and marks it downloaded.
+ *
+ * @return true     block complete.
+ * @return false    block is not what header says, or flash could not be programmed.
+ */
+bool otaBlockEnd()
+{
+    uint16_t partial = g_ota.out % FLASH_PAGE_SIZE;
+
+    /*
+     * Block ends with literals, or a match at the very least.
+     */
+    if (g_ota.out != g_ota.blockOut || (g_ota.lz4 != OTA_LZ4_OFFSET_LOW && g_ota.lz4 != OTA_LZ4_TOKEN))
+        return false;
+
+    if (partial)
+    {
+        memset(&g_ota.sector[g_ota.out], 0xFF, FLASH_PAGE_SIZE - partial);
+        if (!otaFlashRun(OTA_STAGING_OFFSET + g_ota.block * OTA_BLOCK_SIZE + g_ota.out - partial,
+                         &g_ota.sector[g_ota.out - partial], FLASH_PAGE_SIZE))
+            return false;
+    }
+
+    if (!otaBlockMark(g_ota.block))
+        return false;
+
+    if (g_ota.block + 1 < g_ota.blockEnd)
+        otaBlockStart(g_ota.block + 1);
+    else
+        g_ota.block = g_ota.blockEnd;
+
+    return true;
+}
+
+/**
+ * @brief Decompresses next byte of the range (LZ4 block format, one block per sector).
+ *
+ * @param byte      compressed byte.
+ * @return true     taken.
+ * @return false    broken block.
+ */
+bool otaDecode(uint8_t byte)
+{
+    if (g_ota.block >= g_ota.blockEnd)
+        return true;
+
+    g_ota.blockLeft--;
+
+    switch (g_ota.lz4)
+    {
+    case OTA_LZ4_TOKEN:
+        g_ota.token = byte;
+        g_ota.length = byte >> 4;
+        if (g_ota.length == OTA_LZ4_LENGTH_EXTENDED)
+            g_ota.lz4 = OTA_LZ4_LITERAL_LENGTH;
+        else
+            g_ota.lz4 = g_ota.length ? OTA_LZ4_LITERALS : OTA_LZ4_OFFSET_LOW;
+        break;
+    case OTA_LZ4_LITERAL_LENGTH:
+        g_ota.length += byte;
+        if (byte != UINT8_MAX)
+            g_ota.lz4 = OTA_LZ4_LITERALS;
+        break;
+    case OTA_LZ4_LITERALS:
+        if (!otaOutput(byte))
+            return false;
+        if (!--g_ota.length)
+            g_ota.lz4 = OTA_LZ4_OFFSET_LOW;
+        break;
+    case OTA_LZ4_OFFSET_LOW:
+        g_ota.offset = byte;
+        g_ota.lz4 = OTA_LZ4_OFFSET_HIGH;
+        break;
+    case OTA_LZ4_OFFSET_HIGH:
+        g_ota.offset |= byte << 8;
+        g_ota.length = (g_ota.token & 0x0F) + OTA_LZ4_MATCH_MIN;
+        if ((g_ota.token & 0x0F) == OTA_LZ4_LENGTH_EXTENDED)
+            g_ota.lz4 = OTA_LZ4_MATCH_LENGTH;
+        else if (!otaMatch())
+            return false;
+        break;
+    case OTA_LZ4_MATCH_LENGTH:
+        g_ota.length += byte;
+        if (byte != UINT8_MAX && !otaMatch())
+            return false;
+        break;
+    }
+
+    if (!g_ota.blockLeft)
+        return otaBlockEnd();
+
+    return true;
+}
+
+/**
+ * @brief Takes next piece of the response body. Called by request stream as data comes in.
+ *
+ * @param status    HTTP status code.
+ * @param data      data.
+ * @param length    data length.
+ */
+void otaReceive(uint16_t status, const char *data, size_t length)
+{
+    uint8_t byte;
+
+    if (g_ota.requestFailed || (g_ota.state != OTA_STATE_HEADER && g_ota.state != OTA_STATE_DOWNLOAD))
+        return;
+
+    if (status != OTA_HTTP_PARTIAL && status != OTA_HTTP_OK)
+    {
+        g_ota.requestFailed = true;
+        return;
+    }
+
+    /*
+     * Server ignoring the range sends whole file, what's before the range is skipped.
+     */
+    if (g_ota.position == OTA_POSITION_UNKNOWN)
+        g_ota.position = status == OTA_HTTP_PARTIAL ? g_ota.rangeFrom : 0;
+
+    g_ota.downloaded += length;
+
+    for (size_t i = 0; i < length && g_ota.position <= g_ota.rangeTo; i++, g_ota.position++)
+    {
+        if (g_ota.position < g_ota.rangeFrom)
+            continue;
+
+        byte = data[i];
+
+        if (g_ota.state == OTA_STATE_HEADER)
+        {
+            g_ota.record.header[g_ota.position] = byte;
+        }
+        else if (!otaDecode(byte))
+        {
+            g_ota.requestFailed = true;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Starts range request of the image file.
+ *
+ * @param from          first byte.
+ * @param to            last byte.
+ * @return otaStep_t    OTA_STEP_REQUEST if started.
+ */
+otaStep_t otaRequest(uint32_t from, uint32_t to)
+{
+    char *request = requestPrepareRangeGET(g_ota.record.host, g_ota.record.path, from, to);
+
+    g_ota.rangeFrom = from;
+    g_ota.rangeTo = to;
+    g_ota.position = OTA_POSITION_UNKNOWN;
+    g_ota.requestFailed = false;
+
+    if (!requestBeginStream(request, g_ota.record.host, g_ota.record.port, otaReceive))
+    {
+        otaRetry("connection");
+        return OTA_STEP_IDLE;
+    }
+
+    g_ota.requestActive = true;
+    g_ota.requests++;
+
+    return OTA_STEP_REQUEST;
+}
+
+/**
+ * @brief Checks image signature, a slice of ECC operations at a time.
+ *        Once it's good, record is saved and download starts.
+ *
+ * @return otaStep_t    OTA_STEP_BUSY while there's more to do.
+ */
+otaStep_t otaVerifySignature()
+{
+    size_t signedLength = sizeof(otaHeader_t) + otaHeader()->blockCount * 2;
+    const uint8_t *signature = &g_ota.record.header[signedLength];
+    uint8_t hash[OTA_HASH_LEN];
+    int result;
+
+    mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), g_ota.record.header, signedLength, hash);
+
+    mbedtls_ecp_set_max_ops(OTA_VERIFY_MAX_OPS);
+    result = mbedtls_ecdsa_read_signature_restartable(&g_ota.ecdsa, hash, sizeof hash,
+                                                      signature + 1, signature[0], &g_ota.restart);
+    mbedtls_ecp_set_max_ops(0);
+
+    if (result == MBEDTLS_ERR_ECP_IN_PROGRESS)
+        return OTA_STEP_BUSY;
+
+    if (result)
+    {
+        otaFail("signature");
+        return OTA_STEP_IDLE;
+    }
+
+    mbedtls_ecdsa_restart_free(&g_ota.restart);
+    mbedtls_ecdsa_free(&g_ota.ecdsa);
+    g_ota.state = OTA_STATE_IDLE;
+
+    if (!otaRecordSave())
+    {
+        otaFail("flash");
+        return OTA_STEP_IDLE;
+    }
+
+    LOG_INFO(LOG_MODULE_OTA, "image signed, %u bytes in %u blocks", otaHeader()->imageLength,
+             otaHeader()->blockCount);
+    otaPlan();
+
+    return OTA_STEP_BUSY;
+}
+
+/**
+ * @brief Hashes the staged image, a sector at a time, and compares it to signed hash.
+ *
+ * @return otaStep_t    OTA_STEP_BUSY while there's more to do.
+ */
+otaStep_t otaVerifyImage()
+{
+    const otaHeader_t *header = otaHeader();
+    uint32_t length = MIN(OTA_BLOCK_SIZE, header->imageLength - g_ota.verified);
+    uint8_t hash[OTA_HASH_LEN];
+
+    mbedtls_md_update(&g_ota.md, (const uint8_t *)(XIP_BASE + OTA_STAGING_OFFSET + g_ota.verified), length);
+    g_ota.verified += length;
+
+    if (g_ota.verified < header->imageLength)
+        return OTA_STEP_BUSY;
+
+    mbedtls_md_finish(&g_ota.md, hash);
+    mbedtls_md_free(&g_ota.md);
+
+    /*
+     * Staged image doesn't match, downloaded again from scratch.
+     */
+    if (memcmp(hash, header->imageHash, sizeof hash))
+    {
+        g_ota.state = OTA_STATE_IDLE;
+        if (++g_ota.failures >= OTA_RETRIES_MAX || !otaRecordSave())
+        {
+            otaFail("image hash");
+            return OTA_STEP_IDLE;
+        }
+
+        LOG_WARNING(LOG_MODULE_OTA, "image hash mismatch, downloading again");
+        g_ota.error = "image hash";
+        g_ota.retries++;
+        otaPlan();
+        return OTA_STEP_BUSY;
+    }
+
+    LOG_INFO(LOG_MODULE_OTA, "image verified, swapping");
+    g_ota.state = OTA_STATE_SWAP;
+
+    return OTA_STEP_BUSY;
+}
+
+/**
+ * @brief Copies staged image over running firmware, clears update state and restarts.
+ *        Runs from RAM, with XIP off while sectors are erased and programmed,
+ *        so it touches nothing in flash but the staged image, read between operations.
+ *        Called by flash_safe_execute(), never returns.
+ *
+ * @param param image length (uint32_t).
+ */
+void __no_inline_not_in_flash_func(otaSwap)(void *param)
+{
+    uint32_t length = *(uint32_t *)param;
+    const volatile uint8_t *staged = (const volatile uint8_t *)(XIP_BASE + OTA_STAGING_OFFSET);
+
+    for (uint32_t offset = 0; offset < length; offset += OTA_BLOCK_SIZE)
+    {
+        for (int i = 0; i < OTA_BLOCK_SIZE; i++)
+            g_ota.sector[i] = staged[offset + i];
+
+        flash_range_erase(offset, OTA_BLOCK_SIZE);
+        flash_range_program(offset, g_ota.sector, OTA_BLOCK_SIZE);
+    }
+
+    flash_range_erase(OTA_STATE_OFFSET, FLASH_SECTOR_SIZE);
+
+    scb_hw->aircr = (0x05FA << M0PLUS_AIRCR_VECTKEY_LSB) | M0PLUS_AIRCR_SYSRESETREQ_BITS;
+    while (true)
+        ;
+}
+
+/**
+ * @brief Starts firmware update from HTTPS URL, "https://host[:port]/path".
+ *        Update already going on is abandoned.
+ *
+ * @param url       image URL.
+ * @return true     update started.
+ * @return false    bad URL, no public key, or running firmware doesn't leave room for staging.
+ */
+bool otaBegin(char *url)
+{
+    extern char __flash_binary_end;
+    const char *host, *path;
+    size_t hostLength;
+
+    if (g_ota.requestActive || strlen(g_publicKey) != OTA_PUBLIC_KEY_LEN * 2 ||
+        (uintptr_t)&__flash_binary_end - XIP_BASE > OTA_STAGING_OFFSET)
+        return false;
+
+    if (strncmp(url, OTA_URL_SCHEME, strlen(OTA_URL_SCHEME)))
+        return false;
+
+    host = url + strlen(OTA_URL_SCHEME);
+    hostLength = strcspn(host, ":/");
+    path = strchr(host, '/');
+    if (!path)
+        path = "/";
+
+    if (!hostLength || hostLength > OTA_HOST_LEN || strlen(path) > OTA_PATH_LEN)
+        return false;
+
+    otaStop();
+
+    memset(&g_ota.record, 0, sizeof g_ota.record);
+    memcpy(g_ota.record.host, host, hostLength);
+    strcpy(g_ota.record.path, path);
+    g_ota.record.port = host[hostLength] == ':' ? atoi(&host[hostLength + 1]) : OTA_PORT_DEFAULT;
+
+    if (!g_ota.record.port)
+        return false;
+
+    g_ota.failures = 0;
+    g_ota.error = NULL;
+    g_ota.state = OTA_STATE_HEADER;
+    LOG_INFO(LOG_MODULE_OTA, "update started");
+
+    return true;
+}
+
+/**
+ * @brief Resumes update stopped by restart, if there was one. Done once at boot.
+ *
+ * @return true update resumed.
+ */
+bool otaResume()
+{
+    const otaRecord_t *saved = (const otaRecord_t *)(XIP_BASE + OTA_STATE_OFFSET);
+
+    if (saved->magic != OTA_RECORD_MAGIC || otaRecordCrc(saved) != saved->crc)
+        return false;
+
+    memcpy(&g_ota.record, saved, sizeof g_ota.record);
+    g_ota.failures = 0;
+    otaPlan();
+    LOG_INFO(LOG_MODULE_OTA, "update resumed");
+
+    return g_ota.state != OTA_STATE_IDLE;
+}
+
+/**
+ * @brief Stops the update and forgets it. Request going on is left to finish, its data is ignored.
+ */
+void otaStop()
+{
+    otaRelease();
+    g_ota.state = OTA_STATE_IDLE;
+    otaFlashRun(OTA_STATE_OFFSET, NULL, FLASH_SECTOR_SIZE);
+}
+
+/**
+ * @brief Checks if update has work to do.
+ *
+ * @return true update going on.
+ */
+bool otaPending()
+{
+    return g_ota.state != OTA_STATE_IDLE;
+}
+
+/**
+ * @brief Does next piece of update work. Called by network task when there are no feed requests.
+ *
+ * @return otaStep_t    OTA_STEP_REQUEST when request was started, otaRequestDone() is to be called
+ *                      once it's done, OTA_STEP_BUSY when there's more work right away,
+ *                      OTA_STEP_IDLE when there's nothing more for now.
+ */
+otaStep_t otaStep()
+{
+    uint32_t length;
+
+    switch (g_ota.state)
+    {
+    case OTA_STATE_HEADER:
+        return otaRequest(0, OTA_HEADER_MAX - 1);
+    case OTA_STATE_SIGNATURE:
+        return otaVerifySignature();
+    case OTA_STATE_ERASE:
+        if (!otaFlashRun(OTA_STAGING_OFFSET + g_ota.eraseBlock * OTA_BLOCK_SIZE, NULL, OTA_BLOCK_SIZE))
+        {
+            otaRetry("flash");
+            return OTA_STEP_IDLE;
+        }
+        if (++g_ota.eraseBlock == g_ota.blockEnd)
+            g_ota.state = OTA_STATE_DOWNLOAD;
+        return OTA_STEP_BUSY;
+    case OTA_STATE_DOWNLOAD:
+        otaBlockStart(g_ota.blockFirst);
+        return otaRequest(otaBlockPosition(g_ota.blockFirst), otaBlockPosition(g_ota.blockEnd) - 1);
+    case OTA_STATE_VERIFY:
+        return otaVerifyImage();
+    case OTA_STATE_SWAP:
+        length = otaHeader()->imageLength;
+        /*
+         * Swap restarts the device, it returns only when the other core couldn't be locked out.
+         * Image stays verified, swap is tried again on the next step.
+         */
+        if (flash_safe_execute(otaSwap, &length, OTA_FLASH_TIMEOUT) != PICO_OK)
+        {
+            LOG_ERROR(LOG_MODULE_OTA, "swap lockout timed out");
+            g_ota.error = "swap";
+            g_ota.retries++;
+            return OTA_STEP_IDLE;
+        }
+        return OTA_STEP_BUSY;
+    default:
+        return OTA_STEP_IDLE;
+    }
+}
+
+/**
+ * @brief Handles finished request. Blocks that came in are kept, the rest is planned again.
+ */
+void otaRequestDone()
+{
+    uint16_t block = g_ota.block;
+
+    g_ota.requestActive = false;
+
+    switch (g_ota.state)
+    {
+    case OTA_STATE_HEADER:
+        if (g_ota.requestFailed || g_ota.position == OTA_POSITION_UNKNOWN ||
+            g_ota.position < sizeof(otaHeader_t) ||
+            g_ota.position < otaHeaderLength(MIN(otaHeader()->blockCount, OTA_BLOCKS_MAX)))
+        {
+            otaRetry("header");
+            break;
+        }
+        if (!otaHeaderValid())
+        {
+            otaFail("header");
+            break;
+        }
+        if (!otaKeyLoad())
+        {
+            otaFail("public key");
+            break;
+        }
+        g_ota.failures = 0;
+        g_ota.state = OTA_STATE_SIGNATURE;
+        break;
+    case OTA_STATE_DOWNLOAD:
+        if (block == g_ota.blockFirst)
+            otaRetry(g_ota.requestFailed ? "broken block" : "download");
+        else
+            g_ota.failures = 0;
+
+        if (g_ota.state != OTA_STATE_IDLE)
+            otaPlan();
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Prints update progress.
+ */
+void otaPrintStats()
+{
+    static const char *states[] = {"IDLE", "HEADER", "SIGNATURE", "ERASE", "DOWNLOAD", "VERIFY", "SWAP"};
+    const otaHeader_t *header = otaHeader();
+    uint16_t done = 0;
+
+    if (g_ota.state > OTA_STATE_HEADER)
+    {
+        for (int i = 0; i < header->blockCount; i++)
+            done += otaBlockDone(i);
+    }
+
+    printf("OTA: %s\n"
+           "URL: https://%s:%u%s\n"
+           "BLOCKS: %u/%u\n"
+           "DOWNLOADED: %lu\n"
+           "REQUESTS: %lu\n"
+           "RETRIES: %lu\n"
+           "LAST ERROR: %s\n",
+           states[g_ota.state], g_ota.record.host, g_ota.record.port, g_ota.record.path,
+           done, g_ota.state > OTA_STATE_HEADER ? header->blockCount : 0,
+           g_ota.downloaded, g_ota.requests, g_ota.retries, g_ota.error ? g_ota.error : "NONE");
+}
@@ -0,0 +1,41 @@
+/*
+ * File: ota.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef OTA_H
+#define OTA_H
+
+#define OTA_HOST_LEN 64
+#define OTA_PATH_LEN 128
+
+/*
+ * Flash is split in two slots, running firmware in the first,
+ * staged image in the second. Update state sector follows them,
+ * configuration lives at the very end of flash.
+ */
+#define OTA_SLOT_SIZE 0xF8000
+#define OTA_STAGING_OFFSET OTA_SLOT_SIZE
+#define OTA_STATE_OFFSET (OTA_STAGING_OFFSET + OTA_SLOT_SIZE)
+
+typedef enum
+{
+    OTA_STEP_IDLE,
+    OTA_STEP_BUSY,
+    OTA_STEP_REQUEST
+} otaStep_t;
+
+bool otaBegin(char *url);
+bool otaResume();
+void otaStop();
+bool otaPending();
+otaStep_t otaStep();
+void otaRequestDone();
+void otaPrintStats();
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * File: profiler.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Sampling profiler.
+ *
+ * A hardware alarm fires at the requested rate, its interrupt handler grabs the
+ * program counter from the exception frame of whatever code it interrupted and
+ * puts it into a ring buffer. The main loop drains the ring into a histogram,
+ * which can be dumped over serial and symbolised with tools/profile.py.
+ *
+ * Profiler is off until started with "PRF STRT [rate]" serial command.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+#include "profiler.h"
+
+/*
+ * Must be a power of 2.
+ */
+#define PROFILER_RING_LEN 2048
+#define PROFILER_HISTOGRAM_LEN 512
+/*
+ * Stacked exception frame is r0, r1, r2, r3, r12, lr, pc, xPSR.
+ */
+#define PROFILER_FRAME_PC 6
+#define PROFILER_HASH_MULTIPLIER 2654435761u
+#define PROFILER_HASH_SHIFT 23
+
+#define PROFILER_MESSAGE_BEGIN "PRF BEGIN"
+#define PROFILER_MESSAGE_END "PRF END"
+
+/**
+ * @brief A single histogram bucket. Sample count for one program counter.
+ */
+typedef struct
+{
+    uint32_t pc;
+    uint32_t count;
+} profilerBucket_t;
+
+static volatile uint32_t g_ring[PROFILER_RING_LEN];
+static volatile uint16_t g_ringHead;
+static volatile uint16_t g_ringTail;
+static volatile uint32_t g_ringOverflows;
+
+static profilerBucket_t g_histogram[PROFILER_HISTOGRAM_LEN];
+static uint32_t g_samples;
+static uint32_t g_dropped;
+
+static int g_alarm = -1;
+static volatile uint32_t g_period;
+static volatile uint32_t g_rate;
+static volatile bool g_dumpRequested;
+static volatile bool g_clearRequested;
+
+/**
+ * @brief Records sample and rearms the alarm.
+ * Jumped to from profilerAlarmHandler(), with LR still holding EXC_RETURN,
+ * so returning from here returns from the interrupt.
+ * Not static, as it's referenced by name from assembly.
+ *
+ * @param frame exception frame stacked by the interrupted code.
+ */
+void __not_in_flash_func(profilerRecordSample)(uint32_t *frame)
+{
+    uint16_t next = (g_ringHead + 1) & (PROFILER_RING_LEN - 1);
+
+    timer_hw->intr = 1u << g_alarm;
+    timer_hw->alarm[g_alarm] = timer_hw->timerawl + g_period;
+
+    if (next == g_ringTail)
+    {
+        g_ringOverflows++;
+        return;
+    }
+
+    g_ring[g_ringHead] = frame[PROFILER_FRAME_PC];
+    g_ringHead = next;
+}
+
+/**
+ * @brief Alarm interrupt handler.
+ * It must not touch the stack before the frame pointer is taken,
+ * hence it's naked and just picks the right stack pointer.
+ */
+static void __attribute__((naked)) __not_in_flash_func(profilerAlarmHandler)(void)
+{
+    __asm volatile(
+        "movs r0, #4\n"
+        "mov r1, lr\n"
+        "tst r0, r1\n"
+        "bne 1f\n"
+        "mrs r0, msp\n"
+        "b 2f\n"
+        "1:\n"
+        "mrs r0, psp\n"
+        "2:\n"
+        "ldr r1, =profilerRecordSample\n"
+        "bx r1\n"
+        ".align 2\n"
+        ".ltorg\n");
+}
+
+/**
+ * @brief Puts sample into histogram.
+ *
+ * @param pc program counter.
+ */
+void histogramAdd(uint32_t pc)
+{
+    uint32_t index = (pc * PROFILER_HASH_MULTIPLIER) >> PROFILER_HASH_SHIFT;
+
+    for (int i = 0; i < PROFILER_HISTOGRAM_LEN; i++)
+    {
+        profilerBucket_t *bucket = &g_histogram[(index + i) & (PROFILER_HISTOGRAM_LEN - 1)];
+
+        if (bucket->pc == pc || !bucket->count)
+        {
+            bucket->pc = pc;
+            bucket->count++;
+            g_samples++;
+            return;
+        }
+    }
+
+    g_dropped++;
+}
+
+/**
+ * @brief Prints histogram on serial. One "pc count" line per bucket.
+ */
+void histogramDump()
+{
+    printf("%s %lu %lu %lu %lu\n", PROFILER_MESSAGE_BEGIN,
+           g_rate, g_samples, g_dropped, g_ringOverflows);
+
+    for (int i = 0; i < PROFILER_HISTOGRAM_LEN; i++)
+    {
+        if (g_histogram[i].count)
+            printf("%08lx %lu\n", g_histogram[i].pc, g_histogram[i].count);
+    }
+
+    printf("%s\n", PROFILER_MESSAGE_END);
+}
+
+/**
+ * @brief Starts sampling.
+ *
+ * @param rate      sampling rate in Hz, 0 for default.
+ * @return true     profiler is running.
+ * @return false    no free hardware alarm.
+ */
+bool profilerStart(uint32_t rate)
+{
+    if (!rate)
+        rate = PROFILER_DEFAULT_RATE;
+    if (rate > PROFILER_MAX_RATE)
+        rate = PROFILER_MAX_RATE;
+
+    g_rate = rate;
+    g_period = 1000000 / rate;
+
+    if (g_alarm < 0)
+    {
+        g_alarm = hardware_alarm_claim_unused(false);
+        if (g_alarm < 0)
+            return false;
+
+        /*
+         * Highest priority, so samples are taken inside other interrupt handlers too.
+         */
+        irq_set_exclusive_handler(TIMER_IRQ_0 + g_alarm, profilerAlarmHandler);
+        irq_set_priority(TIMER_IRQ_0 + g_alarm, PICO_HIGHEST_IRQ_PRIORITY);
+    }
+
+    hw_set_bits(&timer_hw->inte, 1u << g_alarm);
+    irq_set_enabled(TIMER_IRQ_0 + g_alarm, true);
+    timer_hw->alarm[g_alarm] = timer_hw->timerawl + g_period;
+
+    return true;
+}
+
+/**
+ * @brief Stops sampling. Collected data is kept until cleared.
+ */
+void profilerStop()
+{
+    if (g_alarm < 0)
+        return;
+
+    irq_set_enabled(TIMER_IRQ_0 + g_alarm, false);
+    hw_clear_bits(&timer_hw->inte, 1u << g_alarm);
+    timer_hw->armed = 1u << g_alarm;
+    timer_hw->intr = 1u << g_alarm;
+}
+
+/**
+ * @brief Requests histogram dump. It's printed on next profilerUpdate(),
+ * so it's safe to call from interrupts.
+ */
+void profilerRequestDump()
+{
+    g_dumpRequested = true;
+}
+
+/**
+ * @brief Requests clearing collected data on next profilerUpdate().
+ */
+void profilerRequestClear()
+{
+    g_clearRequested = true;
+}
+
+/**
+ * @brief Drains sample ring into histogram and handles dump / clear requests.
+ * Must be called periodically from main loop.
+ */
+void profilerUpdate()
+{
+    while (g_ringTail != g_ringHead)
+    {
+        histogramAdd(g_ring[g_ringTail]);
+        g_ringTail = (g_ringTail + 1) & (PROFILER_RING_LEN - 1);
+    }
+
+    if (g_dumpRequested)
+    {
+        histogramDump();
+        g_dumpRequested = false;
+    }
+
+    if (g_clearRequested)
+    {
+        memset(g_histogram, 0, sizeof g_histogram);
+        g_samples = 0;
+        g_dropped = 0;
+        g_ringOverflows = 0;
+        g_clearRequested = false;
+    }
+}
@@ -0,0 +1,23 @@
+/*
+ * File: profiler.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define PROFILER_DEFAULT_RATE 250
+#define PROFILER_MAX_RATE 10000
+
+bool profilerStart(uint32_t rate);
+void profilerStop();
+void profilerRequestDump();
+void profilerRequestClear();
+void profilerUpdate();
+
+#endif
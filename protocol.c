@@ -0,0 +1,250 @@
+/*
+ * File: protocol.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Binary serial protocol, for tools rather than people.
+ *
+ * Frame is header (type, request id), payload and CRC-32 of both, COBS encoded
+ * and wrapped in zero bytes. It shares uart and usb serial with text commands,
+ * serial.c tells them apart by the leading zero. Every request gets a reply of
+ * the same type with PROTOCOL_REPLY bit set, the same request id, and payload
+ * starting with status (configStatus_t). Frames with bad CRC are dropped.
+ *
+ * Requests (little endian):
+ *  PING            any payload, echoed back.
+ *  SETTING_READ    u32 key, replied with u8 value kind (PROTOCOL_VALUE_[...])
+ *                  and value (see configSettingRead()).
+ *  SETTING_WRITE   u32 key, value.
+ *  BLOB_READ       u16 offset, u16 length, replied with u16 offset and blob chunk.
+ *  BLOB_WRITE      u16 offset, blob chunk.
+ *  BLOB_APPLY      u16 length, imports written blob and commits it to flash.
+ *  SUBSCRIBE       u16 period in miliseconds, 0 stops. Telemetry frames
+ *                  (telemetryRecord_t) follow with request id of the subscription.
+ *
+ * tools/klik_client.py is the reference host side.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#include "protocol.h"
+#include "config.h"
+#include "serial.h"
+#include "cobs.h"
+#include "crc.h"
+#include "telemetry.h"
+
+#define PROTOCOL_FRAME_MAX (sizeof(protocolHeader_t) + PROTOCOL_PAYLOAD_MAX + sizeof(uint32_t))
+#define PROTOCOL_DELIMITER 0
+
+static uint8_t g_frame[PROTOCOL_FRAME_MAX];
+static uint8_t g_reply[PROTOCOL_FRAME_MAX];
+static uint8_t g_encoded[COBS_ENCODED_LEN(PROTOCOL_FRAME_MAX)];
+
+static uint32_t g_frames;
+static uint32_t g_frameErrors;
+
+/**
+ * @brief Sends frame on serial.
+ *
+ * @param type      frame type.
+ * @param requestId request id.
+ * @param payload   payload, may be reply payload area already.
+ * @param length    payload length, at most PROTOCOL_PAYLOAD_MAX.
+ */
+void protocolSend(uint8_t type, uint8_t requestId, const void *payload, size_t length)
+{
+    protocolHeader_t *header = (protocolHeader_t *)g_reply;
+    uint8_t *data = (uint8_t *)(header + 1);
+    uint32_t crc;
+    size_t encodedLength;
+
+    header->type = type;
+    header->requestId = requestId;
+    if (payload != data)
+        memmove(data, payload, length);
+
+    crc = crc32(g_reply, sizeof *header + length);
+    memcpy(data + length, &crc, sizeof crc);
+    encodedLength = cobsEncode(g_reply, sizeof *header + length + sizeof crc, g_encoded);
+
+    putchar_raw(PROTOCOL_DELIMITER);
+    for (size_t i = 0; i < encodedLength; i++)
+        putchar_raw(g_encoded[i]);
+    putchar_raw(PROTOCOL_DELIMITER);
+    stdio_flush();
+}
+
+/**
+ * @brief Sends reply with status only.
+ *
+ * @param header    request header.
+ * @param status    status.
+ */
+void replyStatus(protocolHeader_t *header, uint8_t status)
+{
+    protocolSend(header->type | PROTOCOL_REPLY, header->requestId, &status, sizeof status);
+}
+
+/**
+ * @brief Handles request, payload is already checked.
+ *
+ * @param header    request header.
+ * @param payload   request payload.
+ * @param length    payload length.
+ */
+void requestHandle(protocolHeader_t *header, uint8_t *payload, size_t length)
+{
+    uint8_t *reply = g_reply + sizeof(protocolHeader_t);
+    uint32_t key;
+    uint16_t offset, size;
+    bool number;
+    int read;
+
+    switch (header->type)
+    {
+    case PROTOCOL_TYPE_PING:
+        reply[0] = CONFIG_STATUS_SUCCESS;
+        memcpy(&reply[1], payload, MIN(length, PROTOCOL_PAYLOAD_MAX - 1));
+        protocolSend(header->type | PROTOCOL_REPLY, header->requestId, reply, MIN(length + 1, PROTOCOL_PAYLOAD_MAX));
+        break;
+    case PROTOCOL_TYPE_SETTING_READ:
+        if (length != sizeof key)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&key, payload, sizeof key);
+        read = configSettingRead(key, &reply[2], PROTOCOL_PAYLOAD_MAX - 2, &number);
+        if (read < 0)
+        {
+            replyStatus(header, CONFIG_STATUS_UNSUPPORTED);
+            break;
+        }
+
+        reply[0] = CONFIG_STATUS_SUCCESS;
+        reply[1] = number ? PROTOCOL_VALUE_NUMBER : PROTOCOL_VALUE_STRING;
+        protocolSend(header->type | PROTOCOL_REPLY, header->requestId, reply, read + 2);
+        break;
+    case PROTOCOL_TYPE_SETTING_WRITE:
+        if (length < sizeof key)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&key, payload, sizeof key);
+        replyStatus(header, configSettingWrite(key, payload + sizeof key, length - sizeof key));
+        break;
+    case PROTOCOL_TYPE_BLOB_READ:
+        if (length != sizeof offset + sizeof size)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&offset, payload, sizeof offset);
+        memcpy(&size, payload + sizeof offset, sizeof size);
+        read = configBlobRead(offset, &reply[1 + sizeof offset], MIN(size, PROTOCOL_PAYLOAD_MAX - 1 - sizeof offset));
+
+        reply[0] = CONFIG_STATUS_SUCCESS;
+        memcpy(&reply[1], &offset, sizeof offset);
+        protocolSend(header->type | PROTOCOL_REPLY, header->requestId, reply, 1 + sizeof offset + read);
+        break;
+    case PROTOCOL_TYPE_BLOB_WRITE:
+        if (length < sizeof offset)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&offset, payload, sizeof offset);
+        replyStatus(header, configBlobWrite(offset, payload + sizeof offset, length - sizeof offset)
+                                ? CONFIG_STATUS_SUCCESS
+                                : CONFIG_STATUS_FAILURE);
+        break;
+    case PROTOCOL_TYPE_BLOB_APPLY:
+        if (length != sizeof size)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&size, payload, sizeof size);
+        replyStatus(header, configBlobApply(size));
+        break;
+    case PROTOCOL_TYPE_SUBSCRIBE:
+        if (length != sizeof size)
+        {
+            replyStatus(header, CONFIG_STATUS_FAILURE);
+            break;
+        }
+
+        memcpy(&size, payload, sizeof size);
+        telemetrySetPeriod(size, header->requestId);
+        replyStatus(header, CONFIG_STATUS_SUCCESS);
+        break;
+    default:
+        replyStatus(header, CONFIG_STATUS_UNSUPPORTED);
+        break;
+    }
+}
+
+/**
+ * @brief Handles binary frame received on serial.
+ *
+ * @param frame COBS encoded frame, without delimiters.
+ */
+void protocolHandleFrame(char *frame)
+{
+    int length = cobsDecode((uint8_t *)frame, strlen(frame), g_frame, sizeof g_frame);
+    protocolHeader_t header;
+    uint32_t crc;
+
+    if (length < (int)(sizeof header + sizeof crc))
+    {
+        g_frameErrors++;
+        return;
+    }
+
+    length -= sizeof crc;
+    memcpy(&crc, &g_frame[length], sizeof crc);
+    if (crc32(g_frame, length) != crc)
+    {
+        g_frameErrors++;
+        return;
+    }
+
+    memcpy(&header, g_frame, sizeof header);
+    g_frames++;
+    requestHandle(&header, g_frame + sizeof header, length - sizeof header);
+}
+
+/**
+ * @brief Gets number of frames dropped for bad encoding or CRC.
+ *
+ * @return uint32_t frame errors.
+ */
+uint32_t protocolGetErrors()
+{
+    return g_frameErrors;
+}
+
+/**
+ * @brief Prints protocol statistics on serial.
+ */
+void protocolPrintStats()
+{
+    printf("FRAMES: %lu\n"
+           "FRAME ERRORS: %lu\n",
+           g_frames, g_frameErrors);
+}
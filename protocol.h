@@ -0,0 +1,48 @@
+/*
+ * File: protocol.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/*
+ * Replies have request type with this bit set.
+ */
+#define PROTOCOL_REPLY 0x80
+#define PROTOCOL_PAYLOAD_MAX 1024
+#define PROTOCOL_VALUE_STRING 0
+#define PROTOCOL_VALUE_NUMBER 1
+
+typedef enum
+{
+    PROTOCOL_TYPE_PING = 0x01,
+    PROTOCOL_TYPE_SETTING_READ = 0x02,
+    PROTOCOL_TYPE_SETTING_WRITE = 0x03,
+    PROTOCOL_TYPE_BLOB_READ = 0x04,
+    PROTOCOL_TYPE_BLOB_WRITE = 0x05,
+    PROTOCOL_TYPE_BLOB_APPLY = 0x06,
+    PROTOCOL_TYPE_SUBSCRIBE = 0x07,
+    PROTOCOL_TYPE_TELEMETRY = 0x40
+} protocolType_t;
+
+/**
+ * @brief Frame header, followed by payload and CRC-32 of both.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t type;
+    uint8_t requestId;
+} protocolHeader_t;
+
+void protocolHandleFrame(char *frame);
+void protocolSend(uint8_t type, uint8_t requestId, const void *payload, size_t length);
+uint32_t protocolGetErrors();
+void protocolPrintStats();
+
+#endif
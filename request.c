@@ -11,19 +11,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
 
 #include "request.h"
 #include "config.h"
+#include "json.h"
 
 #include "libs/picow_tls_client/picow_tls_client.h"
 
 #define REQUEST_SETUP_TIMEOUT 10000
 #define REQUEST_HOSTNAME "io.adafruit.com"
+#define REQUEST_PORT 443
 
 #define REQUEST_PREPARE_TYPE_STRING_LEN 4
 #define REQUEST_PREPARE_VALUE_STRING_LEN 16
 #define REQUEST_PREPARE_CONNECTION_SIZE_STRING_LEN 21
+#define REQUEST_PREPARE_RESOURCE_STRING_LEN (REQUEST_API_FEED_NAME_LEN + 16)
+
+#define REQUEST_STREAM_LINE_LEN 64
+#define REQUEST_STREAM_VALUE_LEN 8
+#define REQUEST_HTTP_OK 200
+
+/*
+ * Streamed response is parsed as it comes in, split anywhere by the network.
+ * Status line and headers are read line by line, body goes to body callback,
+ * dechunked when needed. Group response body goes on to JSON scanner.
+ */
+typedef enum
+{
+    REQUEST_STREAM_STATUS,
+    REQUEST_STREAM_HEADERS,
+    REQUEST_STREAM_BODY,
+    REQUEST_STREAM_CHUNK_SIZE,
+    REQUEST_STREAM_CHUNK_DATA,
+    REQUEST_STREAM_CHUNK_END,
+    REQUEST_STREAM_DONE
+} requestStreamState_t;
+
+typedef struct
+{
+    requestStreamState_t state;
+    bool chunked;
+    uint16_t status;
+    uint32_t chunkLeft;
+    uint8_t lineLength;
+    char line[REQUEST_STREAM_LINE_LEN + 1];
+    jsonScanner_t scanner;
+    uint8_t feedsDepth;
+    char feedKey[REQUEST_API_FEED_NAME_LEN + 1];
+    char feedValue[REQUEST_STREAM_VALUE_LEN + 1];
+    requestValueCallback_t callback;
+    requestBodyCallback_t body;
+} requestStream_t;
 
 /*
  * I don't like defining this globally,
@@ -41,12 +82,14 @@ static TLS_CLIENT_T *g_client;
  */
 static char g_request[REQUEST_API_FORM_MAX_LEN + 1];
 
+static requestStream_t g_stream;
+
 /**
  * @brief Prepares http request string for Adafruit IO HTTP API.
  *
- * @param type          type of the request, (REQUESTS_)GET or POST.
+ * @param type          type of the request, (REQUESTS_)GET, POST or GROUP_GET.
  * @param apiUsername   owner's (account) username.
- * @param apiFeedName   feed name.
+ * @param apiFeedName   feed name, or group name for group request.
  * @param apiKey        api key.
  * @param value         value to be set.
  * @return char*        Request string.
@@ -56,6 +99,7 @@ char *prepareRequest(requestType_t type, char *apiUsername, char *apiFeedName, c
     static char typeString[REQUEST_PREPARE_TYPE_STRING_LEN + 1];
     static char valueString[REQUEST_PREPARE_VALUE_STRING_LEN + 1];
     static char connectionLengthString[REQUEST_PREPARE_CONNECTION_SIZE_STRING_LEN + 1];
+    static char resourceString[REQUEST_PREPARE_RESOURCE_STRING_LEN + 1];
 
     memset(typeString, 0, sizeof typeString);
     memset(valueString, 0, sizeof valueString);
@@ -65,9 +109,15 @@ char *prepareRequest(requestType_t type, char *apiUsername, char *apiFeedName, c
     {
     case REQUEST_GET:
         strncpy(typeString, "GET", 3);
+        snprintf(resourceString, sizeof resourceString, "feeds/%s/data", apiFeedName);
+        break;
+    case REQUEST_GROUP_GET:
+        strncpy(typeString, "GET", 3);
+        snprintf(resourceString, sizeof resourceString, "groups/%s", apiFeedName);
         break;
     case REQUEST_POST:
         strncpy(typeString, "POST", 4);
+        snprintf(resourceString, sizeof resourceString, "feeds/%s/data", apiFeedName);
         snprintf(valueString, REQUEST_PREPARE_VALUE_STRING_LEN, "{\"value\":%d}\r\n", value);
         snprintf(connectionLengthString, REQUEST_PREPARE_CONNECTION_SIZE_STRING_LEN,
                  "Content-Length: %d\r\n", strlen(valueString));
@@ -75,7 +125,7 @@ char *prepareRequest(requestType_t type, char *apiUsername, char *apiFeedName, c
     }
 
     snprintf(g_request, REQUEST_API_FORM_MAX_LEN + 1,
-             "%s /api/v2/%s/feeds/%s/data HTTP/1.1\r\n"
+             "%s /api/v2/%s/%s HTTP/1.1\r\n"
              "X-AIO-Key: %s\r\n"
              "Content-Type: application/json\r\n"
              "Accept: */*\r\n"
@@ -84,7 +134,7 @@ char *prepareRequest(requestType_t type, char *apiUsername, char *apiFeedName, c
              "%s"
              "\r\n"
              "%s",
-             typeString, apiUsername, apiFeedName,
+             typeString, apiUsername, resourceString,
              apiKey,
              connectionLengthString,
              valueString);
@@ -145,31 +195,344 @@ char *requestPreparePOST(int8_t value, char *apiUsername, char *apiFeedName, cha
 }
 
 /**
- * @brief Sends http request to Adafruit IO HTTP API.
+ * @brief Prepares http GET request of a feed group for Adafruit IO HTTP API.
+ *        Response carries last values of all feeds in the group.
  *
- * @param request request.
- * @return char*  http response.
+ * @param apiUsername  owner's (account) username.
+ * @param apiGroupName group key.
+ * @param apiKey       api key.
+ * @return char*       Http GET request string.
  */
-char *requestSend(char *request)
+char *requestPrepareGroupGET(char *apiUsername, char *apiGroupName, char *apiKey)
+{
+    return prepareRequest(REQUEST_GROUP_GET, apiUsername, apiGroupName, apiKey, 0);
+}
+
+/**
+ * @brief Prepares http GET request of a part of a file, for any server.
+ *
+ * @param hostname  server name.
+ * @param path      file path.
+ * @param from      first byte.
+ * @param to        last byte.
+ * @return char*    Http GET request string.
+ */
+char *requestPrepareRangeGET(char *hostname, char *path, uint32_t from, uint32_t to)
 {
-    static TLS_CLIENT_T client;
+    snprintf(g_request, REQUEST_API_FORM_MAX_LEN + 1,
+             "GET %s HTTP/1.1\r\n"
+             "Host: %s\r\n"
+             "Range: bytes=%lu-%lu\r\n"
+             "Accept: */*\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             path, hostname, from, to);
+
+    return g_request;
+}
 
-    client.hostname = REQUEST_HOSTNAME;
-    client.request = request;
+/**
+ * @brief Picks feed keys and last values out of group response.
+ *        Feeds are objects in "feeds" array, their nested objects are skipped.
+ */
+void streamJsonEvent(void *context, jsonEvent_t event, const char *key, const char *value, uint8_t depth)
+{
+    requestStream_t *stream = (requestStream_t *)context;
+    uint8_t feedDepth = stream->feedsDepth + 1;
 
-    if (!tls_client_open(&client))
-        return NULL;
-    while (!client.complete)
+    switch (event)
     {
-        altcp_tls_poll_cyw43();
-        sleep_ms(1);
+    case JSON_EVENT_OPEN:
+        if (!stream->feedsDepth && !strcmp(key, "feeds"))
+        {
+            stream->feedsDepth = depth;
+        }
+        else if (stream->feedsDepth && depth == feedDepth)
+        {
+            stream->feedKey[0] = 0;
+            stream->feedValue[0] = 0;
+        }
+        break;
+    case JSON_EVENT_VALUE:
+        if (!stream->feedsDepth || depth != feedDepth)
+            break;
+
+        if (!strcmp(key, "key"))
+            snprintf(stream->feedKey, sizeof stream->feedKey, "%s", value);
+        else if (!strcmp(key, "last_value"))
+            snprintf(stream->feedValue, sizeof stream->feedValue, "%s", value);
+        break;
+    case JSON_EVENT_CLOSE:
+        if (stream->feedsDepth && depth == feedDepth && stream->feedKey[0])
+            stream->callback(stream->feedKey, stream->feedValue);
+        else if (depth == stream->feedsDepth)
+            stream->feedsDepth = 0;
+        break;
     }
+}
+
+/**
+ * @brief Passes group response body to JSON scanner.
+ *
+ * @param status    HTTP status code.
+ * @param data      piece of the body.
+ * @param length    piece length.
+ */
+void streamJsonBody(uint16_t status, const char *data, size_t length)
+{
+    if (status == REQUEST_HTTP_OK)
+        jsonScannerFeed(&g_stream.scanner, data, length);
+}
+
+/**
+ * @brief Handles complete status, header or chunk size line.
+ *
+ * @param stream stream.
+ */
+void streamLine(requestStream_t *stream)
+{
+    char *space;
+
+    stream->line[stream->lineLength] = 0;
+    stream->lineLength = 0;
+
+    switch (stream->state)
+    {
+    case REQUEST_STREAM_STATUS:
+        space = strchr(stream->line, ' ');
+        stream->status = space ? atoi(space + 1) : 0;
+        stream->state = REQUEST_STREAM_HEADERS;
+        break;
+    case REQUEST_STREAM_HEADERS:
+        if (!stream->line[0])
+            stream->state = stream->chunked ? REQUEST_STREAM_CHUNK_SIZE : REQUEST_STREAM_BODY;
+        else if (!strncasecmp(stream->line, "Transfer-Encoding:", 18) && strstr(stream->line, "chunked"))
+            stream->chunked = true;
+        break;
+    case REQUEST_STREAM_CHUNK_SIZE:
+        stream->chunkLeft = strtoul(stream->line, NULL, 16);
+        stream->state = stream->chunkLeft ? REQUEST_STREAM_CHUNK_DATA : REQUEST_STREAM_DONE;
+        break;
+    case REQUEST_STREAM_CHUNK_END:
+        stream->state = REQUEST_STREAM_CHUNK_SIZE;
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Takes next piece of streamed response. Called by TLS client as data comes in.
+ *
+ * @param data      data.
+ * @param length    data length.
+ */
+void streamReceive(const char *data, size_t length)
+{
+    requestStream_t *stream = &g_stream;
+    size_t part;
+
+    while (length)
+    {
+        switch (stream->state)
+        {
+        case REQUEST_STREAM_BODY:
+            stream->body(stream->status, data, length);
+            return;
+        case REQUEST_STREAM_CHUNK_DATA:
+            part = MIN(length, stream->chunkLeft);
+            stream->body(stream->status, data, part);
+            data += part;
+            length -= part;
+            stream->chunkLeft -= part;
+            if (!stream->chunkLeft)
+                stream->state = REQUEST_STREAM_CHUNK_END;
+            break;
+        case REQUEST_STREAM_DONE:
+            return;
+        default:
+            if (*data == '\n')
+                streamLine(stream);
+            else if (*data != '\r' && stream->lineLength < REQUEST_STREAM_LINE_LEN)
+                stream->line[stream->lineLength++] = *data;
+            data++;
+            length--;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Opens connection to the server and sends request.
+ *
+ * @param request   request.
+ * @param hostname  server name.
+ * @param port      server port.
+ * @return true     request started.
+ * @return false    connection could not be opened.
+ */
+bool requestOpen(char *request, char *hostname, uint16_t port)
+{
+    if (!g_client)
+        return false;
+
+    g_client->hostname = hostname;
+    g_client->port = port;
+    g_client->request = request;
+    g_client->receive = NULL;
+    g_client->complete = false;
+    altcp_tls_get_response_buffer()[0] = 0;
+
+    return tls_client_open(g_client);
+}
 
-    client.complete = false;
+/**
+ * @brief Starts sending http request to Adafruit IO HTTP API.
+ *        Request is then carried out by requestPoll().
+ *
+ * @param request   request.
+ * @return true     request started.
+ * @return false    connection could not be opened.
+ */
+bool requestBegin(char *request)
+{
+    return requestOpen(request, REQUEST_HOSTNAME, REQUEST_PORT);
+}
+
+/**
+ * @brief Starts request to any server, response body is passed to callback
+ *        while it streams in, whatever its size. Request is then carried out by requestPoll().
+ *
+ * @param request   request.
+ * @param hostname  server name.
+ * @param port      server port.
+ * @param callback  function receiving response body.
+ * @return true     request started.
+ * @return false    connection could not be opened.
+ */
+bool requestBeginStream(char *request, char *hostname, uint16_t port, requestBodyCallback_t callback)
+{
+    memset(&g_stream, 0, sizeof g_stream);
+    g_stream.body = callback;
+
+    if (!requestOpen(request, hostname, port))
+        return false;
+
+    g_client->receive = streamReceive;
+
+    return true;
+}
+
+/**
+ * @brief Starts group request. Feed values are parsed out of the response while it
+ *        streams in and passed to callback one by one, whatever the response size.
+ *        Request is then carried out by requestPoll().
+ *
+ * @param request   group request.
+ * @param callback  function receiving feed values.
+ * @return true     request started.
+ * @return false    connection could not be opened.
+ */
+bool requestBeginGroup(char *request, requestValueCallback_t callback)
+{
+    if (!requestBeginStream(request, REQUEST_HOSTNAME, REQUEST_PORT, streamJsonBody))
+        return false;
+
+    g_stream.callback = callback;
+    jsonScannerInit(&g_stream.scanner, streamJsonEvent, &g_stream);
+
+    return true;
+}
 
+/**
+ * @brief Moves started request forward. Never blocks.
+ *
+ * @return requestStatus_t  REQUEST_STATUS_BUSY while request is being processed,
+ *                          REQUEST_STATUS_DONE once connection has been closed.
+ */
+requestStatus_t requestPoll()
+{
+    altcp_tls_poll_cyw43();
+
+    if (!g_client->complete)
+        return REQUEST_STATUS_BUSY;
+
+    g_client->complete = false;
+
+    return REQUEST_STATUS_DONE;
+}
+
+/**
+ * @brief Lets network stack handle pending traffic, when no request is going on.
+ *        Never blocks.
+ */
+void requestPollNetwork()
+{
+    altcp_tls_poll_cyw43();
+}
+
+/**
+ * @brief Gets signal strength of the network device is connected to.
+ *
+ * @return int8_t RSSI in dBm, 0 when unknown.
+ */
+int8_t requestGetRssi()
+{
+    int32_t rssi;
+
+    if (cyw43_wifi_get_rssi(&cyw43_state, &rssi))
+        return 0;
+
+    return rssi;
+}
+
+/**
+ * @brief Gets the response of last finished request.
+ *
+ * @return char* http response, empty if there was none.
+ */
+char *requestGetResponse()
+{
     return altcp_tls_get_response_buffer();
 }
 
+/**
+ * @brief Gets HTTP status code of last finished request.
+ *        Streamed responses are not kept, so it's only known for the others.
+ *
+ * @return uint16_t status code, 0 if there was no response.
+ */
+uint16_t requestGetStatus()
+{
+    char *response = altcp_tls_get_response_buffer();
+    char *space;
+
+    if (strncmp(response, "HTTP/", 5))
+        return 0;
+
+    space = strchr(response, ' ');
+
+    return space ? atoi(space + 1) : 0;
+}
+
+/**
+ * @brief Sends http request to Adafruit IO HTTP API.
+ *        Blocks until request is finished.
+ *
+ * @param request request.
+ * @return char*  http response.
+ */
+char *requestSend(char *request)
+{
+    if (!requestBegin(request))
+        return NULL;
+
+    while (requestPoll() == REQUEST_STATUS_BUSY)
+        sleep_ms(1);
+
+    return requestGetResponse();
+}
+
 /**
  * @brief Destroy requests. Frees memory, etc.
  */
@@ -17,6 +17,7 @@
 #define REQUEST_API_USERNAME_LEN 30
 #define REQUEST_API_FEED_NAME_LEN 128
 #define REQUEST_API_KEY_LEN 32
+#define REQUEST_API_GROUP_NAME_LEN 48
 // The form will be less than that but let's leave some safe space
 #define REQUEST_API_FORM_ALONE_LEN 200
 #define REQUEST_API_FORM_MAX_LEN REQUEST_API_USERNAME_LEN +      \
@@ -27,12 +28,46 @@
 typedef enum
 {
     REQUEST_GET,
-    REQUEST_POST
+    REQUEST_POST,
+    REQUEST_GROUP_GET
 } requestType_t;
 
+/**
+ * @brief Receives feed value from group response, while it's still coming in.
+ *
+ * @param feedKey   feed key.
+ * @param value     last value of the feed, as text.
+ */
+typedef void (*requestValueCallback_t)(const char *feedKey, const char *value);
+
+/**
+ * @brief Receives response body piece by piece, while it's still coming in.
+ *
+ * @param status    HTTP status code.
+ * @param data      piece of the body.
+ * @param length    piece length.
+ */
+typedef void (*requestBodyCallback_t)(uint16_t status, const char *data, size_t length);
+
+typedef enum
+{
+    REQUEST_STATUS_BUSY,
+    REQUEST_STATUS_DONE
+} requestStatus_t;
+
 bool requestSetup(char *ssid, char *password);
 char *requestPrepareGET(char *apiUsername, char *apiFeedName, char *apiKey);
 char *requestPreparePOST(int8_t value, char *apiUsername, char *apiFeedName, char *apiKey);
+char *requestPrepareGroupGET(char *apiUsername, char *apiGroupName, char *apiKey);
+char *requestPrepareRangeGET(char *hostname, char *path, uint32_t from, uint32_t to);
+bool requestBegin(char *request);
+bool requestBeginGroup(char *request, requestValueCallback_t callback);
+bool requestBeginStream(char *request, char *hostname, uint16_t port, requestBodyCallback_t callback);
+requestStatus_t requestPoll();
+void requestPollNetwork();
+char *requestGetResponse();
+uint16_t requestGetStatus();
+int8_t requestGetRssi();
 char *requestSend(char *request);
 void requestDestroy();
 
@@ -8,13 +8,30 @@
  * Copyright 2022 - 2023 M.Kusiak (timax)
  */
 
+/*
+ * Uart receive goes through DMA into a ring buffer, so no byte is lost while
+ * interrupts are off (flash writes). A repeating timer splits received bytes
+ * into lines and puts complete ones into the line queue. Queue has single
+ * producer (timer interrupt) and single consumer (main loop), so it needs no locks.
+ * Lines are executed in the main loop, never in interrupts.
+ *
+ * USB serial has no DMA, stdio tells when characters arrive instead. That
+ * happens in USB interrupt, with stdio locked, so the callback only wakes the
+ * main loop up, which then moves the characters into the USB line queue.
+ *
+ * Binary frames (see protocol.c) share the channels with text lines. Frame is
+ * COBS encoded and wrapped in zero bytes, which never appear in text, so leading
+ * zero switches the framer into frame mode till the closing one.
+ */
+
 #include <stdio.h>
 #include <string.h>
 #include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
 #include "serial.h"
 
 #include "hardware/uart.h"
-#include "hardware/irq.h"
+#include "hardware/dma.h"
 
 #define SERIAL_UART_ID uart0
 #define SERIAL_BAUD_RATE 115200
@@ -22,84 +39,308 @@
 #define SERIAL_STOP_BITS 1
 #define SERIAL_PARITY 0
 
+/*
+ * Ring must be a power of 2 and aligned to its size, for DMA address wrapping.
+ * At 115200 baud it holds over 300 ms of data, framing runs every few miliseconds.
+ */
+#define SERIAL_RX_RING_BITS 12
+#define SERIAL_RX_RING_LEN (1 << SERIAL_RX_RING_BITS)
+#define SERIAL_FRAME_PERIOD 5
+/*
+ * Must be a power of 2.
+ */
+#define SERIAL_LINE_QUEUE_LEN 4
+#define SERIAL_FRAME_DELIMITER 0
+
 /**
- * @brief Initiates and setups serial communication for uart.
+ * @brief What framerPush() made of the symbol.
  */
-void serialUartInit()
+typedef enum
 {
-    uart_init(SERIAL_UART_ID, SERIAL_BAUD_RATE);
-    uart_set_format(SERIAL_UART_ID, SERIAL_DATA_BITS, SERIAL_STOP_BITS, SERIAL_PARITY);
-    uart_set_fifo_enabled(SERIAL_UART_ID, true);
-    uart_set_hw_flow(SERIAL_UART_ID, false, false);
+    SERIAL_FRAMER_MORE,
+    SERIAL_FRAMER_LINE,
+    SERIAL_FRAMER_FRAME,
+    SERIAL_FRAMER_DROPPED
+} serialFramerResult_t;
+
+/**
+ * @brief Splits received symbols into text lines and binary frames.
+ */
+typedef struct
+{
+    uint16_t length;
+    bool tooLong;
+    bool frame;
+} serialFramer_t;
+
+/**
+ * @brief Queue of received lines. Line is assembled right in the slot at head,
+ * which consumer never touches. Single producer, single consumer.
+ */
+typedef struct
+{
+    char lines[SERIAL_LINE_QUEUE_LEN][SERIAL_MAX_INCOME_LEN];
+    bool frames[SERIAL_LINE_QUEUE_LEN];
+    serialFramer_t framer;
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    bool held;
+    volatile uint32_t received;
+    volatile uint32_t count;
+    volatile uint32_t dropped;
+} serialLineQueue_t;
+
+static uint8_t g_rxRing[SERIAL_RX_RING_LEN] __attribute__((aligned(SERIAL_RX_RING_LEN)));
+static int g_rxChannel = -1;
+static uint32_t g_rxRemaining;
+static uint32_t g_rxTail;
+static volatile uint32_t g_overruns;
+static repeating_timer_t g_frameTimer;
+static serialCallback_t g_callback;
+
+static serialLineQueue_t g_uart;
+static serialLineQueue_t g_usb;
+
+/**
+ * @brief (Re)starts DMA transfer from uart into the ring, from where the last one stopped.
+ */
+void rxStart()
+{
+    dma_channel_config config = dma_channel_get_default_config(g_rxChannel);
+
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_ring(&config, true, SERIAL_RX_RING_BITS);
+    channel_config_set_dreq(&config, uart_get_dreq(SERIAL_UART_ID, false));
+
+    g_rxRemaining = UINT32_MAX;
+    dma_channel_configure(g_rxChannel, &config, &g_rxRing[g_uart.received & (SERIAL_RX_RING_LEN - 1)],
+                          &uart_get_hw(SERIAL_UART_ID)->dr, g_rxRemaining, true);
 }
 
 /**
- * @brief Gets last full line from uart.
+ * @brief Adds received symbol to the line or frame being assembled.
+ * Empty lines are skipped, overlong ones dropped.
  *
- * @return char* Last full line from uart, or 0 when empty.
+ * @param framer                framer.
+ * @param buffer                line buffer, SERIAL_MAX_INCOME_LEN long.
+ * @param symbol                received symbol.
+ * @return serialFramerResult_t SERIAL_FRAMER_LINE or SERIAL_FRAMER_FRAME when buffer holds complete one.
  */
-char *serialUartGetLastLine()
+serialFramerResult_t framerPush(serialFramer_t *framer, char *buffer, uint8_t symbol)
 {
-    static char income[SERIAL_MAX_INCOME_LEN];
-    static uint16_t incomeIndex;
-    char symbol;
+    serialFramerResult_t result = framer->frame ? SERIAL_FRAMER_FRAME : SERIAL_FRAMER_LINE;
+    bool end = framer->frame ? symbol == SERIAL_FRAME_DELIMITER
+                             : symbol == '\n' || symbol == '\r' || symbol == SERIAL_FRAME_DELIMITER;
 
-    if (!income[0])
-        incomeIndex = 0;
+    if (!end)
+    {
+        if (framer->length == SERIAL_MAX_INCOME_LEN - 1)
+            framer->tooLong = true;
+        else
+            buffer[framer->length++] = symbol;
 
-    if (!incomeIndex)
-        memset(income, 0, sizeof income);
+        return SERIAL_FRAMER_MORE;
+    }
 
-    while (uart_is_readable(SERIAL_UART_ID))
+    /*
+     * Zero opens a frame, unless it closes one. Unfinished text before it is junk.
+     */
+    if (symbol == SERIAL_FRAME_DELIMITER && (!framer->frame || !framer->length))
     {
-        symbol = uart_getc(SERIAL_UART_ID);
+        result = framer->length && !framer->frame ? SERIAL_FRAMER_DROPPED : SERIAL_FRAMER_MORE;
+        framer->length = 0;
+        framer->tooLong = false;
+        framer->frame = true;
+        return result;
+    }
 
-        if (symbol == '\n' || symbol == '\r' || (incomeIndex > SERIAL_MAX_INCOME_LEN - 1))
-        {
-            income[incomeIndex] = 0;
-            incomeIndex = 0;
+    if (framer->tooLong)
+        result = SERIAL_FRAMER_DROPPED;
+    else if (!framer->length)
+        result = SERIAL_FRAMER_MORE;
+    else
+        buffer[framer->length] = 0;
 
-            return income;
-        }
+    framer->length = 0;
+    framer->tooLong = false;
+    framer->frame = false;
+
+    return result;
+}
 
-        income[incomeIndex] = symbol;
-        incomeIndex++;
+/**
+ * @brief Adds received symbol to the queue, queues the line once it's complete.
+ *
+ * @param queue     line queue.
+ * @param symbol    received symbol.
+ * @return true     line or frame queued.
+ */
+bool lineQueuePush(serialLineQueue_t *queue, uint8_t symbol)
+{
+    serialFramerResult_t result = framerPush(&queue->framer, queue->lines[queue->head], symbol);
+    uint8_t next = (queue->head + 1) & (SERIAL_LINE_QUEUE_LEN - 1);
+
+    if (result == SERIAL_FRAMER_MORE)
+        return false;
+
+    if (result == SERIAL_FRAMER_DROPPED || next == queue->tail)
+    {
+        queue->dropped++;
+        return false;
     }
-    return 0;
+
+    queue->frames[queue->head] = result == SERIAL_FRAMER_FRAME;
+    __dmb();
+    queue->head = next;
+    queue->count++;
+
+    return true;
 }
 
-char *serialUsbGetLastLine()
+/**
+ * @brief Takes next line from the queue.
+ * Line stays valid until the next call, which gives its slot back.
+ *
+ * @param queue     line queue.
+ * @param frame     set if it's binary frame (COBS encoded, without delimiters).
+ * @return char*    line, or 0 when there's none.
+ */
+char *lineQueuePop(serialLineQueue_t *queue, bool *frame)
 {
-    static char income[SERIAL_MAX_INCOME_LEN];
-    static uint16_t incomeIndex;
-    char symbol;
+    if (queue->held)
+    {
+        queue->tail = (queue->tail + 1) & (SERIAL_LINE_QUEUE_LEN - 1);
+        queue->held = false;
+    }
+
+    if (queue->tail == queue->head)
+        return 0;
 
-    if (!income[0])
-        incomeIndex = 0;
+    __dmb();
+    queue->held = true;
+    *frame = queue->frames[queue->tail];
 
-    if (!incomeIndex)
-        memset(income, 0, sizeof income);
+    return queue->lines[queue->tail];
+}
 
-    while (true)
+/**
+ * @brief Splits bytes received on uart since last run into lines.
+ *
+ * @param timer     repeating timer.
+ * @return true     timer keeps repeating.
+ */
+bool frameTimerCallback(repeating_timer_t *timer)
+{
+    uint32_t remaining = dma_channel_hw_addr(g_rxChannel)->transfer_count;
+    bool queued = false;
+
+    g_uart.received += g_rxRemaining - remaining;
+    g_rxRemaining = remaining;
+
+    /*
+     * Ring was lapped, whatever is left of the oldest data is garbage now.
+     */
+    if (g_uart.received - g_rxTail > SERIAL_RX_RING_LEN)
     {
-        symbol = getchar_timeout_us(0);
+        g_overruns += g_uart.received - g_rxTail - SERIAL_RX_RING_LEN;
+        g_rxTail = g_uart.received - SERIAL_RX_RING_LEN;
+        g_uart.framer.tooLong = true;
+    }
+
+    for (; g_rxTail != g_uart.received; g_rxTail++)
+        queued |= lineQueuePush(&g_uart, g_rxRing[g_rxTail & (SERIAL_RX_RING_LEN - 1)]);
+
+    if (queued && g_callback)
+        g_callback();
+
+    if (!dma_channel_is_busy(g_rxChannel))
+        rxStart();
+
+    return true;
+}
 
-        if (symbol == 255)
-            break;
+/**
+ * @brief Wakes the main loop up when characters arrive on usb serial.
+ *
+ * @param param not used.
+ */
+void usbCharsAvailable(void *param)
+{
+    if (g_callback)
+        g_callback();
+}
+
+/**
+ * @brief Initiates and setups serial communication for uart.
+ * Receiving starts right away, lines wait in the queue for serialUartGetLastLine().
+ */
+void serialUartInit()
+{
+    uart_init(SERIAL_UART_ID, SERIAL_BAUD_RATE);
+    uart_set_format(SERIAL_UART_ID, SERIAL_DATA_BITS, SERIAL_STOP_BITS, SERIAL_PARITY);
+    uart_set_fifo_enabled(SERIAL_UART_ID, true);
+    uart_set_hw_flow(SERIAL_UART_ID, false, false);
+
+    g_rxChannel = dma_claim_unused_channel(true);
+    rxStart();
+    add_repeating_timer_ms(SERIAL_FRAME_PERIOD, frameTimerCallback, NULL, &g_frameTimer);
+}
+
+/**
+ * @brief Starts watching usb serial input, see serialSetCallback().
+ */
+void serialUsbInit()
+{
+    stdio_set_chars_available_callback(usbCharsAvailable, NULL);
+}
 
-        if (symbol == '\n' || symbol == '\r' || (incomeIndex > SERIAL_MAX_INCOME_LEN - 1))
-        {
-            income[incomeIndex] = 0;
-            incomeIndex = 0;
+/**
+ * @brief Gets next full line received on uart.
+ * Line stays valid until the next call, which gives its slot back to the queue.
+ *
+ * @param frame     set if it's binary frame (COBS encoded, without delimiters).
+ * @return char*    Next full line from uart, or 0 when there's none.
+ */
+char *serialUartGetLastLine(bool *frame)
+{
+    return lineQueuePop(&g_uart, frame);
+}
 
-            return income;
-        }
+/**
+ * @brief Moves characters waiting in usb stdio into the usb line queue, till the queue is full.
+ * The rest waits in usb stdio buffer for the next call, so pasted lines are not lost.
+ * Only usb driver is read, uart input belongs to DMA.
+ */
+void serialUsbReceive()
+{
+    char symbol;
 
-        income[incomeIndex] = symbol;
-        incomeIndex++;
+    while (((g_usb.head + 1) & (SERIAL_LINE_QUEUE_LEN - 1)) != g_usb.tail &&
+           stdio_usb.in_chars(&symbol, 1) == 1)
+    {
+        g_usb.received++;
+        lineQueuePush(&g_usb, symbol);
     }
+}
 
-    return 0;
+/**
+ * @brief Gets next full line received on usb serial.
+ * Line stays valid until the next call, which gives its slot back to the queue.
+ *
+ * @param frame     set if it's binary frame (COBS encoded, without delimiters).
+ * @return char*    Next full line from usb serial, or 0 when there's none.
+ */
+char *serialUsbGetLastLine(bool *frame)
+{
+    char *line = lineQueuePop(&g_usb, frame);
+
+    if (line)
+        return line;
+
+    serialUsbReceive();
+    return lineQueuePop(&g_usb, frame);
 }
 
 /**
@@ -121,15 +362,37 @@ bool serialUartSendLine(char *line)
 }
 
 /**
- * @brief Sets interrupt on uart activity with handler function.
+ * @brief Sets function called when there's input to handle: line queued on uart
+ * or characters arrived on usb serial. It's called from interrupts, so it should
+ * only wake the main loop up.
+ *
+ * @param callback callback, NULL to disable.
+ */
+void serialSetCallback(serialCallback_t callback)
+{
+    g_callback = callback;
+}
+
+/**
+ * @brief Gets uart receive statistics.
  *
- * @param handlerFunction handler function.
+ * @param stats statistics.
  */
-void serialUartSetInterruptHandler(void *handlerFunction)
+void serialUartGetStats(serialStats_t *stats)
 {
-    static int UART_IRQ = SERIAL_UART_ID == uart0 ? UART0_IRQ : UART1_IRQ;
+    stats->received = g_uart.received;
+    stats->overruns = g_overruns;
+    stats->lines = g_uart.count;
+    stats->dropped = g_uart.dropped;
+}
 
-    irq_set_exclusive_handler(UART_IRQ, handlerFunction);
-    irq_set_enabled(UART_IRQ, true);
-    uart_set_irq_enables(SERIAL_UART_ID, true, false);
-}
\ No newline at end of file
+/**
+ * @brief Prints uart and usb serial receive statistics on serial.
+ */
+void serialPrintStats()
+{
+    printf("UART: RECEIVED %lu, OVERRUNS %lu, LINES %lu, DROPPED %lu\n"
+           "USB: RECEIVED %lu, LINES %lu, DROPPED %lu\n",
+           g_uart.received, g_overruns, g_uart.count, g_uart.dropped,
+           g_usb.received, g_usb.count, g_usb.dropped);
+}
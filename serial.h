@@ -11,12 +11,31 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
-#define SERIAL_MAX_INCOME_LEN 256
+/*
+ * Long enough for configuration blob ("SET BLOB").
+ */
+#define SERIAL_MAX_INCOME_LEN 1536
+
+typedef void (*serialCallback_t)();
+
+/**
+ * @brief Uart receive statistics.
+ */
+typedef struct
+{
+    uint32_t received;
+    uint32_t overruns;
+    uint32_t lines;
+    uint32_t dropped;
+} serialStats_t;
 
 void serialUartInit();
-char *serialUartGetLastLine();
-char *serialUsbGetLastLine();
+void serialUsbInit();
+char *serialUartGetLastLine(bool *frame);
+char *serialUsbGetLastLine(bool *frame);
 bool serialUartSendLine(char *line);
-void serialUartSetInterruptHandler(void *handlerFunction);
+void serialSetCallback(serialCallback_t callback);
+void serialUartGetStats(serialStats_t *stats);
+void serialPrintStats();
 
 #endif
\ No newline at end of file
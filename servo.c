@@ -9,46 +9,1036 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/pwm.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/clocks.h"
+#include "hardware/pio.h"
 
 #include "servo.h"
+#include "servo.pio.h"
 
 #define SERVO_DIVIDER 64
 #define SERVO_WRAP 39062
 #define SERVO_CYCLE_LENGTH 20000
-#define SERVO_MAXIMUM_LENGTH 2000
-#define SERVO_MINIMAL_LENGTH 400
+
+#define SERVO_BENCHMARK_ROUNDS 1000
+
+#define SERVO_PIO pio1
+#define SERVO_PIO_LOOP_CYCLES 3
+#define SERVO_PINS_COUNT 30
+
+/*
+ * PWM runs at 50Hz, so motion engine is stepped every 20ms.
+ */
+#define SERVO_FRAME_TIME_US SERVO_CYCLE_LENGTH
+#define SERVO_FRAME_TIME_MS (SERVO_FRAME_TIME_US / 1000)
+
+/*
+ * Longest ramp, in frames (5s). Longer moves are sped up to fit.
+ */
+#define SERVO_RAMP_MAX_LEN 250
+/*
+ * Steps a channel may take in one frame. Only steps taking no time can pile up,
+ * this stops a macro looping over such steps from hogging the interrupt.
+ */
+#define SERVO_FRAME_STEPS_MAX 32
+/*
+ * Profile shapes are sampled in 64 segments, positions are Q15.
+ */
+#define SERVO_SHAPE_SEGMENTS 64
+#define SERVO_SHAPE_SEGMENT_BITS 10
+#define SERVO_SHAPE_ONE_BITS 15
+/*
+ * Peak velocity of the shapes relative to average velocity, Q8.
+ */
+#define SERVO_PEAK_TRAPEZOID 341
+#define SERVO_PEAK_S_CURVE 480
+
+/**
+ * @brief Trapezoidal velocity profile position, quarter of the time for acceleration
+ * and quarter for deceleration.
+ */
+static const uint16_t g_shapeTrapezoid[SERVO_SHAPE_SEGMENTS + 1] = {
+    0, 21, 85, 192, 341, 533, 768, 1045,
+    1365, 1728, 2133, 2581, 3072, 3605, 4181, 4800,
+    5461, 6144, 6826, 7509, 8192, 8874, 9557, 10240,
+    10922, 11605, 12288, 12970, 13653, 14336, 15018, 15701,
+    16384, 17066, 17749, 18431, 19114, 19797, 20479, 21162,
+    21845, 22527, 23210, 23893, 24575, 25258, 25941, 26623,
+    27306, 27967, 28586, 29162, 29695, 30186, 30634, 31039,
+    31402, 31722, 31999, 32234, 32426, 32575, 32682, 32746,
+    32767};
 
 /**
- * @brief Initialise servo.
+ * @brief S-curve position (6u^5 - 15u^4 + 10u^3), acceleration is zero at both ends.
+ */
+static const uint16_t g_shapeSCurve[SERVO_SHAPE_SEGMENTS + 1] = {
+    0, 1, 10, 31, 73, 139, 233, 361,
+    526, 730, 975, 1264, 1598, 1977, 2403, 2875,
+    3392, 3954, 4560, 5209, 5898, 6626, 7390, 8189,
+    9018, 9875, 10757, 11661, 12583, 13520, 14469, 15424,
+    16384, 17343, 18298, 19247, 20184, 21106, 22010, 22892,
+    23749, 24578, 25377, 26141, 26869, 27558, 28207, 28813,
+    29375, 29892, 30364, 30790, 31169, 31503, 31792, 32037,
+    32241, 32406, 32534, 32628, 32694, 32736, 32757, 32766,
+    32767};
+
+/**
+ * @brief Motion being carried out by the engine.
+ */
+typedef struct
+{
+    servoMotion_t motion;
+    uint8_t step;
+    bool active;
+    uint8_t loops[SERVO_MACRO_STEPS_MAX];
+} servoMotionState_t;
+
+/**
+ * @brief Servo channel. Output, motion queue and motion engine state.
+ */
+typedef struct
+{
+    servoOutput_t output;
+    uint8_t pin;
+    uint8_t slice;
+    uint8_t pwmChannel;
+    uint8_t sm;
+
+    servoMotion_t queue[SERVO_QUEUE_LEN];
+    volatile uint8_t queueHead;
+    volatile uint8_t queueCount;
+
+    servoMotionState_t current;
+    int32_t waitUs;
+
+    uint16_t ramp[SERVO_RAMP_MAX_LEN];
+    uint16_t rampLength;
+    uint16_t rampIndex;
+    uint8_t angle;
+    uint8_t angleMax;
+    uint16_t level;
+    bool levelChanged;
+
+    bool detached;
+    uint32_t idleFrames;
+    uint32_t energisedFrames;
+    uint32_t detachedFrames;
+    uint32_t moves;
+} servoChannel_t;
+
+static servoChannel_t g_channels[SERVO_CHANNELS_MAX];
+static uint16_t g_lastId;
+static servoMotionCallback_t g_callback;
+
+static int g_frameSlice = -1;
+static struct repeating_timer g_frameTimer;
+static int g_pioOffset = -1;
+
+static servoProfile_t g_profile;
+static uint16_t g_profileDuration;
+static uint16_t g_profileVelocity;
+
+static uint16_t g_levels[SERVO_MAX_ANGLE + 1];
+static uint16_t g_minPulse = SERVO_DEFAULT_MIN_PULSE;
+static uint16_t g_maxPulse = SERVO_DEFAULT_MAX_PULSE;
+static bool g_reversed;
+
+static uint32_t g_holdFrames;
+
+static servoMacroStep_t g_macros[SERVO_MACROS_MAX][SERVO_MACRO_STEPS_MAX];
+
+/**
+ * @brief Converts angle to PWM level. Just a lookup in calibrated table.
  *
- * @param servoPin  servo pin.
+ * @param degree    angle (0-180).
+ * @return uint16_t PWM level.
+ */
+static inline uint16_t angleToLevel(uint8_t degree)
+{
+    return g_levels[degree > SERVO_MAX_ANGLE ? SERVO_MAX_ANGLE : degree];
+}
+
+/**
+ * @brief Converts angle to PWM level with floating point math.
+ * This is how it used to be done, it's only kept for the benchmark.
+ *
+ * @param degree    angle (0-180).
+ * @return uint16_t PWM level.
+ */
+uint16_t angleToLevelFloat(float degree)
+{
+    float multiplier = degree / SERVO_MAX_ANGLE;
+
+    if (g_reversed)
+        multiplier = 1 - multiplier;
+
+    float micros = (g_maxPulse - g_minPulse) * multiplier + g_minPulse;
+
+    return micros / SERVO_CYCLE_LENGTH * SERVO_WRAP;
+}
+
+/**
+ * @brief Sets PWM level and remembers it as current servo position.
+ * Level reaches the output at the end of the frame, see outputWrite().
+ *
+ * @param channel   channel.
+ * @param level     PWM level.
+ */
+void setLevel(servoChannel_t *channel, uint16_t level)
+{
+    channel->level = level;
+    channel->levelChanged = true;
+}
+
+/**
+ * @brief Writes channel's level to its output. Both PWM slice and the PIO program
+ * pick it up at the start of next period. Detached channel gets level 0, so no pulses
+ * are sent and servo stops holding its position.
+ *
+ * @param channel channel.
+ */
+void outputWrite(servoChannel_t *channel)
+{
+    uint16_t level = channel->detached ? 0 : channel->level;
+
+    if (!channel->levelChanged)
+        return;
+
+    switch (channel->output)
+    {
+    case SERVO_OUTPUT_PWM:
+        pwm_set_chan_level(channel->slice, channel->pwmChannel, level);
+        break;
+    case SERVO_OUTPUT_PIO:
+        if (pio_sm_is_tx_fifo_full(SERVO_PIO, channel->sm))
+            return;
+        pio_sm_put(SERVO_PIO, channel->sm, level);
+        break;
+    default:
+        break;
+    }
+
+    channel->levelChanged = false;
+}
+
+/**
+ * @brief Re-arms detached channel output, servo gets pulses of its last position again.
+ * Every call counts as a move.
+ *
+ * @param channel channel.
+ */
+void attach(servoChannel_t *channel)
+{
+    channel->moves++;
+    channel->idleFrames = 0;
+
+    if (!channel->detached)
+        return;
+
+    channel->detached = false;
+    channel->levelChanged = true;
+}
+
+/**
+ * @brief Counts energised and detached time, and detaches the output once channel
+ * was idle for the hold time. Called once per frame.
+ *
+ * @param channel channel.
+ */
+void powerUpdate(servoChannel_t *channel)
+{
+    bool idle = !channel->current.active && !channel->queueCount &&
+                channel->rampIndex >= channel->rampLength && channel->waitUs <= 0;
+
+    if (channel->detached)
+    {
+        channel->detachedFrames++;
+        return;
+    }
+
+    channel->energisedFrames++;
+
+    if (!idle)
+    {
+        channel->idleFrames = 0;
+        return;
+    }
+
+    if (g_holdFrames && ++channel->idleFrames >= g_holdFrames)
+    {
+        channel->detached = true;
+        channel->levelChanged = true;
+    }
+}
+
+/**
+ * @brief Computes ramp length in frames for a move, according to profile.
+ * Move takes configured duration, unless that would exceed maximum velocity.
+ *
+ * @param distance  move distance in degrees.
+ * @return uint16_t ramp length in frames.
+ */
+uint16_t rampLength(uint8_t distance)
+{
+    uint32_t duration = g_profileDuration;
+    uint32_t peak = g_profile == SERVO_PROFILE_TRAPEZOID ? SERVO_PEAK_TRAPEZOID : SERVO_PEAK_S_CURVE;
+    uint32_t minimalDuration;
+
+    if (g_profileVelocity)
+    {
+        minimalDuration = (distance * peak * 1000 / g_profileVelocity) >> 8;
+        if (minimalDuration > duration)
+            duration = minimalDuration;
+    }
+
+    duration = (duration + SERVO_FRAME_TIME_MS - 1) / SERVO_FRAME_TIME_MS;
+
+    if (duration > SERVO_RAMP_MAX_LEN)
+        return SERVO_RAMP_MAX_LEN;
+    if (!duration)
+        return 1;
+
+    return duration;
+}
+
+/**
+ * @brief Precomputes PWM levels of a move to the angle, one per frame.
+ * Integer only, profile shape is interpolated from the shape table.
+ *
+ * @param channel   channel.
+ * @param angle     target angle.
+ * @return uint32_t move time in microseconds.
+ */
+uint32_t rampStart(servoChannel_t *channel, uint8_t angle)
+{
+    uint16_t target = angleToLevel(angle);
+    int32_t delta = (int32_t)target - channel->level;
+    const uint16_t *shape = g_profile == SERVO_PROFILE_TRAPEZOID ? g_shapeTrapezoid : g_shapeSCurve;
+    uint8_t distance = angle > channel->angle ? angle - channel->angle : channel->angle - angle;
+    uint32_t u, segment, fraction, position;
+
+    channel->angle = angle;
+    channel->rampIndex = 0;
+
+    /*
+     * Position is unknown before first move, so there's nothing to ramp from.
+     */
+    if (g_profile == SERVO_PROFILE_NONE || !distance || !channel->level)
+    {
+        channel->rampLength = 0;
+        setLevel(channel, target);
+        return 0;
+    }
+
+    channel->rampLength = rampLength(distance);
+
+    for (int i = 1; i < channel->rampLength; i++)
+    {
+        u = (i << (SERVO_SHAPE_SEGMENT_BITS + 6)) / channel->rampLength;
+        segment = u >> SERVO_SHAPE_SEGMENT_BITS;
+        fraction = u & ((1 << SERVO_SHAPE_SEGMENT_BITS) - 1);
+        position = shape[segment] + (((shape[segment + 1] - shape[segment]) * fraction) >> SERVO_SHAPE_SEGMENT_BITS);
+
+        channel->ramp[i - 1] = channel->level + ((delta * (int32_t)position) >> SERVO_SHAPE_ONE_BITS);
+    }
+    channel->ramp[channel->rampLength - 1] = target;
+
+    return channel->rampLength * SERVO_FRAME_TIME_US;
+}
+
+/**
+ * @brief Plays next level of the ramp. Called once per frame.
+ *
+ * @param channel channel.
+ */
+void rampUpdate(servoChannel_t *channel)
+{
+    if (channel->rampIndex >= channel->rampLength)
+        return;
+
+    setLevel(channel, channel->ramp[channel->rampIndex++]);
+}
+
+/**
+ * @brief Takes next motion from the queue and makes it current.
+ *
+ * @param channel   channel.
+ * @return true     there was a motion to start.
+ * @return false    queue empty.
+ */
+bool motionStartNext(servoChannel_t *channel)
+{
+    if (!channel->queueCount)
+        return false;
+
+    channel->current.motion = channel->queue[channel->queueHead];
+    channel->current.step = 0;
+    channel->current.active = true;
+    memset(channel->current.loops, 0, sizeof channel->current.loops);
+    channel->queueHead = (channel->queueHead + 1) % SERVO_QUEUE_LEN;
+    channel->queueCount--;
+
+    if (channel->current.motion.type != SERVO_MOTION_HOLD)
+        attach(channel);
+
+    return true;
+}
+
+/**
+ * @brief Finishes current motion and reports it.
+ *
+ * @param channel channel.
+ */
+void motionComplete(servoChannel_t *channel)
+{
+    channel->current.active = false;
+
+    if (g_callback)
+        g_callback(channel - g_channels, channel->current.motion.id);
+}
+
+/**
+ * @brief Carries out next step of macro. Repeat steps are followed straight away,
+ * so every call either starts something that takes time or completes the macro.
+ *
+ * @param channel channel.
+ */
+void macroStep(servoChannel_t *channel)
+{
+    servoMotionState_t *current = &channel->current;
+    const servoMacroStep_t *step;
+    uint32_t ramp;
+
+    while (current->step < SERVO_MACRO_STEPS_MAX)
+    {
+        step = &g_macros[current->motion.count][current->step];
+
+        switch (step->op)
+        {
+        case SERVO_MACRO_MOVE:
+            ramp = rampStart(channel, MIN(step->arg, channel->angleMax));
+            channel->waitUs += ramp > step->time * 1000 ? ramp : step->time * 1000;
+            current->step++;
+            return;
+        case SERVO_MACRO_WAIT:
+            channel->waitUs += step->time * 1000;
+            current->step++;
+            return;
+        case SERVO_MACRO_REPEAT:
+            if (current->loops[current->step] < step->arg)
+            {
+                current->loops[current->step]++;
+                current->step = step->time;
+            }
+            else
+            {
+                current->loops[current->step] = 0;
+                current->step++;
+            }
+            break;
+        default:
+            motionComplete(channel);
+            return;
+        }
+    }
+
+    motionComplete(channel);
+}
+
+/**
+ * @brief Carries out next step of current motion.
+ * Steps that take time, add it to the wait time.
+ *
+ * @param channel channel.
+ */
+void motionStep(servoChannel_t *channel)
+{
+    servoMotionState_t *current = &channel->current;
+    servoMotion_t *motion = &current->motion;
+    uint32_t ramp;
+
+    switch (motion->type)
+    {
+    case SERVO_MOTION_MOVE:
+        if (current->step++)
+        {
+            motionComplete(channel);
+            break;
+        }
+        channel->waitUs += rampStart(channel, motion->angle);
+        break;
+    case SERVO_MOTION_HOLD:
+        if (current->step++)
+        {
+            motionComplete(channel);
+            break;
+        }
+        channel->waitUs += motion->time * 1000;
+        break;
+    case SERVO_MOTION_TAP:
+        /*
+         * Back and forth motion, starting and ending at 0.
+         * Every position is held for motion time.
+         */
+        if (current->step == 2 * motion->count + 1)
+        {
+            motionComplete(channel);
+            break;
+        }
+        ramp = rampStart(channel, current->step % 2 ? motion->angle : 0);
+        channel->waitUs += ramp > motion->time * 1000 ? ramp : motion->time * 1000;
+        current->step++;
+        break;
+    case SERVO_MOTION_MACRO:
+        macroStep(channel);
+        break;
+    default:
+        motionComplete(channel);
+        break;
+    }
+}
+
+/**
+ * @brief Runs motion engine of a channel for one frame.
+ * Wait time is carried over between motions, so timing doesn't drift.
+ *
+ * @param channel channel.
+ */
+void channelUpdate(servoChannel_t *channel)
+{
+    int steps = 0;
+
+    rampUpdate(channel);
+
+    if (channel->waitUs > 0)
+        channel->waitUs -= SERVO_FRAME_TIME_US;
+
+    while (channel->waitUs <= 0 && steps++ < SERVO_FRAME_STEPS_MAX)
+    {
+        if (!channel->current.active && !motionStartNext(channel))
+        {
+            channel->waitUs = 0;
+            break;
+        }
+
+        motionStep(channel);
+    }
+
+    powerUpdate(channel);
+}
+
+/**
+ * @brief Runs motion engine of all channels once per frame.
+ * Outputs are written together at the end, so all channels change in the same frame.
+ */
+void __not_in_flash_func(framesUpdate)()
+{
+    for (int i = 0; i < SERVO_CHANNELS_MAX; i++)
+    {
+        if (g_channels[i].output != SERVO_OUTPUT_NONE)
+            channelUpdate(&g_channels[i]);
+    }
+
+    for (int i = 0; i < SERVO_CHANNELS_MAX; i++)
+        outputWrite(&g_channels[i]);
+}
+
+/**
+ * @brief PWM wrap interrupt handler. Frames are counted by the first PWM slice in use.
  */
-void servoSetup(uint8_t servoPin)
+void __not_in_flash_func(servoWrapHandler)()
 {
-    gpio_set_function(servoPin, GPIO_FUNC_PWM);
-    uint slice = pwm_gpio_to_slice_num(servoPin);
+    if (!(pwm_get_irq_status_mask() & (1u << g_frameSlice)))
+        return;
 
-    pwm_set_wrap(slice, SERVO_WRAP);
-    pwm_set_clkdiv(slice, SERVO_DIVIDER);
-    pwm_set_enabled(slice, true);
+    pwm_clear_irq(g_frameSlice);
+    framesUpdate();
 }
 
 /**
- * @brief Move servo to angle (0-180).
+ * @brief Frame timer callback, used when no PWM slice is in use.
  *
+ * @param timer timer.
+ * @return true
+ */
+bool servoFrameTimerCallback(struct repeating_timer *timer)
+{
+    framesUpdate();
+    return true;
+}
+
+/**
+ * @brief Checks if slice channel is already used by another servo channel.
+ *
+ * @param slice         PWM slice.
+ * @param pwmChannel    PWM channel of the slice.
+ * @return true         slice channel is taken.
+ * @return false        slice channel is free.
+ */
+bool pwmChannelTaken(uint slice, uint pwmChannel)
+{
+    for (int i = 0; i < SERVO_CHANNELS_MAX; i++)
+    {
+        if (g_channels[i].output == SERVO_OUTPUT_PWM &&
+            g_channels[i].slice == slice && g_channels[i].pwmChannel == pwmChannel)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Sets channel up on PIO servo program.
+ *
+ * @param channel   channel.
+ * @return true     PIO state machine claimed.
+ * @return false    no free state machine or no room for the program.
+ */
+bool pioSetup(servoChannel_t *channel)
+{
+    int sm;
+
+    if (g_pioOffset < 0)
+    {
+        if (!pio_can_add_program(SERVO_PIO, &servo_program))
+            return false;
+        g_pioOffset = pio_add_program(SERVO_PIO, &servo_program);
+    }
+
+    sm = pio_claim_unused_sm(SERVO_PIO, false);
+    if (sm < 0)
+        return false;
+
+    /*
+     * One loop of the program is 3 cycles, so this makes it count at PWM slice rate.
+     */
+    servo_program_init(SERVO_PIO, sm, g_pioOffset, channel->pin, (float)SERVO_DIVIDER / SERVO_PIO_LOOP_CYCLES);
+    pio_sm_put_blocking(SERVO_PIO, sm, SERVO_WRAP);
+    pio_sm_exec(SERVO_PIO, sm, pio_encode_pull(false, false));
+    pio_sm_exec(SERVO_PIO, sm, pio_encode_out(pio_isr, 32));
+
+    channel->sm = sm;
+    channel->output = SERVO_OUTPUT_PIO;
+
+    return true;
+}
+
+/**
+ * @brief Initialise servo channel. Channel gets hardware PWM slice channel of the pin
+ * if it's free, otherwise it falls back to PIO. Outputs are started with servoStart().
+ *
+ * @param channel   servo channel (0 - SERVO_CHANNELS_MAX-1).
  * @param servoPin  servo pin.
+ * @return servoOutput_t output used by the channel, SERVO_OUTPUT_NONE on failure.
+ */
+servoOutput_t servoSetup(uint8_t channel, uint8_t servoPin)
+{
+    servoChannel_t *servo;
+    uint slice, pwmChannel;
+
+    if (channel >= SERVO_CHANNELS_MAX || servoPin >= SERVO_PINS_COUNT)
+        return SERVO_OUTPUT_NONE;
+
+    servo = &g_channels[channel];
+    if (servo->output != SERVO_OUTPUT_NONE)
+        return servo->output;
+
+    slice = pwm_gpio_to_slice_num(servoPin);
+    pwmChannel = pwm_gpio_to_channel(servoPin);
+    servo->pin = servoPin;
+    servo->angleMax = SERVO_MAX_ANGLE;
+    /*
+     * Nothing is sent till the first move.
+     */
+    servo->detached = true;
+
+    if (!pwmChannelTaken(slice, pwmChannel))
+    {
+        gpio_set_function(servoPin, GPIO_FUNC_PWM);
+        pwm_set_wrap(slice, SERVO_WRAP);
+        pwm_set_clkdiv(slice, SERVO_DIVIDER);
+        pwm_set_chan_level(slice, pwmChannel, 0);
+
+        servo->slice = slice;
+        servo->pwmChannel = pwmChannel;
+        servo->output = SERVO_OUTPUT_PWM;
+
+        return servo->output;
+    }
+
+    pioSetup(servo);
+
+    return servo->output;
+}
+
+/**
+ * @brief Sets the largest angle channel may be moved to. Moves, taps and macro moves
+ * past it stop at it. Channels start with SERVO_MAX_ANGLE.
+ *
+ * @param channel   servo channel.
+ * @param angle     largest angle (0-180).
+ */
+void servoSetAngleMax(uint8_t channel, uint8_t angle)
+{
+    if (channel < SERVO_CHANNELS_MAX)
+        g_channels[channel].angleMax = MIN(angle, SERVO_MAX_ANGLE);
+}
+
+/**
+ * @brief Starts outputs of all channels and the motion engine.
+ * Slices are started together, so they all wrap at the same time.
+ */
+void servoStart()
+{
+    uint32_t slices = 0;
+    uint32_t stateMachines = 0;
+
+    for (int i = 0; i < SERVO_CHANNELS_MAX; i++)
+    {
+        if (g_channels[i].output == SERVO_OUTPUT_PWM)
+        {
+            slices |= 1u << g_channels[i].slice;
+            pwm_hw->slice[g_channels[i].slice].ctr = 0;
+            if (g_frameSlice < 0)
+                g_frameSlice = g_channels[i].slice;
+        }
+        else if (g_channels[i].output == SERVO_OUTPUT_PIO)
+            stateMachines |= 1u << g_channels[i].sm;
+    }
+
+    hw_set_bits(&pwm_hw->en, slices);
+    pio_set_sm_mask_enabled(SERVO_PIO, stateMachines, true);
+
+    if (g_frameSlice >= 0)
+    {
+        pwm_clear_irq(g_frameSlice);
+        pwm_set_irq_enabled(g_frameSlice, true);
+        irq_add_shared_handler(PWM_IRQ_WRAP, servoWrapHandler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(PWM_IRQ_WRAP, true);
+    }
+    else if (stateMachines)
+        add_repeating_timer_us(-SERVO_FRAME_TIME_US, servoFrameTimerCallback, NULL, &g_frameTimer);
+}
+
+/**
+ * @brief Move servo to angle (0-180) immediately, bypassing motion queue.
+ *
+ * @param channel   servo channel.
  * @param degree    angle to move to.
  */
-void servoMoveToAngle(uint8_t servoPin, float degree)
+void servoMoveToAngle(uint8_t channel, uint8_t degree)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    g_channels[channel].rampLength = 0;
+    g_channels[channel].angle = degree;
+    attach(&g_channels[channel]);
+    setLevel(&g_channels[channel], angleToLevel(degree));
+    outputWrite(&g_channels[channel]);
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Sets servo pulse range and direction, and precomputes angle to PWM level table.
+ *
+ * @param minPulse  pulse length at 0 degrees, in microseconds.
+ * @param maxPulse  pulse length at 180 degrees, in microseconds.
+ * @param reversed  true if servo should turn the other way.
+ * @return true     calibration applied.
+ * @return false    pulse range invalid, nothing changed.
+ */
+bool servoCalibrate(uint16_t minPulse, uint16_t maxPulse, bool reversed)
+{
+    uint32_t span, pulse;
+    uint8_t angle;
+
+    if (minPulse >= maxPulse || minPulse < SERVO_PULSE_LIMIT_MIN || maxPulse > SERVO_PULSE_LIMIT_MAX)
+        return false;
+
+    g_minPulse = minPulse;
+    g_maxPulse = maxPulse;
+    g_reversed = reversed;
+
+    span = maxPulse - minPulse;
+
+    for (int i = 0; i <= SERVO_MAX_ANGLE; i++)
+    {
+        angle = reversed ? SERVO_MAX_ANGLE - i : i;
+        pulse = minPulse + (span * angle + SERVO_MAX_ANGLE / 2) / SERVO_MAX_ANGLE;
+        g_levels[i] = (pulse * SERVO_WRAP + SERVO_CYCLE_LENGTH / 2) / SERVO_CYCLE_LENGTH;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Prints how long angle to PWM level conversion takes,
+ * using lookup table and using floating point math.
+ */
+void servoBenchmark()
+{
+    volatile uint32_t sum = 0;
+    uint32_t start, loopTime, tableTime, floatTime;
+    uint32_t cyclesPerMicro = clock_get_hz(clk_sys) / 1000000;
+
+    /*
+     * Loop overhead alone, subtracted from both results.
+     */
+    start = time_us_32();
+    for (int i = 0; i < SERVO_BENCHMARK_ROUNDS; i++)
+        sum += i % (SERVO_MAX_ANGLE + 1);
+    loopTime = time_us_32() - start;
+
+    start = time_us_32();
+    for (int i = 0; i < SERVO_BENCHMARK_ROUNDS; i++)
+        sum += angleToLevel(i % (SERVO_MAX_ANGLE + 1));
+    tableTime = time_us_32() - start;
+
+    start = time_us_32();
+    for (int i = 0; i < SERVO_BENCHMARK_ROUNDS; i++)
+        sum += angleToLevelFloat(i % (SERVO_MAX_ANGLE + 1));
+    floatTime = time_us_32() - start;
+
+    printf("TABLE: %lu cycles\n"
+           "FLOAT: %lu cycles\n",
+           (tableTime - MIN(loopTime, tableTime)) * cyclesPerMicro / SERVO_BENCHMARK_ROUNDS,
+           (floatTime - MIN(loopTime, floatTime)) * cyclesPerMicro / SERVO_BENCHMARK_ROUNDS);
+}
+
+/**
+ * @brief Sets motion profile used for moves of motion engine.
+ *
+ * @param profile   profile (SERVO_PROFILE_[...]), SERVO_PROFILE_NONE jumps straight to target.
+ * @param duration  move duration in miliseconds.
+ * @param velocity  maximum velocity in degrees per second, 0 for no limit.
+ */
+void servoMotionSetProfile(servoProfile_t profile, uint16_t duration, uint16_t velocity)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    g_profile = profile < SERVO_PROFILE_UNDEFINED ? profile : SERVO_PROFILE_NONE;
+    g_profileDuration = duration;
+    g_profileVelocity = velocity;
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Sets how long servo keeps holding its position after motion settles.
+ * Output is detached after that, and re-armed by the next motion.
+ *
+ * @param holdTime hold time in miliseconds, 0 to hold forever.
+ */
+void servoSetHoldTime(uint16_t holdTime)
+{
+    g_holdFrames = (holdTime + SERVO_FRAME_TIME_MS - 1) / SERVO_FRAME_TIME_MS;
+}
+
+/**
+ * @brief Prints energised and detached time, and number of moves of every channel on serial.
+ */
+void servoPrintStats()
+{
+    servoChannel_t *channel;
+
+    for (int i = 0; i < SERVO_CHANNELS_MAX; i++)
+    {
+        channel = &g_channels[i];
+
+        if (channel->output == SERVO_OUTPUT_NONE)
+            continue;
+
+        printf("CHANNEL %d: %s, ENERGISED %llu ms, DETACHED %llu ms, MOVES %lu\n", i,
+               channel->detached ? "DETACHED" : "ENERGISED",
+               (uint64_t)channel->energisedFrames * SERVO_FRAME_TIME_MS,
+               (uint64_t)channel->detachedFrames * SERVO_FRAME_TIME_MS,
+               channel->moves);
+    }
+}
+
+/**
+ * @brief Sets function called when queued motion is completed.
+ * It's called from interrupt, so it must be short.
+ *
+ * @param callback callback, receives id of completed motion.
+ */
+void servoMotionSetCallback(servoMotionCallback_t callback)
+{
+    g_callback = callback;
+}
+
+/**
+ * @brief Checks macro steps, without setting them.
+ *
+ * @param steps     SERVO_MACRO_STEPS_MAX steps.
+ * @return true     steps valid.
+ * @return false    invalid step, repeat must jump back.
+ */
+bool servoMacroIsValid(const servoMacroStep_t *steps)
+{
+    for (int i = 0; i < SERVO_MACRO_STEPS_MAX; i++)
+    {
+        if (steps[i].op == SERVO_MACRO_END)
+            break;
+        if (steps[i].op > SERVO_MACRO_REPEAT ||
+            (steps[i].op == SERVO_MACRO_MOVE && steps[i].arg > SERVO_MAX_ANGLE) ||
+            (steps[i].op == SERVO_MACRO_REPEAT && steps[i].time >= i))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Sets macro steps. Macro ends at the first SERVO_MACRO_END step, or after the last step.
+ *
+ * @param macro     macro index.
+ * @param steps     SERVO_MACRO_STEPS_MAX steps.
+ * @return true     macro set.
+ * @return false    invalid step, repeat must jump back, macro is left unchanged.
+ */
+bool servoMacroSet(uint8_t macro, const servoMacroStep_t *steps)
+{
+    uint32_t interrupts;
+
+    if (macro >= SERVO_MACROS_MAX || !servoMacroIsValid(steps))
+        return false;
+
+    interrupts = save_and_disable_interrupts();
+    memcpy(g_macros[macro], steps, sizeof g_macros[macro]);
+    restore_interrupts(interrupts);
+
+    return true;
+}
+
+/**
+ * @brief Checks if macro has any steps.
+ *
+ * @param macro     macro index.
+ * @return true     macro defined.
+ * @return false    macro empty or out of range.
+ */
+bool servoMacroIsDefined(uint8_t macro)
 {
-    float multiplier = 1;
+    return macro < SERVO_MACROS_MAX && g_macros[macro][0].op != SERVO_MACRO_END;
+}
+
+/**
+ * @brief Queues motion. Motions of a channel are carried out one after another, in background.
+ *
+ * @param channel   servo channel.
+ * @param type      motion type.
+ * @param angle     target angle, or tap angle.
+ * @param count     number of taps (SERVO_MOTION_TAP), or macro index (SERVO_MOTION_MACRO).
+ * @param time      hold time, or time between tap moves, in miliseconds.
+ * @return uint16_t motion id, 0 if queue is full, channel is not set up or there's no such macro.
+ *                  Move of an idle channel to the angle it's at is completed right away, output
+ *                  stays as it is and it doesn't count as a move.
+ */
+uint16_t servoMotionQueue(uint8_t channel, servoMotionType_t type, uint8_t angle, uint8_t count, uint16_t time)
+{
+    servoChannel_t *servo;
+    uint32_t interrupts;
+    servoMotion_t *motion;
+    uint16_t id;
+
+    if (channel >= SERVO_CHANNELS_MAX || g_channels[channel].output == SERVO_OUTPUT_NONE)
+        return 0;
+    if (type == SERVO_MOTION_MACRO && count >= SERVO_MACROS_MAX)
+        return 0;
+
+    servo = &g_channels[channel];
+    interrupts = save_and_disable_interrupts();
+
+    if (servo->queueCount == SERVO_QUEUE_LEN)
+    {
+        restore_interrupts(interrupts);
+        return 0;
+    }
+
+    if (!++g_lastId)
+        g_lastId++;
 
-    if (degree < SERVO_MAX_ANGLE)
-        multiplier = (degree / SERVO_MAX_ANGLE) - ((int)degree / SERVO_MAX_ANGLE);
+    /*
+     * Position is known only after first move, till then every move is carried out.
+     */
+    if (type == SERVO_MOTION_MOVE && servo->level && !servo->current.active && !servo->queueCount &&
+        MIN(angle, servo->angleMax) == servo->angle)
+    {
+        id = g_lastId;
+        restore_interrupts(interrupts);
+        if (g_callback)
+            g_callback(channel, id);
+        return id;
+    }
 
-    float millis = SERVO_MAXIMUM_LENGTH * multiplier + SERVO_MINIMAL_LENGTH;
+    motion = &servo->queue[(servo->queueHead + servo->queueCount) % SERVO_QUEUE_LEN];
+    motion->type = type;
+    motion->angle = MIN(angle, servo->angleMax);
+    motion->count = count;
+    motion->time = time;
+    motion->id = g_lastId;
+    servo->queueCount++;
 
-    pwm_set_gpio_level(servoPin, millis / SERVO_CYCLE_LENGTH * SERVO_WRAP);
-}
\ No newline at end of file
+    restore_interrupts(interrupts);
+
+    return motion->id;
+}
+
+/**
+ * @brief Drops all queued motions of the channel. Current motion is finished.
+ *
+ * @param channel servo channel.
+ */
+void servoMotionClear(uint8_t channel)
+{
+    uint32_t interrupts = save_and_disable_interrupts();
+
+    g_channels[channel].queueCount = 0;
+
+    restore_interrupts(interrupts);
+}
+
+/**
+ * @brief Checks if motion engine of the channel has work to do.
+ *
+ * @param channel   servo channel.
+ * @return true     motion in progress or queued.
+ * @return false    channel idle.
+ */
+bool servoMotionIsBusy(uint8_t channel)
+{
+    return g_channels[channel].current.active || g_channels[channel].queueCount;
+}
+
+/**
+ * @brief Gets angle the channel was last sent to. During a move, it's the move's target.
+ *
+ * @param channel   servo channel.
+ * @return uint8_t  angle.
+ */
+uint8_t servoGetAngle(uint8_t channel)
+{
+    return g_channels[channel].angle;
+}
+
+/**
+ * @brief Gets pulse length the channel outputs right now.
+ *
+ * @param channel   servo channel.
+ * @return uint16_t pulse length in microseconds, 0 when detached.
+ */
+uint16_t servoGetPulse(uint8_t channel)
+{
+    servoChannel_t *servo = &g_channels[channel];
+
+    if (servo->detached)
+        return 0;
+
+    return ((uint32_t)servo->level * SERVO_CYCLE_LENGTH + SERVO_WRAP / 2) / SERVO_WRAP;
+}
@@ -12,8 +12,90 @@
 #define SERVO_H
 
 #define SERVO_MAX_ANGLE 180
+#define SERVO_QUEUE_LEN 8
+#define SERVO_CHANNELS_MAX 4
+#define SERVO_DEFAULT_PIN 21
+#define SERVO_DEFAULT_PROFILE_DURATION 300
+#define SERVO_DEFAULT_PROFILE_VELOCITY 600
+#define SERVO_DEFAULT_MIN_PULSE 400
+#define SERVO_DEFAULT_MAX_PULSE 2400
+#define SERVO_PULSE_LIMIT_MIN 100
+#define SERVO_PULSE_LIMIT_MAX 3000
+#define SERVO_DEFAULT_HOLD_TIME 0
+#define SERVO_MACROS_MAX 4
+#define SERVO_MACRO_STEPS_MAX 16
 
-void servoSetup(uint8_t servoPin);
-void servoMoveToAngle(uint8_t servoPin, float degree);
+typedef enum
+{
+    SERVO_PROFILE_NONE,
+    SERVO_PROFILE_TRAPEZOID,
+    SERVO_PROFILE_S_CURVE,
+    SERVO_PROFILE_UNDEFINED
+} servoProfile_t;
+
+typedef enum
+{
+    SERVO_OUTPUT_NONE,
+    SERVO_OUTPUT_PWM,
+    SERVO_OUTPUT_PIO
+} servoOutput_t;
+
+typedef enum
+{
+    SERVO_MOTION_MOVE,
+    SERVO_MOTION_TAP,
+    SERVO_MOTION_HOLD,
+    SERVO_MOTION_MACRO
+} servoMotionType_t;
+
+typedef enum
+{
+    SERVO_MACRO_END,
+    SERVO_MACRO_MOVE,
+    SERVO_MACRO_WAIT,
+    SERVO_MACRO_REPEAT
+} servoMacroOp_t;
+
+/**
+ * @brief Macro step. Move goes to angle (arg) and takes at least time miliseconds,
+ * wait takes time miliseconds, repeat jumps back to step (time) arg more times.
+ * Stored in flash as is, so it's packed.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t op;
+    uint8_t arg;
+    uint16_t time;
+} servoMacroStep_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t angle;
+    uint8_t count;
+    uint16_t time;
+    uint16_t id;
+} servoMotion_t;
+
+typedef void (*servoMotionCallback_t)(uint8_t channel, uint16_t id);
+
+servoOutput_t servoSetup(uint8_t channel, uint8_t servoPin);
+void servoSetAngleMax(uint8_t channel, uint8_t angle);
+void servoStart();
+void servoMoveToAngle(uint8_t channel, uint8_t degree);
+bool servoCalibrate(uint16_t minPulse, uint16_t maxPulse, bool reversed);
+void servoBenchmark();
+void servoSetHoldTime(uint16_t holdTime);
+void servoPrintStats();
+void servoMotionSetProfile(servoProfile_t profile, uint16_t duration, uint16_t velocity);
+void servoMotionSetCallback(servoMotionCallback_t callback);
+bool servoMacroIsValid(const servoMacroStep_t *steps);
+bool servoMacroSet(uint8_t macro, const servoMacroStep_t *steps);
+bool servoMacroIsDefined(uint8_t macro);
+uint16_t servoMotionQueue(uint8_t channel, servoMotionType_t type, uint8_t angle, uint8_t count, uint16_t time);
+void servoMotionClear(uint8_t channel);
+bool servoMotionIsBusy(uint8_t channel);
+uint8_t servoGetAngle(uint8_t channel);
+uint16_t servoGetPulse(uint8_t channel);
 
 #endif
\ No newline at end of file
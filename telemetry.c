@@ -0,0 +1,87 @@
+/*
+ * File: telemetry.c
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+/*
+ * Telemetry stream. When enabled ("SET TELE <ms>", or binary SUBSCRIBE request),
+ * fixed size records are sent as binary protocol frames at the given period,
+ * on both uart and usb serial. tools/telemetry.py turns them into CSV.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include "pico/stdlib.h"
+
+#include "telemetry.h"
+#include "protocol.h"
+#include "serial.h"
+#include "servo.h"
+#include "event.h"
+
+static uint16_t g_period;
+static uint8_t g_requestId;
+static uint32_t g_lastTime;
+static telemetrySource_t g_source;
+
+/**
+ * @brief Sets telemetry period.
+ *
+ * @param period    period in miliseconds, 0 stops the stream.
+ * @param requestId request id records are sent with, SUBSCRIBE request's or 0.
+ */
+void telemetrySetPeriod(uint16_t period, uint8_t requestId)
+{
+    g_period = period ? MAX(period, TELEMETRY_PERIOD_MIN) : 0;
+    g_requestId = requestId;
+    g_lastTime = to_ms_since_boot(get_absolute_time());
+}
+
+/**
+ * @brief Sets function filling application part of the record.
+ *
+ * @param source source.
+ */
+void telemetrySetSource(telemetrySource_t source)
+{
+    g_source = source;
+}
+
+/**
+ * @brief Sends telemetry record, when it's due.
+ * Must be called periodically from main loop.
+ */
+void telemetryUpdate()
+{
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    telemetryRecord_t record;
+    serialStats_t serial;
+
+    if (!g_period || now - g_lastTime < g_period)
+        return;
+
+    g_lastTime = now;
+    serialUartGetStats(&serial);
+
+    memset(&record, 0, sizeof record);
+    record.version = TELEMETRY_VERSION;
+    record.time = now;
+    record.servoAngle = servoGetAngle(0);
+    record.servoPulse = servoGetPulse(0);
+    record.heapHighWater = mallinfo().arena;
+    record.eventsDropped = eventLoopGetDropped();
+    record.serialOverruns = serial.overruns;
+    record.serialDropped = serial.dropped;
+    record.frameErrors = protocolGetErrors();
+
+    if (g_source)
+        g_source(&record);
+
+    protocolSend(PROTOCOL_TYPE_TELEMETRY, g_requestId, &record, sizeof record);
+}
@@ -0,0 +1,50 @@
+/*
+ * File: telemetry.h
+ * Project: Klik
+ * -----
+ * This source code is released under BSD-3 license.
+ * Check LICENSE file for full list of conditions and disclaimer.
+ * -----
+ * Copyright 2022 - 2023 M.Kusiak (timax)
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/*
+ * Bump it when record layout changes, tools/telemetry.py decodes by version.
+ */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_PERIOD_MIN 10
+
+/**
+ * @brief Telemetry record, sent as binary protocol frame. No padding, little endian.
+ */
+typedef struct __attribute__((packed))
+{
+    uint8_t version;
+    uint8_t state;
+    int8_t rssi;
+    int8_t lastValue;
+    uint32_t time;
+    uint16_t pollLatency;
+    uint16_t requestErrors;
+    uint8_t servoAngle;
+    uint16_t servoPulse;
+    uint32_t heapHighWater;
+    uint32_t eventsDropped;
+    uint32_t serialOverruns;
+    uint32_t serialDropped;
+    uint32_t frameErrors;
+} telemetryRecord_t;
+
+/**
+ * @brief Fills application part of the record: state, rssi, last value, poll latency and request errors.
+ */
+typedef void (*telemetrySource_t)(telemetryRecord_t *record);
+
+void telemetrySetPeriod(uint16_t period, uint8_t requestId);
+void telemetrySetSource(telemetrySource_t source);
+void telemetryUpdate();
+
+#endif
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+#
+# File: klik_client.py
+# Project: Klik
+# -----
+# This source code is released under BSD-3 license.
+# Check LICENSE file for full list of conditions and disclaimer.
+# -----
+# Copyright 2022 - 2023 M.Kusiak (timax)
+#
+
+"""
+Reference client for Klik binary serial protocol (see protocol.c).
+Requires pyserial.
+
+    python3 tools/klik_client.py --port /dev/ttyACM0 get SSID
+    python3 tools/klik_client.py --port /dev/ttyACM0 set ANGL 90
+    python3 tools/klik_client.py --port /dev/ttyACM0 blob-read config.bin
+    python3 tools/klik_client.py --port /dev/ttyACM0 blob-write config.bin
+    python3 tools/klik_client.py --port /dev/ttyACM0 bench --count 500 --size 256
+"""
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+PING = 0x01
+SETTING_READ = 0x02
+SETTING_WRITE = 0x03
+BLOB_READ = 0x04
+BLOB_WRITE = 0x05
+BLOB_APPLY = 0x06
+SUBSCRIBE = 0x07
+TELEMETRY = 0x40
+REPLY = 0x80
+
+STATUS = {0: "SUCCESS", 1: "FAILURE", 2: "UNSUPPORTED"}
+VALUE_STRING = 0
+VALUE_NUMBER = 1
+BLOB_CHUNK = 512
+
+
+def cobs_encode(data):
+    output = bytearray()
+    block = bytearray()
+    for byte in data:
+        if byte:
+            block.append(byte)
+        if not byte or len(block) == 0xFE:
+            output.append(len(block) + 1)
+            output += block
+            block = bytearray()
+    output.append(len(block) + 1)
+    output += block
+    return bytes(output)
+
+
+def cobs_decode(data):
+    output = bytearray()
+    i = 0
+    while i < len(data):
+        block = data[i]
+        if not block or i + block > len(data):
+            raise ValueError("malformed frame")
+        output += data[i + 1:i + block]
+        i += block
+        if block != 0xFF and i < len(data):
+            output.append(0)
+    return bytes(output)
+
+
+def decode_frame(encoded):
+    """Returns (type, request id, payload) of COBS encoded frame, None if it's malformed or corrupted."""
+    try:
+        frame = cobs_decode(encoded)
+    except ValueError:
+        return None
+    if len(frame) < 6 or zlib.crc32(frame[:-4]) != struct.unpack("<I", frame[-4:])[0]:
+        return None
+    return frame[0], frame[1], frame[2:-4]
+
+
+def setting_key(name):
+    return struct.unpack("<I", name.encode().ljust(4, b"\0")[:4])[0]
+
+
+class Client:
+    def __init__(self, port, baud, timeout):
+        import serial
+        self.port = serial.Serial(port, baud, timeout=timeout)
+        self.timeout = timeout
+        self.request_id = 0
+        self.buffer = bytearray()
+        self.port.reset_input_buffer()
+
+    def send(self, frame_type, payload=b""):
+        self.request_id = (self.request_id + 1) & 0xFF
+        frame = struct.pack("<BB", frame_type, self.request_id) + payload
+        frame += struct.pack("<I", zlib.crc32(frame))
+        self.port.write(b"\0" + cobs_encode(frame) + b"\0")
+        return self.request_id
+
+    def receive(self):
+        """Returns next valid frame as (type, request id, payload), text between frames is skipped."""
+        deadline = time.time() + self.timeout
+        while time.time() < deadline:
+            start = self.buffer.find(b"\0")
+            end = self.buffer.find(b"\0", start + 1) if start >= 0 else -1
+            if end < 0:
+                self.buffer += self.port.read(max(1, self.port.in_waiting))
+                continue
+            encoded = bytes(self.buffer[start + 1:end])
+            del self.buffer[:end]
+            frame = decode_frame(encoded) if encoded else None
+            if frame is None:
+                continue
+            del self.buffer[:1]
+            return frame
+        raise TimeoutError("no reply")
+
+    def request(self, frame_type, payload=b""):
+        request_id = self.send(frame_type, payload)
+        while True:
+            reply_type, reply_id, reply = self.receive()
+            if reply_type == frame_type | REPLY and reply_id == request_id:
+                return reply[0], reply[1:]
+
+    def get(self, name):
+        """Returns (status, value), value is int or str."""
+        status, reply = self.request(SETTING_READ, struct.pack("<I", setting_key(name)))
+        if status:
+            return status, None
+        if reply[0] == VALUE_NUMBER:
+            return status, struct.unpack("<I", reply[1:5])[0]
+        return status, reply[1:].decode(errors="replace")
+
+    def set(self, name, value):
+        """Writes value in the form the setting has, so it's read first."""
+        status, current = self.get(name)
+        payload = struct.pack("<I", setting_key(name))
+        if status:
+            return self.request(SETTING_WRITE, payload + value.encode())[0]
+        payload += struct.pack("<I", int(value)) if isinstance(current, int) else value.encode()
+        return self.request(SETTING_WRITE, payload)[0]
+
+    def blob_read(self):
+        blob = bytearray()
+        while True:
+            status, reply = self.request(BLOB_READ, struct.pack("<HH", len(blob), BLOB_CHUNK))
+            if status or len(reply) <= 2:
+                return bytes(blob)
+            blob += reply[2:]
+
+    def blob_write(self, blob):
+        for offset in range(0, len(blob), BLOB_CHUNK):
+            status = self.request(BLOB_WRITE, struct.pack("<H", offset) + blob[offset:offset + BLOB_CHUNK])[0]
+            if status:
+                return status
+        return self.request(BLOB_APPLY, struct.pack("<H", len(blob)))[0]
+
+
+def command_get(client, args):
+    status, value = client.get(args.setting)
+    if status:
+        sys.exit(STATUS.get(status, status))
+    print(value)
+
+
+def command_set(client, args):
+    print(STATUS.get(client.set(args.setting, args.value)))
+
+
+def command_blob_read(client, args):
+    blob = client.blob_read()
+    with open(args.file, "wb") as output:
+        output.write(blob)
+    print("%d bytes" % len(blob))
+
+
+def command_blob_write(client, args):
+    with open(args.file, "rb") as source:
+        print(STATUS.get(client.blob_write(source.read())))
+
+
+def command_bench(client, args):
+    payload = bytes(i & 0xFF for i in range(args.size))
+    start = time.time()
+    for _ in range(args.count):
+        status, echo = client.request(PING, payload)
+        if status or echo != payload:
+            sys.exit("corrupted echo")
+    elapsed = time.time() - start
+    print("%d round trips in %.2f s: %.1f frames/s, %.1f kB/s payload each way" %
+          (args.count, elapsed, args.count / elapsed, args.count * args.size / elapsed / 1000))
+
+    start = time.time()
+    blob = client.blob_read()
+    elapsed = time.time() - start
+    print("blob read: %d bytes in %.3f s" % (len(blob), elapsed))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", required=True)
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=2.0)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("get", help="read setting")
+    command.add_argument("setting")
+    command.set_defaults(handler=command_get)
+
+    command = commands.add_parser("set", help="write setting")
+    command.add_argument("setting")
+    command.add_argument("value")
+    command.set_defaults(handler=command_set)
+
+    command = commands.add_parser("blob-read", help="save configuration blob to file")
+    command.add_argument("file")
+    command.set_defaults(handler=command_blob_read)
+
+    command = commands.add_parser("blob-write", help="load configuration blob from file")
+    command.add_argument("file")
+    command.set_defaults(handler=command_blob_write)
+
+    command = commands.add_parser("bench", help="measure round trip throughput")
+    command.add_argument("--count", type=int, default=200)
+    command.add_argument("--size", type=int, default=256, help="ping payload size, at most 1023")
+    command.set_defaults(handler=command_bench)
+
+    args = parser.parse_args()
+    args.handler(Client(args.port, args.baud, args.timeout), args)
+
+
+if __name__ == "__main__":
+    main()
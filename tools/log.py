@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+#
+# File: log.py
+# Project: Klik
+# -----
+# This source code is released under BSD-3 license.
+# Check LICENSE file for full list of conditions and disclaimer.
+# -----
+# Copyright 2022 - 2023 M.Kusiak (timax)
+#
+
+"""
+Formats Klik deferred log dump ("LOG DUMP") with format strings taken from firmware ELF.
+
+Device stores only format string addresses and raw 32-bit arguments, so the ELF
+must be the one that's running. Dump can be read from a file (or stdin, when
+file is "-"), or straight from the device when --port is given (requires pyserial).
+
+    python3 tools/log.py build/klik.elf dump.txt
+    python3 tools/log.py build/klik.elf --port /dev/ttyACM0
+"""
+
+import argparse
+import re
+import struct
+import sys
+import time
+
+BEGIN = "LOG BEGIN"
+END = "LOG END"
+
+# Keep in sync with logModule_t in log.h.
+MODULES = ["TLS", "NET", "OTA"]
+LEVELS = ["OFF", "ERR", "WRN", "INF", "DBG"]
+
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+class Elf:
+    """Reads strings from loadable sections of ELF file, by their address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as file:
+            self.data = file.read()
+
+        if self.data[:4] != b"\x7fELF":
+            sys.exit("%s is not an ELF file" % path)
+
+        wide = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+
+        if wide:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            section = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            section = endian + "IIIIII"
+
+        self.sections = []
+        for i in range(shnum):
+            _, kind, flags, address, offset, size = struct.unpack_from(section, self.data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and kind != SHT_NOBITS and size:
+                self.sections.append((address, offset, size))
+
+    def string(self, address):
+        for start, offset, size in self.sections:
+            if start <= address < start + size:
+                begin = offset + address - start
+                end = self.data.find(b"\0", begin, offset + size)
+                if end < 0:
+                    return None
+                return self.data[begin:end].decode(errors="replace")
+        return None
+
+
+def format_record(elf, format_address, args):
+    text = elf.string(format_address)
+    if text is None:
+        return "<unknown format 0x%08x> %s" % (format_address, " ".join("%08x" % a for a in args))
+
+    args = list(args)
+
+    def convert(match):
+        flags, width, precision, _, conversion = match.groups()
+        if conversion == "%":
+            return "%"
+        if not args:
+            return "<missing>"
+
+        value = args.pop(0)
+        spec = "%" + flags + width + ("." + precision if precision else "")
+
+        if conversion in "di":
+            return (spec + "d") % (value - (1 << 32) if value & 0x80000000 else value)
+        if conversion in "ouxX":
+            return (spec + conversion.replace("u", "d")) % value
+        if conversion == "c":
+            return (spec + "c") % chr(value & 0xff)
+        if conversion == "p":
+            return "0x%08x" % value
+        string = elf.string(value)
+        return (spec + "s") % (string if string is not None else "<0x%08x>" % value)
+
+    return CONVERSION.sub(convert, text)
+
+
+def read_dump_lines(args):
+    if not args.port:
+        source = sys.stdin if args.dump == "-" else open(args.dump)
+        return source.read().splitlines()
+
+    import serial
+
+    lines = []
+    with serial.Serial(args.port, args.baud, timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        port.write(b"LOG DUMP\n")
+        deadline = time.time() + args.timeout
+        while time.time() < deadline:
+            line = port.readline().decode(errors="replace").strip()
+            if line:
+                lines.append(line)
+            if line == END:
+                break
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF file (build/klik.elf)")
+    parser.add_argument("dump", nargs="?", default="-", help="dump file, '-' for stdin")
+    parser.add_argument("--port", help="serial port to request the dump from")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=5.0)
+    args = parser.parse_args()
+
+    elf = Elf(args.elf)
+    inside = False
+    found = False
+
+    for line in read_dump_lines(args):
+        if line.startswith(BEGIN):
+            header = line[len(BEGIN):].split()
+            if len(header) > 1 and int(header[1]):
+                print("%s records dropped before this dump" % header[1])
+            inside = found = True
+            continue
+        if line == END:
+            break
+        if not inside:
+            continue
+
+        words = [int(word, 16) for word in line.split()]
+        header, timestamp, format_address = words[:3]
+        module = header >> 8 & 0xff
+        level = header >> 4 & 0x0f
+
+        print("%12.6f %-3s %s %s" % (
+            timestamp / 1e6,
+            MODULES[module] if module < len(MODULES) else str(module),
+            LEVELS[level] if level < len(LEVELS) else str(level),
+            format_record(elf, format_address, words[3:])))
+
+    if not found:
+        sys.exit("no log dump found")
+
+
+if __name__ == "__main__":
+    main()
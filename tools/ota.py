@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+#
+# File: ota.py
+# Project: Klik
+# -----
+# This source code is released under BSD-3 license.
+# Check LICENSE file for full list of conditions and disclaimer.
+# -----
+# Copyright 2022 - 2023 M.Kusiak (timax)
+#
+
+"""
+Builds and serves Klik firmware update images ("OTA BEGN <url>").
+
+Image is a header (with SHA-256 of the firmware), compressed length of every block,
+ECDSA P-256 signature of both, then the blocks. Every block is one flash sector
+of firmware, compressed on its own in LZ4 block format. Signing uses openssl.
+
+    openssl ecparam -name prime256v1 -genkey -noout -out ota_key.pem
+    python3 tools/ota.py key ota_key.pem        # prints cmake option with public key
+    python3 tools/ota.py build build/klik.bin ota_key.pem klik.ota
+    python3 tools/ota.py serve . --port 8443    # HTTPS with range requests, self-signed
+"""
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+
+# Keep in sync with ota.c and ota.h.
+IMAGE_MAGIC = 0x41544F4B
+IMAGE_FORMAT = 1
+HEADER = struct.Struct("<IBBHI32s")
+BLOCK_SIZE = 4096
+SLOT_SIZE = 0xF8000
+SIGNATURE_MAX = 72
+
+LZ4_MATCH_MIN = 4
+LZ4_LAST_LITERALS = 5
+LZ4_MATCH_LIMIT = 12
+
+
+def lz4_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4_sequence(out, literals, offset=0, match=0):
+    match_code = match - LZ4_MATCH_MIN if offset else 0
+    out.append(min(len(literals), 15) << 4 | min(match_code, 15))
+    if len(literals) >= 15:
+        lz4_length(out, len(literals) - 15)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if match_code >= 15:
+            lz4_length(out, match_code - 15)
+
+
+def lz4_compress(data):
+    """Greedy LZ4 block compression, good enough for firmware."""
+    out = bytearray()
+    table = {}
+    anchor = pos = 0
+    end = len(data)
+
+    while pos < end - LZ4_MATCH_LIMIT:
+        key = data[pos:pos + LZ4_MATCH_MIN]
+        candidate = table.get(key)
+        table[key] = pos
+
+        if candidate is None:
+            pos += 1
+            continue
+
+        length = LZ4_MATCH_MIN
+        while pos + length < end - LZ4_LAST_LITERALS and data[candidate + length] == data[pos + length]:
+            length += 1
+
+        lz4_sequence(out, data[anchor:pos], pos - candidate, length)
+        pos += length
+        anchor = pos
+
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def lz4_decompress(data, size):
+    out = bytearray()
+    pos = 0
+
+    while True:
+        token = data[pos]
+        pos += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                length += data[pos]
+                pos += 1
+                if data[pos - 1] != 255:
+                    break
+        out += data[pos:pos + length]
+        pos += length
+        if pos == len(data):
+            break
+
+        offset, = struct.unpack_from("<H", data, pos)
+        pos += 2
+        length = (token & 15) + LZ4_MATCH_MIN
+        if token & 15 == 15:
+            while True:
+                length += data[pos]
+                pos += 1
+                if data[pos - 1] != 255:
+                    break
+        for _ in range(length):
+            out.append(out[-offset])
+
+    if len(out) != size:
+        raise ValueError("block decompresses to %d bytes, %d expected" % (len(out), size))
+    return bytes(out)
+
+
+def openssl(*args, data=None):
+    result = subprocess.run(["openssl"] + list(args), input=data, capture_output=True)
+    if result.returncode:
+        sys.exit("openssl failed: %s" % result.stderr.decode().strip())
+    return result.stdout
+
+
+def public_key(key_path):
+    der = openssl("ec", "-in", key_path, "-pubout", "-outform", "DER")
+    # SubjectPublicKeyInfo of a P-256 key ends with the uncompressed point.
+    if len(der) != 91 or der[-65] != 4:
+        sys.exit("%s is not a P-256 key" % key_path)
+    return der[-65:]
+
+
+def build(image_path, key_path, output_path):
+    with open(image_path, "rb") as file:
+        image = file.read()
+
+    if not image or len(image) > SLOT_SIZE:
+        sys.exit("image must be 1 to %d bytes" % SLOT_SIZE)
+
+    blocks = [lz4_compress(image[i:i + BLOCK_SIZE]) for i in range(0, len(image), BLOCK_SIZE)]
+    for i, block in enumerate(blocks):
+        lz4_decompress(block, len(image[i * BLOCK_SIZE:(i + 1) * BLOCK_SIZE]))
+
+    signed = HEADER.pack(IMAGE_MAGIC, IMAGE_FORMAT, 0, len(blocks), len(image), hashlib.sha256(image).digest())
+    signed += b"".join(struct.pack("<H", len(block)) for block in blocks)
+
+    with tempfile.NamedTemporaryFile() as file:
+        file.write(signed)
+        file.flush()
+        signature = openssl("dgst", "-sha256", "-sign", key_path, file.name)
+
+    with open(output_path, "wb") as file:
+        file.write(signed)
+        file.write(bytes([len(signature)]) + signature.ljust(SIGNATURE_MAX, b"\xff"))
+        file.write(b"".join(blocks))
+
+    compressed = sum(len(block) for block in blocks)
+    print("%s: %d bytes in %d blocks, compressed to %d (%.0f%%)" % (
+        output_path, len(image), len(blocks), compressed, 100.0 * compressed / len(image)))
+
+
+class RangeHandler(http.server.SimpleHTTPRequestHandler):
+    """Serves files, with single byte ranges, the way device asks for them."""
+
+    RANGE = re.compile(r"bytes=(\d+)-(\d*)$")
+
+    def send_head(self):
+        match = self.RANGE.match(self.headers.get("Range", ""))
+        path = self.translate_path(self.path)
+
+        if not match or not os.path.isfile(path):
+            return super().send_head()
+
+        size = os.path.getsize(path)
+        first = int(match.group(1))
+        last = min(int(match.group(2)) if match.group(2) else size - 1, size - 1)
+
+        if first > last:
+            self.send_error(416)
+            return None
+
+        file = open(path, "rb")
+        file.seek(first)
+        self.send_response(206)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, size))
+        self.send_header("Content-Length", str(last - first + 1))
+        self.end_headers()
+        self.remaining = last - first + 1
+        return file
+
+    def copyfile(self, source, output):
+        remaining = getattr(self, "remaining", None)
+        if remaining is None:
+            return super().copyfile(source, output)
+        output.write(source.read(remaining))
+
+
+def serve(directory, port, cert, key):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+
+    with tempfile.TemporaryDirectory() as temporary:
+        if not cert:
+            cert = os.path.join(temporary, "cert.pem")
+            key = os.path.join(temporary, "key.pem")
+            openssl("req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+                    "-keyout", key, "-out", cert, "-days", "30", "-subj", "/CN=klik-ota")
+        context.load_cert_chain(cert, key)
+
+        handler = lambda *args: RangeHandler(*args, directory=directory)
+        server = http.server.ThreadingHTTPServer(("", port), handler)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+        print("serving %s on https://0.0.0.0:%d" % (os.path.abspath(directory), port))
+        server.serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    command = commands.add_parser("key", help="print public key as cmake option")
+    command.add_argument("key", help="private key (PEM, P-256)")
+
+    command = commands.add_parser("build", help="build signed, compressed update image")
+    command.add_argument("image", help="firmware binary (build/klik.bin)")
+    command.add_argument("key", help="private key (PEM, P-256)")
+    command.add_argument("output", help="update image")
+
+    command = commands.add_parser("serve", help="serve directory over HTTPS, with range requests")
+    command.add_argument("directory", nargs="?", default=".")
+    command.add_argument("--port", type=int, default=8443)
+    command.add_argument("--cert", help="certificate (PEM), self-signed one is made when missing")
+    command.add_argument("--cert-key", help="certificate key (PEM)")
+
+    args = parser.parse_args()
+
+    if args.command == "key":
+        print("-DOTA_PUBLIC_KEY=%s" % public_key(args.key).hex())
+    elif args.command == "build":
+        build(args.image, args.key, args.output)
+    elif args.command == "serve":
+        serve(args.directory, args.port, args.cert, args.cert_key)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# File: profile.py
+# Project: Klik
+# -----
+# This source code is released under BSD-3 license.
+# Check LICENSE file for full list of conditions and disclaimer.
+# -----
+# Copyright 2022 - 2023 M.Kusiak (timax)
+#
+
+"""
+Symbolises Klik sampling profiler dump ("PRF DUMP") against firmware ELF.
+
+Dump can be read from a file (or stdin, when file is "-"), or straight from
+the device when --port is given (requires pyserial).
+
+    python3 tools/profile.py build/klik.elf dump.txt
+    python3 tools/profile.py build/klik.elf --port /dev/ttyACM0
+"""
+
+import argparse
+import subprocess
+import sys
+import time
+from collections import Counter
+
+BEGIN = "PRF BEGIN"
+END = "PRF END"
+
+
+def read_dump_lines(args):
+    if not args.port:
+        source = sys.stdin if args.dump == "-" else open(args.dump)
+        return source.read().splitlines()
+
+    import serial
+
+    lines = []
+    with serial.Serial(args.port, args.baud, timeout=args.timeout) as port:
+        port.reset_input_buffer()
+        port.write(b"PRF DUMP\n")
+        deadline = time.time() + args.timeout
+        while time.time() < deadline:
+            line = port.readline().decode(errors="replace").strip()
+            if line:
+                lines.append(line)
+            if line == END:
+                break
+    return lines
+
+
+def parse_dump(lines):
+    header = None
+    samples = Counter()
+    inside = False
+
+    for line in lines:
+        if line.startswith(BEGIN):
+            header = line[len(BEGIN):].split()
+            inside = True
+            continue
+        if line == END:
+            break
+        if not inside:
+            continue
+        pc, count = line.split()
+        samples[int(pc, 16)] += int(count)
+
+    if header is None:
+        sys.exit("no profiler dump found")
+
+    return header, samples
+
+
+def symbolise(elf, addr2line, addresses):
+    addresses = sorted(addresses)
+    # addr2line with no addresses reads them from stdin
+    if not addresses:
+        return {}
+
+    output = subprocess.run(
+        [addr2line, "-f", "-C", "-e", elf] + ["%x" % a for a in addresses],
+        check=True, capture_output=True, text=True).stdout.splitlines()
+
+    symbols = {}
+    for i, address in enumerate(addresses):
+        function = output[2 * i]
+        location = output[2 * i + 1]
+        symbols[address] = (function, location)
+    return symbols
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF file (build/klik.elf)")
+    parser.add_argument("dump", nargs="?", default="-", help="dump file, '-' for stdin")
+    parser.add_argument("--port", help="serial port to request the dump from")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=5.0)
+    parser.add_argument("--addr2line", default="arm-none-eabi-addr2line")
+    parser.add_argument("--lines", action="store_true", help="report per source line instead of per function")
+    parser.add_argument("--top", type=int, default=30)
+    args = parser.parse_args()
+
+    header, samples = parse_dump(read_dump_lines(args))
+    rate, total, dropped, overflows = (header + ["0"] * 4)[:4]
+    symbols = symbolise(args.elf, args.addr2line, samples.keys())
+
+    report = Counter()
+    for address, count in samples.items():
+        function, location = symbols[address]
+        report[location if args.lines else function] += count
+
+    total = sum(report.values())
+    print("rate %s Hz, %d samples, %s dropped, %s ring overflows" % (rate, total, dropped, overflows))
+    for name, count in report.most_common(args.top):
+        print("%6.2f%% %8d  %s" % (100.0 * count / total, count, name))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# File: telemetry.py
+# Project: Klik
+# -----
+# This source code is released under BSD-3 license.
+# Check LICENSE file for full list of conditions and disclaimer.
+# -----
+# Copyright 2022 - 2023 M.Kusiak (timax)
+#
+
+"""
+Decodes Klik telemetry records (telemetry.h) to CSV.
+
+Records can be read from a raw serial capture (or stdin, when file is "-"),
+or straight from the device when --port is given (requires pyserial). With
+--period the stream is requested with SUBSCRIBE, otherwise it's expected to be
+enabled on the device already ("SET TELE <ms>").
+
+    python3 tools/telemetry.py --port /dev/ttyACM0 --period 100 > unit.csv
+    python3 tools/telemetry.py capture.bin > unit.csv
+"""
+
+import argparse
+import csv
+import struct
+import sys
+
+from klik_client import Client, SUBSCRIBE, TELEMETRY, decode_frame
+
+STATES = ("SETUP", "CONNECTING", "CONNECTION_ERROR", "REQUEST_ERROR", "WORKING")
+
+# Record layouts by version, fields in order.
+RECORDS = {
+    1: ("<BBbbIHHBHIIIII", ("version", "state", "rssi", "last_value", "time", "poll_latency", "request_errors",
+                          "servo_angle", "servo_pulse", "heap_high_water", "events_dropped", "serial_overruns",
+                          "serial_dropped", "frame_errors")),
+}
+FIELDS = max((fields for _, fields in RECORDS.values()), key=len)
+
+
+def decode_record(payload):
+    if not payload or payload[0] not in RECORDS:
+        return None
+    layout, fields = RECORDS[payload[0]]
+    if len(payload) < struct.calcsize(layout):
+        return None
+    record = dict(zip(fields, struct.unpack_from(layout, payload)))
+    if record["state"] < len(STATES):
+        record["state"] = STATES[record["state"]]
+    return record
+
+
+def capture_frames(data):
+    for encoded in data.split(b"\0"):
+        frame = decode_frame(encoded) if encoded else None
+        if frame:
+            yield frame
+
+
+def port_frames(args):
+    client = Client(args.port, args.baud, args.timeout)
+    if args.period:
+        client.send(SUBSCRIBE, struct.pack("<H", args.period))
+    try:
+        while True:
+            try:
+                yield client.receive()
+            except TimeoutError:
+                continue
+    finally:
+        if args.period:
+            client.send(SUBSCRIBE, struct.pack("<H", 0))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", nargs="?", default="-", help="raw serial capture, '-' for stdin")
+    parser.add_argument("--port", help="serial port to read the stream from")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=2.0)
+    parser.add_argument("--period", type=int, help="request the stream with this period, in miliseconds")
+    args = parser.parse_args()
+
+    if args.port:
+        frames = port_frames(args)
+    else:
+        source = sys.stdin.buffer if args.capture == "-" else open(args.capture, "rb")
+        frames = capture_frames(source.read())
+
+    writer = csv.DictWriter(sys.stdout, FIELDS, extrasaction="ignore")
+    writer.writeheader()
+    try:
+        for frame_type, _, payload in frames:
+            record = decode_record(payload) if frame_type == TELEMETRY else None
+            if record:
+                writer.writerow(record)
+                sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()